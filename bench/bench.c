@@ -0,0 +1,263 @@
+/*******************************************************************************
+ * bench.c
+ *
+ *  Description:
+ *      Microbenchmarks for the hot paths of smallsh. The shell is compiled
+ *      into this program directly so each path can be timed on its own:
+ *
+ *          expand       - getInputString() on lines needing expansion
+ *          parse        - getuserInputFromString() on short and long lines
+ *          parse_cached - parseCommand() on a line found in the parse cache
+ *          lex_*        - getuserInputFromString() on a long line of long and
+ *                         quoted words, with each version of lexScan()
+ *          spawn        - launchCommand() running /bin/true in the foreground
+ *          spawn_zygote - the same through a pool of 8 zygotes
+ *          reap         - background /bin/true jobs reaped by the event loop
+ *
+ *      Results are printed as one JSON object per line so runs of different
+ *      versions can be compared by a script.
+ *
+ *  Usage:
+ *      bench/bench [scale]     - scale multiplies every iteration count
+ ******************************************************************************/
+
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+#include <time.h>
+
+/*******************************************************************************
+ * nowNs()
+ *
+ *  Description:
+ *      Returns CLOCK_MONOTONIC in nanoseconds.
+ ******************************************************************************/
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * report()
+ *
+ *  Description:
+ *      Prints one result line.
+ ******************************************************************************/
+static void report(const char *name, size_t iterations, size_t bytes,
+                   uint64_t elapsedNs) {
+    double seconds = (double)elapsedNs / 1e9;
+    fprintf(stdout,
+            "{\"bench\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.1f,"
+            "\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.1f}\n",
+            name, iterations, (double)elapsedNs / (double)iterations,
+            (double)iterations / seconds, (double)bytes / seconds);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * benchExpand()
+ *
+ *  Description:
+ *      Feeds a batch script of lines containing $$ and $HOME through
+ *      getInputString().
+ ******************************************************************************/
+static void benchExpand(size_t iterations) {
+    const char *line =
+        "echo $$ some/path/$$/file.$$ > out.$$ < ${HOME}/in.$? plain words\n";
+    size_t lineLength = strlen(line);
+
+    FILE *script = tmpfile();
+    if (script == NULL) {
+        err(1, "tmpfile");
+    }
+    for (size_t i = 0; i < iterations; i++) {
+        fwrite(line, 1, lineLength, script);
+    }
+    fflush(script);
+
+    InputSource input;
+    if (openInputSource(&input, fileno(script)) != 0) {
+        err(1, "openInputSource");
+    }
+
+    size_t nLines = 0;
+    uint64_t start = nowNs();
+    while (getInputString(&input) != NULL) {
+        nLines++;
+    }
+    report("expand", nLines, nLines * lineLength, nowNs() - start);
+
+    fclose(script);
+}
+
+/*******************************************************************************
+ * benchParse()
+ *
+ *  Description:
+ *      Parses a line of `nTokens` arguments with redirections and a pipe,
+ *      through the parse cache if `cached` is set.
+ ******************************************************************************/
+static void benchParse(const char *name, size_t nTokens, size_t iterations,
+                       int cached) {
+    size_t capacity = nTokens * 8 + 64;
+    char *line = malloc(capacity);
+    if (line == NULL) {
+        err(1, "malloc");
+    }
+
+    size_t length = (size_t)sprintf(line, "cmd");
+    for (size_t i = 0; i < nTokens; i++) {
+        length += (size_t)sprintf(line + length, " arg%zu", i % 1000);
+    }
+    length += (size_t)sprintf(line + length, " < in | wc -l > out &");
+
+    Arena arena = {0};
+    uint64_t start = nowNs();
+    for (size_t i = 0; i < iterations; i++) {
+        UserInputStruct userInput = cached
+                                        ? parseCommand(line, &arena)
+                                        : getuserInputFromString(line, &arena);
+        if (!userInput.checkSum) {
+            errx(1, "parse failed");
+        }
+        arenaReset(&arena);
+    }
+    report(name, iterations, iterations * length, nowNs() - start);
+
+    free(arena.base);
+    free(line);
+}
+
+/*******************************************************************************
+ * benchLexer()
+ *
+ *  Description:
+ *      Parses a line of about 1 MB made of paths, quoted strings and escaped
+ *      blanks with lexScan() pointed at `scanner`, the scalar loop being the
+ *      byte at a time copy the parser did before.
+ ******************************************************************************/
+static void benchLexer(const char *name,
+                       const char *(*scanner)(const char *, const char *,
+                                              int),
+                       size_t iterations) {
+    static const char *pieces[] = {
+        "/usr/local/share/smallsh/some/rather/long/path/to/a/file.txt",
+        "'a single quoted string with a few words in it'",
+        "\"a double quoted one, with \\\"escapes\\\" inside\"",
+        "escaped\\ blank", "plain", "-o", "output.log"};
+    size_t nPieces = sizeof(pieces) / sizeof(pieces[0]);
+    size_t capacity = (1 << 20) + 256;
+    char *line = malloc(capacity);
+    if (line == NULL) {
+        err(1, "malloc");
+    }
+    size_t length = (size_t)sprintf(line, "cmd");
+    for (size_t i = 0; length < (1 << 20); i++) {
+        length += (size_t)sprintf(line + length, " %s", pieces[i % nPieces]);
+    }
+
+    lexScan = scanner;
+    Arena arena = {0};
+    uint64_t start = nowNs();
+    for (size_t i = 0; i < iterations; i++) {
+        UserInputStruct userInput = getuserInputFromString(line, &arena);
+        if (!userInput.checkSum) {
+            errx(1, "parse failed");
+        }
+        arenaReset(&arena);
+    }
+    report(name, iterations, iterations * length, nowNs() - start);
+    lexScan = lexScanSelect;
+
+    free(arena.base);
+    free(line);
+}
+
+/*******************************************************************************
+ * benchSpawn()
+ *
+ *  Description:
+ *      Times launching /bin/true in the foreground until it has been reaped.
+ ******************************************************************************/
+static void benchSpawn(const char *name, size_t iterations) {
+    UserInputStruct userInput =
+        getuserInputFromString("/bin/true", &commandArena);
+
+    uint64_t start = nowNs();
+    for (size_t i = 0; i < iterations; i++) {
+        launchCommand(userInput, "/bin/true");
+    }
+    report(name, iterations, 0, nowNs() - start);
+
+    arenaReset(&commandArena);
+}
+
+/*******************************************************************************
+ * benchReap()
+ *
+ *  Description:
+ *      Launches background /bin/true jobs and times how long it takes until
+ *      the event loop has reaped all of them through their pidfds and their
+ *      notices have been flushed to /dev/null.
+ ******************************************************************************/
+static void benchReap(size_t iterations) {
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    UserInputStruct userInput =
+        getuserInputFromString("/bin/true &", &commandArena);
+
+    uint64_t start = nowNs();
+    for (size_t i = 0; i < iterations; i++) {
+        launchCommand(userInput, "/bin/true &");
+    }
+    while (jobTable.nPids > 0) {
+        runEventLoop(-1);
+    }
+    noticeFlush();
+    uint64_t elapsed = nowNs() - start;
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    report("reap", iterations, 0, elapsed);
+    arenaReset(&commandArena);
+}
+
+int main(int argc, char *argv[]) {
+    size_t scale = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+    if (scale == 0) {
+        scale = 1;
+    }
+    if (setupEventLoop(-1) != 0) {
+        err(1, "setupEventLoop");
+    }
+    cacheShellPid();
+
+    benchExpand(200000 * scale);
+    benchParse("parse_short", 8, 1000000 * scale, 0);
+    benchParse("parse_long", 100000, 50 * scale, 0);
+    benchParse("parse_cached", 8, 1000000 * scale, 1);
+    benchLexer("lex_scalar", lexScanScalar, 100 * scale);
+#if defined(__x86_64__)
+    benchLexer("lex_sse2", lexScanSse2, 100 * scale);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        benchLexer("lex_avx2", lexScanAvx2, 100 * scale);
+    }
+#endif
+    benchSpawn("spawn", 2000 * scale);
+    setenv("SMALLSH_ZYGOTES", "8", 1);
+    zygotePoolStart();
+    benchSpawn("spawn_zygote", 2000 * scale);
+    zygotePoolStop();
+    benchReap(2000 * scale);
+
+    return 0;
+}
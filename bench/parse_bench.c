@@ -0,0 +1,242 @@
+/*******************************************************************************
+ * parse_bench.c
+ *
+ *  Description:
+ *      Stress test and throughput benchmark of the path every command line
+ *      takes before it is launched: getInputString() reading and expanding
+ *      it from a script, then getuserInputFromString() parsing it. Lines of
+ *      10 bytes to 10 MB are made of many short tokens, $$ occurrences,
+ *      redirections and pipes. The shell is compiled into this program
+ *      directly, and malloc, calloc and realloc are interposed to count the
+ *      allocations made on the way.
+ *
+ *      Each size prints one JSON object with lines/s, bytes/s and the
+ *      allocations per line once the reused buffers have grown. The program
+ *      fails, exiting with 1, if any size still allocates in that steady
+ *      state or if its throughput per byte falls far below the best size's,
+ *      as it would if the time per line grew faster than its length.
+ *
+ *  Usage:
+ *      bench/parse_bench [scale]   - scale multiplies the bytes parsed
+ ******************************************************************************/
+
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+#include <time.h>
+
+#define PARSE_BENCH_WARMUP 2        // lines parsed before counting starts
+#define PARSE_BENCH_BYTES (32 << 20) // per size, times the scale
+#define PARSE_BENCH_SLOWDOWN 4.0     // allowed bytes/s below the best size
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+static unsigned long nAllocations = 0;
+
+/*******************************************************************************
+ * malloc(), calloc(), realloc(), free()
+ *
+ *  Description:
+ *      Count every allocation made by the shell or by libc on its behalf,
+ *      and hand it to glibc's allocator.
+ ******************************************************************************/
+void *malloc(size_t size) {
+    nAllocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    nAllocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    nAllocations++;
+    return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer) {
+    __libc_free(pointer);
+}
+
+/*******************************************************************************
+ * nowNs()
+ *
+ *  Description:
+ *      Returns CLOCK_MONOTONIC in nanoseconds.
+ ******************************************************************************/
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * makeLine()
+ *
+ *  Description:
+ *      Builds a valid command line of about `size` bytes, ending in a
+ *      newline, out of short arguments, $$ expansions, < and > redirections
+ *      and | pipes.
+ *
+ *  Outputs:
+ *      Returns the malloc'd line, its length in *lineLength.
+ ******************************************************************************/
+static char *makeLine(size_t size, size_t *lineLength) {
+    static const char *pieces[] = {"arg", "$$",  "dir/$$/file", "<", "in.$$",
+                                   ">",   "out", "|",           "cmd"};
+    char *line = malloc(size + 64);
+    if (line == NULL) {
+        err(1, "malloc");
+    }
+
+    size_t length = (size_t)sprintf(line, "cmd");
+    for (size_t i = 0;; i++) {
+        const char *piece = pieces[i % (sizeof(pieces) / sizeof(pieces[0]))];
+        size_t pieceLength = strlen(piece);
+        if (length + 1 + pieceLength + 3 > size) {
+            break;
+        }
+        line[length++] = ' ';
+        memcpy(line + length, piece, pieceLength);
+        length += pieceLength;
+    }
+    // a word after a dangling <, > or | too
+    length += (size_t)sprintf(line + length, " x\n");
+
+    *lineLength = length;
+    return line;
+}
+
+/*******************************************************************************
+ * benchLines()
+ *
+ *  Description:
+ *      Writes a script holding copies of a line of about `size` bytes and
+ *      reads, expands and parses it back.
+ *
+ *  Outputs:
+ *      Returns the bytes parsed per second once warmed up, and sets *failed
+ *      if the steady state allocated.
+ ******************************************************************************/
+static double benchLines(size_t size, size_t scale, int *failed) {
+    size_t lineLength;
+    char *line = makeLine(size, &lineLength);
+    size_t nLines = PARSE_BENCH_BYTES * scale / lineLength;
+    if (nLines > 200000 * scale) {
+        nLines = 200000 * scale;
+    }
+    if (nLines < PARSE_BENCH_WARMUP + 4) {
+        nLines = PARSE_BENCH_WARMUP + 4;
+    }
+
+    FILE *script = tmpfile();
+    if (script == NULL) {
+        err(1, "tmpfile");
+    }
+    for (size_t i = 0; i < nLines; i++) {
+        if (fwrite(line, 1, lineLength, script) != lineLength) {
+            err(1, "fwrite");
+        }
+    }
+    fflush(script);
+    free(line);
+
+    InputSource input;
+    if (openInputSource(&input, fileno(script)) != 0) {
+        err(1, "openInputSource");
+    }
+
+    Arena arena = {0};
+    size_t nParsed = 0;
+    size_t bytes = 0;
+    unsigned long allocationsBefore = 0;
+    uint64_t start = 0;
+    char *expanded;
+    while ((expanded = getInputString(&input)) != NULL) {
+        if (nParsed == PARSE_BENCH_WARMUP) {
+            allocationsBefore = nAllocations;
+            start = nowNs();
+        }
+        UserInputStruct userInput = getuserInputFromString(expanded, &arena);
+        if (!userInput.checkSum || userInput.argc == 0) {
+            errx(1, "%zu byte line: parse failed", size);
+        }
+        arenaReset(&arena);
+        if (nParsed >= PARSE_BENCH_WARMUP) {
+            bytes += lineLength;
+        }
+        nParsed++;
+    }
+    uint64_t elapsed = nowNs() - start;
+    unsigned long allocations = nAllocations - allocationsBefore;
+    if (nParsed != nLines) {
+        errx(1, "%zu byte line: read %zu of %zu lines", size, nParsed,
+             nLines);
+    }
+
+    size_t nTimed = nParsed - PARSE_BENCH_WARMUP;
+    double seconds = (double)elapsed / 1e9;
+    double bytesPerSecond = (double)bytes / seconds;
+    double allocationsPerLine = (double)allocations / (double)nTimed;
+    fprintf(stdout,
+            "{\"bench\":\"parse_%zu\",\"line_bytes\":%zu,\"lines\":%zu,"
+            "\"lines_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+            "\"allocs_per_line\":%.3f}\n",
+            size, lineLength, nTimed, (double)nTimed / seconds,
+            bytesPerSecond, allocationsPerLine);
+    fflush(stdout);
+    if (allocations > 0) {
+        fprintf(stderr, "parse_%zu: %lu allocations in %zu lines after "
+                        "warming up\n",
+                size, allocations, nTimed);
+        *failed = 1;
+    }
+
+    free(arena.base);
+    fclose(script);
+    return bytesPerSecond;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = {10,     100,     1000,    10000,
+                                   100000, 1000000, 10000000};
+    size_t nSizes = sizeof(sizes) / sizeof(sizes[0]);
+    size_t scale = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+    if (scale == 0) {
+        scale = 1;
+    }
+    if (setupEventLoop(-1) != 0) {
+        err(1, "setupEventLoop");
+    }
+    cacheShellPid();
+
+    int failed = 0;
+    double bytesPerSecond[sizeof(sizes) / sizeof(sizes[0])];
+    // short lines are dominated by the cost per line, only lines of 1000
+    // bytes and more are expected to run at about the same bytes/s
+    double best = 0;
+    for (size_t i = 0; i < nSizes; i++) {
+        bytesPerSecond[i] = benchLines(sizes[i], scale, &failed);
+        if (sizes[i] >= 1000 && bytesPerSecond[i] > best) {
+            best = bytesPerSecond[i];
+        }
+    }
+
+    for (size_t i = 0; i < nSizes; i++) {
+        if (sizes[i] >= 1000 &&
+            bytesPerSecond[i] * PARSE_BENCH_SLOWDOWN < best) {
+            fprintf(stderr,
+                    "parse_%zu: %.1f bytes/s, more than %.0fx below the "
+                    "best of %.1f\n",
+                    sizes[i], bytesPerSecond[i], PARSE_BENCH_SLOWDOWN, best);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+# spawn_rate.sh - measures how many `true` commands per second smallsh can
+# launch and reap.
+#
+# Usage: bench/spawn_rate.sh [path/to/smallsh] [iterations]
+#
+# The shell is run under setsid so that its exit-time cleanup can not signal
+# the calling process group.
+
+SHELL_BIN=${1:-./smallsh}
+ITERATIONS=${2:-5000}
+
+INPUT=$(mktemp)
+trap 'rm -f "$INPUT"' EXIT
+
+i=0
+while [ "$i" -lt "$ITERATIONS" ]; do
+    echo "true"
+    i=$((i + 1))
+done >"$INPUT"
+echo "exit" >>"$INPUT"
+
+START=$(date +%s%N)
+setsid "$SHELL_BIN" <"$INPUT" >/dev/null 2>&1
+END=$(date +%s%N)
+
+ELAPSED_NS=$((END - START))
+echo "$ITERATIONS commands in $((ELAPSED_NS / 1000000)) ms:" \
+    "$((ITERATIONS * 1000000000 / ELAPSED_NS)) commands/s"
@@ -0,0 +1,76 @@
+#!/bin/sh
+# trace_percentiles.sh - turns a SMALLSH_TRACE log into latency percentiles
+# for each step of a command.
+#
+# Usage: bench/trace_percentiles.sh [trace.jsonl ...]
+#
+# Steps, in microseconds:
+#   expand   - line read to variables expanded
+#   parse    - expanded to parsed
+#   dispatch - parsed to the first stage being launched
+#   launch   - first stage launched to every stage exec'd
+#   run      - every stage exec'd to the last process reaped
+#   total    - line read to the command done, builtins included
+#
+# A step is left out of a record when either end of it is null.
+
+awk '
+function field(name,    start) {
+    if (!match($0, "\"" name "\":[0-9]+")) {
+        return ""
+    }
+    start = RSTART + length(name) + 3
+    return substr($0, start, RSTART + RLENGTH - start)
+}
+function step(name, from, to) {
+    if (from != "" && to != "") {
+        printf "%s %.3f\n", name, (to - from) / 1000
+    }
+}
+{
+    read = field("read")
+    expand = field("expand")
+    parse = field("parse")
+    spawn = field("spawn")
+    exec = field("exec")
+    reap = field("reap")
+    step("expand", read, expand)
+    step("parse", expand, parse)
+    step("dispatch", parse, spawn)
+    step("launch", spawn, exec)
+    step("run", exec, reap)
+    step("total", read, reap)
+}
+' "$@" | sort -k1,1 -k2,2n | awk '
+# nearest rank percentile of the n sorted values
+function percentile(p,    rank) {
+    rank = int(n * p + 0.999999)
+    if (rank < 1) {
+        rank = 1
+    }
+    return values[rank]
+}
+function report() {
+    if (n == 0) {
+        return
+    }
+    printf "%-8s %7d %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, n,
+        percentile(0.50), percentile(0.90), percentile(0.99),
+        percentile(0.999), values[n]
+}
+BEGIN {
+    printf "%-8s %7s %10s %10s %10s %10s %10s\n", "step", "count",
+        "p50 us", "p90 us", "p99 us", "p99.9 us", "max us"
+}
+$1 != name {
+    report()
+    name = $1
+    n = 0
+}
+{
+    values[++n] = $2
+}
+END {
+    report()
+}
+'
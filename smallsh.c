@@ -11,26 +11,117 @@
  * Author: Joe Maurer
  *
  * Description: This is a shell program, written in C. Contains built in
- * support for 3 commands:
+ * support for the following commands:
  *
  *  cd          - change directory
- *  status      - provides the exit status of the program, or last child if any
- *                have been terminated.
+ *  status [-v] - provides the exit status of the program, or last child if any
+ *                have been terminated. -v adds its wall, user and system time
+ *                and peak memory.
+ *  time command
+ *              - run command and report its wall, user and system time and
+ *                the peak memory of its processes on stderr.
+ *  on CPUS, nice N, ionice CLASS command
+ *              - run command pinned to CPUS (a list like 0-3,8), with its nice
+ *                value raised by N or in I/O class CLASS (idle, be[:0-7] or
+ *                rt[:0-7]). The prefixes combine in any order after time.
+ *  bgpolicy [none | [on CPUS] [nice N] [ionice CLASS]]
+ *              - show, clear or set the policy every & job starts from.
+ *  hash        - list, clear (-r) or pre-warm (hash name ...) the table of
+ *                command locations resolved from $PATH, with hit/miss counts.
+ *  stats [-r]  - show the hit rate and memory use of the cache of parsed
+ *                command lines, or empty it (-r), and the use of the
+ *                zygote pool.
+ *  jobs        - list background jobs with their state, run time and command.
+ *  fg [%n]     - continue a job in the foreground and wait for it.
+ *  bg [%n]     - continue a stopped job in the background.
+ *  wait [%n]   - wait for the given jobs, or for all of them printing each
+ *                job's exit status.
+ *  kill [-SIG] %n|pid
+ *              - send a signal (default SIGTERM) to a job or process.
+ *  parallel [-j N] [-k] command [arg ...] ::: value ... | < file
+ *              - run command once per value, N at a time (default: one per
+ *                CPU), with {} replaced by the value. Outputs are printed
+ *                whole as each finishes, in value order with -k, followed by
+ *                a summary of the failures.
+ *  xargs [-0] [-n N] [-P N] command [arg ...] [< file]
+ *              - run command with the blank (NUL with -0) separated items of
+ *                file, or of stdin when it is not the script, appended, as
+ *                many per command as ARG_MAX allows or N with -n, N commands
+ *                at a time with -P. Status 123 if any failed, 125 if any was
+ *                killed.
+ *  echo [-n], printf format [arg ...], test expr, [ expr ], true, false, pwd
+ *              - run inside the shell, without a fork, when they are a single
+ *                foreground command; in a pipeline or with & the utility on
+ *                $PATH runs instead.
  *  exit/quit   - terminates the shell program and any child processes (hotkey:
  *                ctrl^\) foreground and background.
  *
  * Any other commands are handled by a call to an exec() function with provided
- * arguments. Shell supports input/output redirection as well as optional
- * background execution (&).
+ * arguments. Shell supports input/output redirection, here-docs (<<word, read
+ * up to a line holding only word) and here-strings (<<<word), pipelines (|)
+ * as well as optional background execution (&).
  *
  * Command syntax:
  *
- *  command [arg1 arg2 ...] [< input_file] [> output_file] [&]
+ *  command [arg1 arg2 ...] [< input_file | <<word | <<<word] [> output_file]
+ *          [| command [arg1 ...] [< input_file] [> output_file] ...] [&]
+ *
+ * Words are separated by blanks (spaces or tabs). Within single quotes every
+ * character is literal. Within double quotes $$ and $VAR are still
+ * expanded and a backslash only escapes ", \, $ and `, while outside of
+ * quotes it escapes any character. Quoted operators such as "|" or '<' are
+ * plain arguments.
  *
  * Instructions:
  *
- * Compile with
- *  gcc -std=c99 -Wall -o smallsh smallsh.c -lm
+ * Compile with make, or directly with
+ *  gcc -std=c99 -Wall -o smallsh smallsh.c
+ *
+ * make test runs the scripts in tests/ through smallsh in batch mode and
+ * compares their output with the .out file next to each.
+ *
+ * make bench runs the microbenchmarks in bench/ and writes their results as
+ * JSON lines to bench_output.txt. It fails if bench/parse_bench finds that
+ * reading, expanding and parsing lines of 10 bytes to 10 MB still allocates
+ * once its buffers have grown, or slows down per byte as lines get longer.
+ *
+ * Run ./smallsh for an interactive prompt. The prompt has a line editor with
+ * emacs style keys, up/down to browse earlier commands and ctrl^r to search
+ * them, and tab to complete commands on $PATH and file names. Commands are
+ * kept in ~/.smallsh_history, or the file named by $SMALLSH_HISTORY (empty to
+ * keep none). Given a script argument, or when stdin is not a terminal,
+ * commands are read in batch mode without the prompt or banner and the shell
+ * exits with the status of the last command:
+ *
+ *  ./smallsh script.sh
+ *  generate-commands | ./smallsh
+ *
+ * ./smallsh -c 'command line' runs a string of one or more lines the same
+ * way, so smallsh can be the SHELL of make and other task runners. When
+ * the last command is not a builtin and runs in the foreground on its own,
+ * untimed and untraced, with no background jobs and nothing after it, the
+ * shell execs it in place of forking, so the caller waits for the command
+ * itself and gets its pid and exit status.
+ *
+ * Run ./smallsh --server path to serve command lines over a UNIX domain socket
+ * instead. The shell starts once and runs the commands of any number of
+ * clients concurrently, each request being a SOCK_SEQPACKET message holding
+ * one command line and, optionally, an fd passed with SCM_RIGHTS for its
+ * stdin. The reply is a struct ServerReply (wait status, exit code, wall, user
+ * and system time, peak memory) with memfds of the command's stdout and stderr
+ * passed along. SIGTERM, ctrl^c or ctrl^\ stop the server once the commands
+ * still running have been terminated and replied to.
+ *
+ * Set SMALLSH_ZYGOTES=N to keep up to N (at most 64) children forked ahead of
+ * time by a helper process. A command launched through one is only sent its
+ * argv, fds and working directory and execs at once, and the pool is refilled
+ * in the background. stats shows how often one was ready.
+ *
+ * Set SMALLSH_TRACE=file to append a JSON line to file for every command, with
+ * the monotonic times at which it was read, expanded, parsed, launched,
+ * exec'd and reaped, its pid, exit status and resource usage. Records are
+ * buffered and written in blocks. bench/trace_percentiles.sh file prints the
+ * latency percentiles of each step.
  *
  */
 
@@ -40,15 +131,34 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <math.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 /*******************************************************************************
  * Structures
  *
@@ -56,500 +166,7795 @@
 struct UserInputStruct // struct to hold payload for command
 {
     char **argv; // must terminated with a NULL pointer for exec
-    char *inputDestination_ptr;
-    char *outputDestination_ptr;
-    int *runInBackground;
-    int *checkSum;
+    size_t argc;
+    char *inputDestination_ptr;  // NULL when stdin is not redirected
+    char *outputDestination_ptr; // NULL when stdout is not redirected
+    char *inputDocument_ptr;     // here-doc or here-string fed to stdin
+    size_t inputDocumentLength;
+    char *hereDocDelimiter_ptr; // <<word whose body has not been read yet
+    int runInBackground;
+    int checkSum; // 1 once the whole line has been parsed
+    struct UserInputStruct *next; // next stage of a pipeline, or NULL
 };
 typedef struct UserInputStruct UserInputStruct;
 
-// do not look at these
-int currentStatus = 0;
-int fgOnly = 0;
-int control_var = 1;
-sig_atomic_t quit = 0;
+struct ResourceUsage // what a command cost, summed over its processes
+{
+    struct timespec wall; // elapsed CLOCK_MONOTONIC time
+    struct timeval user;
+    struct timeval system;
+    long maxRss; // largest resident set of any process, in KiB
+};
+typedef struct ResourceUsage ResourceUsage;
 
-/******************************************************************************
- * Signal handlers
- *
- ******************************************************************************/
-void handle_SIGCHLD(int signo, siginfo_t *siginfo, void *ucontext) {
-    pid_t spawnpid;
+enum JobState { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct TraceRecord // when each step of a command happened, 0 if it did not
+{
+    unsigned long sequence; // numbers the commands read, from 1
+    int64_t read;   // CLOCK_MONOTONIC nanoseconds
+    int64_t expand;
+    int64_t parse;
+    int64_t spawn;  // the first stage is about to be launched
+    int64_t exec;   // every stage was launched, and has exec'd unless forked
+    int64_t reap;   // the last process was reaped, or the builtin returned
+    int background;
+};
+typedef struct TraceRecord TraceRecord;
+
+struct Trace // SMALLSH_TRACE, one JSON line per command
+{
+    int fd;       // -1 when tracing is off
+    char *buffer; // records not written out yet
+    size_t length;
+    unsigned long sequence;
+    TraceRecord current; // the command being run
+};
+typedef struct Trace Trace;
+
+struct Job // background pipeline launched by the shell
+{
+    int inUse;
+    int nextFree;   // index of the next free slot while unused
+    pid_t *pids;    // every stage of the pipeline, in order
+    int *pidfds;    // pidfd watching each stage, -1 once reaped or if none
+    size_t nPids;
+    size_t nRunning; // stages not reaped yet
+    int status;      // wait status of the last stage once reaped
+    enum JobState state;
+    struct timespec startTime;
+    ResourceUsage usage; // of the stages reaped so far
+    char *commandLine;   // stored in the same block as pids
+    TraceRecord trace;   // written once the job is done
+};
+typedef struct Job Job;
+
+struct PidSlot // open addressing entry mapping a running pid to its job
+{
+    pid_t pid; // 0 when empty
+    int jobIndex;
+};
+typedef struct PidSlot PidSlot;
+
+struct DoneJob // a job removed once done, kept for a later wait
+{
+    int id;
+    pid_t pid; // of the last stage
     int status;
-    while ((spawnpid = waitpid(-1, &status, WNOHANG)) > 0) {
-        currentStatus = status;
-        char *message = "\nBackground process (";
-        write(STDOUT_FILENO, message, 21);
+};
+typedef struct DoneJob DoneJob;
 
-        int digit = 0;
+#define JOB_DONE_KEPT 64 // statuses kept, the oldest is dropped first
 
-        int tempPid = 0;
-        tempPid = (int)spawnpid;
+struct JobTable // jobs by id (slot index + 1) and by pid
+{
+    Job *jobs;
+    size_t capacity;
+    int freeList; // -1 when no slot below capacity is free
+    size_t nJobs;
+    PidSlot *pidSlots;
+    size_t pidCapacity; // power of two
+    size_t nPids;
+    int waited; // slot waitForJob() is waiting for, -1 if none
+    DoneJob done[JOB_DONE_KEPT];
+    size_t nDone;
+};
+typedef struct JobTable JobTable;
 
-        size_t nDigits =
-            floor(log10(abs(tempPid))) +
-            1; // I found this here: https://stackoverflow.com/a/3068420
-        char pidChar[nDigits];
+#define EVENT_INPUT 1   // the input fd is readable
+#define EVENT_SIGNAL 2  // the signalfd is readable
+#define EVENT_CHILD 3   // a pidfd is readable, the value is the child's pid
+#define EVENT_PATH 4    // a directory on $PATH changed
+#define EVENT_ACCEPT 5  // the --server socket has a connection waiting
+#define EVENT_REQUEST 6 // a --server client is readable, the value is its slot
 
-        size_t count = 1;
-        while (tempPid > 0) {
-            digit = tempPid % 10;
-            tempPid = tempPid / 10;
-            pidChar[nDigits - count] = (char)(digit + 48);
-            count++;
-        }
+struct EventLoop // single epoll instance driving the shell
+{
+    int epollFd;
+    int signalFd;
+    int inputFd;       // fd watched for command input, -1 if none
+    int inputReady;    // set when inputFd became readable
+    int interrupted;   // set by SIGINT, cleared by whoever waits for it
+    size_t nUnwatched; // background children without a pidfd
+    struct rlimit fileLimit; // RLIMIT_NOFILE the shell was started with
+    int fileLimitRaised;     // set once pidfds needed more than that
+    sigset_t ignoredSignals; // handled signals ignored when the shell started
+};
+typedef struct EventLoop EventLoop;
 
-        write(STDOUT_FILENO, pidChar, nDigits);
+#define NOTICE_SLOTS 1024 // power of two
+#define NOTICE_LENGTH 96
+struct NoticeRing // single producer, single consumer queue of job notices
+{
+    char text[NOTICE_SLOTS][NOTICE_LENGTH];
+    size_t length[NOTICE_SLOTS];
+    size_t head; // next slot the producer fills, only it stores here
+    size_t tail; // next slot the consumer prints, only it stores here
+};
+typedef struct NoticeRing NoticeRing;
 
-        char *message2 = ") is done: ";
-        write(STDOUT_FILENO, message2, 11);
+#define OUTPUT_PENDING -2 // the task has not finished yet
+struct ParallelTask // command started by a scheduler and not reaped yet
+{
+    pid_t pid;    // 0 while the slot is free
+    int pidfd;    // -1 if the child is polled on SIGCHLD instead
+    int output;   // memfd capturing its stdout, -1 if not captured
+    size_t index; // order the task was started in
+};
+typedef struct ParallelTask ParallelTask;
 
-        int tempStatus;
+struct Scheduler // runs commands with at most maxRunning alive at a time
+{
+    int epollFd;
+    size_t maxRunning;
+    size_t nRunning;
+    ParallelTask *running; // maxRunning slots
+    size_t *freeSlots;     // stack of unused slots in running
+    size_t nFree;
+    int keepOrder; // print outputs in start order instead of finish order
+    int outputFd;  // where captured outputs are copied to
+    int *outputs;  // memfd of each finished task waiting to be printed
+    int *statuses; // wait status of each task
+    size_t nTasks;
+    size_t tasksCapacity;
+    size_t nextOutput; // task printed next when keepOrder is set
+    size_t nFailed;
+    ResourceUsage usage; // of every task reaped so far
+};
+typedef struct Scheduler Scheduler;
 
-        if (WIFEXITED(status)) {
-            char *message3 = "exit value ";
-            write(STDOUT_FILENO, message3, 11);
+struct ServerReply // sent back for every command run by --server
+{
+    int32_t status;   // wait status of the last stage
+    int32_t exitCode; // exit status, or 128 + the signal that killed it
+    int64_t wallNs;
+    int64_t userUs;
+    int64_t systemUs;
+    int64_t maxRssKb;
+};
+typedef struct ServerReply ServerReply;
 
-            tempStatus = WEXITSTATUS(status);
-        } else if (WIFSIGNALED(status)) {
-            char *message3 = "terminated by signal ";
-            write(STDOUT_FILENO, message3, 21);
-            tempStatus = WTERMSIG(status);
-        }
+struct ServerClient // connection to --server and the command it is running
+{
+    int socket; // -1 while the slot is free
+    int busy;   // a command is running, further requests wait
+    int hungUp; // the client went away, nothing is sent back
+    pid_t *pids;
+    int *pidfds;
+    size_t nPids;
+    size_t pidsCapacity;
+    size_t nRunning;
+    pid_t lastPid;
+    int status;
+    int output; // memfds capturing stdout and stderr
+    int error;
+    struct timespec start;
+    ResourceUsage usage;
+};
+typedef struct ServerClient ServerClient;
 
-        count = 1;
-        digit = 0;
-        if (tempStatus < 10) {
-            char statusChar[] = {(char)(status + 48)};
-            write(STDOUT_FILENO, statusChar, (size_t)1);
-        } else {
-            nDigits = floor(log10(abs(tempStatus))) + 1;
+struct Server // state of smallsh --server
+{
+    int epollFd;
+    int listenFd;
+    ServerClient *clients;
+    size_t capacity;
+    size_t nBusy;
+};
+typedef struct Server Server;
 
-            char statusChar[nDigits];
+#define IOPRIO_CLASS_SHIFT 13 // from linux/ioprio.h
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+struct LaunchPolicy // where and how eagerly a child runs, set before its exec
+{
+    int hasCpus;
+    cpu_set_t cpus; // sched_setaffinity()
+    int hasNice;
+    int nice;   // added to the inherited nice value, like nice(1)
+    int ioprio; // ioprio_set() value, or -1 to inherit
+};
+typedef struct LaunchPolicy LaunchPolicy;
 
-            while (tempStatus > 0) {
-                digit = tempStatus % 10;
-                tempStatus = tempStatus / 10;
-                statusChar[nDigits - count] = (char)(digit + 48);
-                count++;
-            }
-            write(STDOUT_FILENO, statusChar, nDigits);
-        }
+struct ZygoteRequest // what a zygote is sent to exec, followed by the strings
+{
+    int32_t background; // SIGINT stays blocked, like spawnCommand() does
+    int32_t argc;       // the path to exec comes first, then argc arguments
+    LaunchPolicy policy;
+};
+typedef struct ZygoteRequest ZygoteRequest;
 
-        if (WIFEXITED(status)) {
-            char *message4 = "\n";
-            write(STDOUT_FILENO, message4, 2);
-        } else {
-            char *message4 = "\n";
-            write(STDOUT_FILENO, message4, 1);
-        }
+struct ZygotePool // pre-forked children waiting to exec a command
+{
+    int factoryFd; // connection to the process forking the zygotes, or -1
+    pid_t factoryPid;
+    pid_t *pids;   // zygotes ready to use, newest last
+    int *sockets;  // connection to each of them
+    size_t nReady;
+    size_t size;   // SMALLSH_ZYGOTES
+    unsigned long launches;
+    unsigned long fallbacks; // no zygote was ready
+};
+typedef struct ZygotePool ZygotePool;
+
+struct InputSource // where command lines come from
+{
+    int fd;
+    int interactive; // prompt and banner are only shown on a terminal
+    char *map;       // script contents when the input could be mmap'd
+    size_t mapLength;
+    size_t mapOffset;
+    char *buffer; // read() buffer when the input is a terminal or a pipe
+    size_t bufferStart;
+    size_t bufferEnd;
+    size_t bufferCapacity;
+    char *line; // reused for every line handed to the parser
+    size_t lineCapacity;
+    char *expansion; // reused for the $$ expanded copy of the line
+    size_t expansionCapacity;
+    char *documents; // reused for the command line and its here-doc bodies
+    size_t documentsCapacity;
+    int atEof;
+};
+typedef struct InputSource InputSource;
+
+struct History // commands typed at the prompt, newest first
+{
+    int fd;         // history file, opened for appending, -1 if none
+    char *map;      // the file as it was at startup
+    size_t mapLength;
+    uint32_t *offsets; // starts of the lines of map indexed so far
+    size_t nOffsets;
+    size_t offsetsCapacity;
+    size_t scanEnd; // map is only indexed from here on
+    char *session;  // lines added since startup, \0 terminated
+    size_t sessionLength;
+    size_t sessionCapacity;
+    uint32_t *sessionOffsets;
+    size_t nSession;
+    size_t sessionOffsetsCapacity;
+};
+typedef struct History History;
+
+struct LineEditor // state kept between prompts by the line editor
+{
+    struct termios savedMode; // restored whenever the editor is not reading
+    char *draft;              // line being typed while browsing history
+    size_t draftCapacity;
+    size_t draftLength;
+    char *screen; // each refresh is built here and written at once
+    size_t screenCapacity;
+};
+typedef struct LineEditor LineEditor;
+
+struct CommandIndex // sorted names of every executable on $PATH
+{
+    uint32_t *names; // offsets into text
+    size_t nNames;
+    size_t namesCapacity;
+    char *text; // the names, \0 terminated
+    size_t textLength;
+    size_t textCapacity;
+    char *pathSnapshot; // $PATH the index was built from, NULL if never
+    int inotifyFd;      // watches every directory on $PATH
+    int stale;          // set by the event loop when one of them changed
+};
+typedef struct CommandIndex CommandIndex;
+
+struct linux_dirent64 // record returned by getdents64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define DIRECTORY_BUFFER_SIZE (64 * 1024)
+struct DirectoryReader // reads a directory in large getdents64 batches
+{
+    int fd;
+    size_t position;
+    size_t end;
+    char buffer[DIRECTORY_BUFFER_SIZE];
+};
+typedef struct DirectoryReader DirectoryReader;
+
+struct Arena // bump allocator holding everything parsed out of one command
+{
+    char *base;
+    size_t used;
+    size_t capacity;
+};
+typedef struct Arena Arena;
+
+struct CommandHashEntry // resolved location of a command found on $PATH
+{
+    struct CommandHashEntry *next;
+    unsigned long hits;
+    char *name;
+    char *path; // absolute path handed to execve, stored after name
+};
+typedef struct CommandHashEntry CommandHashEntry;
+
+#define COMMAND_HASH_BUCKETS 64
+struct CommandHash // table of commands resolved since $PATH last changed
+{
+    CommandHashEntry *buckets[COMMAND_HASH_BUCKETS];
+    char *pathSnapshot; // value of $PATH the entries were resolved against
+    unsigned long hits;
+    unsigned long misses;
+};
+typedef struct CommandHash CommandHash;
+
+struct ParseCacheEntry // parsed command kept for a line that may come again
+{
+    struct ParseCacheEntry *next;   // in the same bucket
+    struct ParseCacheEntry *newer;  // towards the most recently used
+    struct ParseCacheEntry *older;  // towards the next one to be evicted
+    size_t hash;
+    size_t size; // of the whole block holding the entry
+    char *line;  // stored after the parsed command in the same block
+    UserInputStruct parsed;
+};
+typedef struct ParseCacheEntry ParseCacheEntry;
+
+#define PARSE_CACHE_BUCKETS 512
+#define PARSE_CACHE_ENTRIES 256
+#define PARSE_CACHE_LINE_MAX 4096 // longer lines are parsed every time
+struct ParseCache // bounded LRU cache of parsed command lines
+{
+    ParseCacheEntry *buckets[PARSE_CACHE_BUCKETS];
+    ParseCacheEntry *newest;
+    ParseCacheEntry *oldest;
+    size_t nEntries;
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+};
+typedef struct ParseCache ParseCache;
+
+// do not look at these
+int currentStatus = 0;
+int fgOnly = 0;
+int control_var = 1;
+sig_atomic_t quit = 0;
+CommandHash commandHash = {{0}};
+ParseCache parseCache = {{0}};
+ZygotePool zygotePool = {-1, -1, NULL, NULL, 0, 0, 0, 0};
+const LaunchPolicy noLaunchPolicy = {0, {{0}}, 0, 0, -1};
+LaunchPolicy launchPolicy = {0, {{0}}, 0, 0, -1}; // for the current command
+LaunchPolicy backgroundPolicy = {0, {{0}}, 0, 0, -1}; // & jobs, see bgpolicy
+Arena commandArena = {0};
+JobTable jobTable = {NULL, 0, -1, 0, NULL, 0, 0, -1, {{0}}, 0};
+EventLoop eventLoop = {-1, -1, -1, 0, 0, 0};
+NoticeRing noticeRing; // zeroed as a global
+char shellPid[24];     // $$, formatted once by cacheShellPid()
+size_t shellPidLength = 0;
+pid_t lastBackgroundPid = 0; // $!
+int scriptOnStdin = 0; // batch lines come from stdin, builtins must not read it
+History history = {-1};
+LineEditor lineEditor; // zeroed as a global
+CommandIndex commandIndex = {NULL, 0, 0, NULL, 0, 0, NULL, -1, 0};
+ResourceUsage lastUsage = {{0}};  // reported by status -v
+ResourceUsage timedUsage = {{0}}; // foreground children since time started
+Trace trace = {-1};
+
+/******************************************************************************
+ * Resource usage
+ *
+ * Children are reaped with wait4() so their CPU time and peak memory are
+ * kept. A command's usage is the sum over every process it ran, and its wall
+ * time is measured with CLOCK_MONOTONIC around the whole command.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * usageAdd()
+ *
+ *  Description:
+ *      Adds the CPU time of a reaped process to total and keeps the largest
+ *      resident set size.
+ ******************************************************************************/
+void usageAdd(ResourceUsage *total, const struct rusage *usage) {
+    timeradd(&total->user, &usage->ru_utime, &total->user);
+    timeradd(&total->system, &usage->ru_stime, &total->system);
+    if (usage->ru_maxrss > total->maxRss) {
+        total->maxRss = usage->ru_maxrss;
     }
-    fflush(stdout);
 }
 
-void handle_SIGTSTP(int signo, siginfo_t *siginfo, void *ucontext) {
-    fgOnly = !fgOnly;
-
-    if (fgOnly) {
-        char *message = "\nNow entering foreground only mode\n";
-        write(STDOUT_FILENO, message, 36);
-        fflush(stdout);
-    } else {
-        char *message = "\nNow leaving foreground only mode\n";
-        write(STDOUT_FILENO, message, 35);
-        fflush(stdout);
+/*******************************************************************************
+ * usageMerge()
+ *
+ *  Description:
+ *      Adds the CPU time and peak memory of one command to another.
+ ******************************************************************************/
+void usageMerge(ResourceUsage *total, const ResourceUsage *usage) {
+    timeradd(&total->user, &usage->user, &total->user);
+    timeradd(&total->system, &usage->system, &total->system);
+    if (usage->maxRss > total->maxRss) {
+        total->maxRss = usage->maxRss;
     }
 }
 
-void handle_SIGUSR1(int signo, siginfo_t *siginfo, void *ucontext) {
+/*******************************************************************************
+ * usageSetWall()
+ *
+ *  Description:
+ *      Sets the wall time of usage to the time elapsed since start.
+ ******************************************************************************/
+void usageSetWall(ResourceUsage *usage, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usage->wall.tv_sec = now.tv_sec - start->tv_sec;
+    usage->wall.tv_nsec = now.tv_nsec - start->tv_nsec;
+    if (usage->wall.tv_nsec < 0) {
+        usage->wall.tv_sec--;
+        usage->wall.tv_nsec += 1000000000L;
+    }
+}
 
-    char *message =
-        "\nSmallsh encountered an error\nAttemping to recover...\n: ";
-    write(STDOUT_FILENO, message, 56);
-    fflush(stdout);
-    return;
+/*******************************************************************************
+ * printUsage()
+ *
+ *  Description:
+ *      Prints usage on one line the way time and status -v report it.
+ ******************************************************************************/
+void printUsage(FILE *stream, const ResourceUsage *usage) {
+    fprintf(stream, "real %ld.%03lds user %ld.%03lds sys %ld.%03lds "
+                    "maxrss %ldKB\n",
+            (long)usage->wall.tv_sec, usage->wall.tv_nsec / 1000000L,
+            (long)usage->user.tv_sec, (long)usage->user.tv_usec / 1000L,
+            (long)usage->system.tv_sec, (long)usage->system.tv_usec / 1000L,
+            usage->maxRss);
 }
 
-void handle_SIGQUIT(int signo, siginfo_t *siginfo, void *ucontext) { quit = 1; }
+/******************************************************************************
+ * Notices
+ *
+ * Messages about background jobs are formatted with the helpers below, which
+ * only touch the buffer they are given and so are async-signal-safe, and
+ * queued in noticeRing. The queue is flushed with a single writev() before
+ * the next prompt, so a burst of finished jobs costs one syscall and never
+ * lands in the middle of what the user is typing.
+ ******************************************************************************/
 
 /*******************************************************************************
- * Functions
+ * formatString()
  *
+ *  Description:
+ *      Appends str to buffer[*length], stopping at capacity.
  ******************************************************************************/
+void formatString(char *buffer, size_t *length, size_t capacity,
+                  const char *str) {
+    while (*str != '\0' && *length < capacity) {
+        buffer[(*length)++] = *str++;
+    }
+}
 
 /*******************************************************************************
- * getInputString
+ * formatInt()
  *
- *  Description
- *      Returns pointer to a dynamically allocated string retrieved by getline
- *      from stdin. Removes trailing \n character. Performs expansion for $$
+ *  Description:
+ *      Appends the decimal digits of value to buffer[*length], stopping at
+ *      capacity.
+ ******************************************************************************/
+void formatInt(char *buffer, size_t *length, size_t capacity, long value) {
+    char digits[24];
+    size_t nDigits = 0;
+    unsigned long magnitude =
+        value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+
+    do {
+        digits[nDigits++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        digits[nDigits++] = '-';
+    }
+
+    while (nDigits > 0 && *length < capacity) {
+        buffer[(*length)++] = digits[--nDigits];
+    }
+}
+
+/*******************************************************************************
+ * noticePush()
  *
- *  Inputs:
- *      Retrieves user input from stdin
+ *  Description:
+ *      Queues a notice. Only one context may push at a time, but it may run
+ *      concurrently with noticeFlush().
  *
  *  Outputs:
- *      Returns a char* on success. Returns null on failure.
+ *      Returns 0 on success, -1 if the ring is full.
  ******************************************************************************/
-char *getInputString() {
-    while (1) {
-        char *userInputString = NULL;
-        char *expansion_str = NULL;
-        size_t userInputStringLength = 0;
-        char *temp_str = NULL;
+int noticePush(const char *text, size_t length) {
+    size_t head = __atomic_load_n(&noticeRing.head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&noticeRing.tail, __ATOMIC_ACQUIRE);
+    if (head - tail == NOTICE_SLOTS) {
+        return -1;
+    }
 
-        fprintf(stdout, ": ");
-        fflush(stdout);
+    size_t slot = head & (NOTICE_SLOTS - 1);
+    if (length > NOTICE_LENGTH) {
+        length = NOTICE_LENGTH;
+    }
+    memcpy(noticeRing.text[slot], text, length);
+    noticeRing.length[slot] = length;
+    __atomic_store_n(&noticeRing.head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-        fflush(stdin);
-        /*****************************************************************
-         * TODO
-         * This allocation is causing a memory leak when execvp fails to
-         * execute I can't quit fix yet.
-         *
-         * **************************************************************/
-        ssize_t nRead = getline(&temp_str, &userInputStringLength, stdin);
-        fflush(stdin);
-        if (temp_str == NULL) {
-            raise(SIGUSR1);
-            return NULL;
-        }
+/*******************************************************************************
+ * noticeFlush()
+ *
+ *  Description:
+ *      Writes every queued notice to stdout with as few writev() calls as
+ *      possible, after anything still buffered in stdout.
+ ******************************************************************************/
+void noticeFlush() {
+    size_t tail = __atomic_load_n(&noticeRing.tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&noticeRing.head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+    fflush(stdout);
 
-        // await user input
-        if (nRead > 1) {
-            // successfully read
-            if (temp_str[0] == '#') {
-                // ignore comment
+    struct iovec iov[NOTICE_SLOTS];
+    size_t nIov = 0;
+    for (size_t i = tail; i != head; i++) {
+        size_t slot = i & (NOTICE_SLOTS - 1);
+        iov[nIov].iov_base = noticeRing.text[slot];
+        iov[nIov].iov_len = noticeRing.length[slot];
+        nIov++;
+    }
+
+    // the ring holds at most IOV_MAX (1024) entries, loop on short writes
+    struct iovec *next = iov;
+    while (nIov > 0) {
+        ssize_t written = writev(STDOUT_FILENO, next, (int)nIov);
+        if (written < 0) {
+            if (errno == EINTR) {
                 continue;
             }
+            break;
+        }
+        while (nIov > 0 && (size_t)written >= next->iov_len) {
+            written -= (ssize_t)next->iov_len;
+            next++;
+            nIov--;
+        }
+        if (nIov > 0) {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= (size_t)written;
+        }
+    }
 
-            // begone \n
-            temp_str[nRead - (size_t)(1)] = '\0';
+    __atomic_store_n(&noticeRing.tail, head, __ATOMIC_RELEASE);
+}
 
-            // handle $$ expansion
-            char *moneyPtr = strstr(temp_str, "$$");
-            if (moneyPtr != NULL) {
-                // find how many times we're expanding $$
-                int numOccurences = 0;
-                for (size_t i = 0; i < strlen(temp_str); i++) {
-                    if (temp_str[i] == '$') {
-                        if (temp_str[i + (size_t)1] == '$') {
-                            numOccurences++;
+/******************************************************************************
+ * Tracing
+ *
+ * With SMALLSH_TRACE=file every command appends one JSON line to file, with
+ * the CLOCK_MONOTONIC time in nanoseconds at which its line was read,
+ * expanded and parsed, its first stage was launched, every stage had exec'd
+ * and its last process was reaped, followed by its pid, status and usage.
+ * Records are formatted with the notice helpers into a 64 KiB buffer which is
+ * written out whole when it fills, before an interactive prompt and at exit,
+ * so a traced command costs a few hundred nanoseconds and no syscall. A
+ * background job's record is written when its last process is reaped.
+ * bench/trace_percentiles.sh turns the log into latency percentiles.
+ ******************************************************************************/
+#define TRACE_BUFFER_SIZE (64 * 1024)
+#define TRACE_COMMAND_MAX 256 // longer command lines are cut short
+#define TRACE_RECORD_MAX (TRACE_COMMAND_MAX * 6 + 512)
 
-                            i = i + 1; // consume the
-                                       // second $
-                        }
-                    }
-                }
+/*******************************************************************************
+ * traceNow()
+ *
+ *  Description:
+ *      Returns the CLOCK_MONOTONIC time in nanoseconds.
+ ******************************************************************************/
+int64_t traceNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-                // do some math to calc new token size
-                size_t byteCount = 0;
-                pid_t pid = getpid();
-                size_t nDigits = floor(log10(abs(pid))) + 1;
-
-                byteCount = (strlen(temp_str) - (2 * numOccurences)) +
-                            (nDigits * numOccurences) + 1;
-                //(strlen - 2*numoccurences) - string length of
-                // original tokens minus however many $ we're
-                // removing (nDigits * numOccurences) - digits of
-                // the pid * how many times we're inserting it +1
-                // for null terminator
-
-                // convert the pid to a char[]
-                char pidChar[nDigits];
-                int digit = 0;
-                size_t count = 1;
-                while (pid > 0) {
-                    digit = pid % 10;
-                    pid = pid / 10;
-                    pidChar[nDigits - count] = (char)(digit + 48);
-                    count++;
-                }
+/*******************************************************************************
+ * traceStamp()
+ *
+ *  Description:
+ *      Sets *field to the current time when tracing is on.
+ ******************************************************************************/
+void traceStamp(int64_t *field) {
+    if (trace.fd >= 0) {
+        *field = traceNow();
+    }
+}
 
-                // allocate some space
-                expansion_str = calloc(byteCount, sizeof(char));
-                if (expansion_str == NULL) {
-                    free(temp_str);
-                    raise(SIGUSR1);
-                    return userInputString;
-                }
+/*******************************************************************************
+ * traceOpen()
+ *
+ *  Description:
+ *      Opens the file named by SMALLSH_TRACE for appending, when it is set.
+ *      Tracing stays off if it can not be opened.
+ ******************************************************************************/
+void traceOpen() {
+    const char *path = getenv("SMALLSH_TRACE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    trace.buffer = malloc(TRACE_BUFFER_SIZE);
+    if (trace.buffer == NULL) {
+        return;
+    }
+    trace.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (trace.fd < 0) {
+        fprintf(stderr, "SMALLSH_TRACE: %s: %s\n", path, strerror(errno));
+        fflush(stderr);
+        free(trace.buffer);
+        trace.buffer = NULL;
+    }
+}
 
-                size_t offset = 0;
-                // build the new token
-                for (size_t h = 0; h < strlen(temp_str); h++) {
-                    if (temp_str[h] == '$') {
-                        if (temp_str[h + (size_t)1] == '$') {
-                            // add the pid to the arr
-                            for (size_t j = 0; j < nDigits; j++) {
-                                expansion_str[h + j + offset] = pidChar[j];
-                            }
-
-                            offset = offset + nDigits - 2;
-                            h = h + 1;
-                        } else {
-                            expansion_str[h + offset] = '$';
-                        }
-                    } else {
-                        expansion_str[h + offset] = temp_str[h];
-                    }
-                }
+/*******************************************************************************
+ * traceFlush()
+ *
+ *  Description:
+ *      Writes out the buffered records.
+ ******************************************************************************/
+void traceFlush() {
+    size_t written = 0;
+    while (trace.fd >= 0 && written < trace.length) {
+        ssize_t result =
+            write(trace.fd, trace.buffer + written, trace.length - written);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            break;
+        }
+        written += (size_t)result;
+    }
+    trace.length = 0;
+}
+
+/*******************************************************************************
+ * traceClose()
+ *
+ *  Description:
+ *      Writes out the buffered records and stops tracing.
+ ******************************************************************************/
+void traceClose() {
+    if (trace.fd < 0) {
+        return;
+    }
+    traceFlush();
+    close(trace.fd);
+    trace.fd = -1;
+    free(trace.buffer);
+    trace.buffer = NULL;
+}
+
+/*******************************************************************************
+ * traceBegin()
+ *
+ *  Description:
+ *      Starts the record of the next command, whose line was just read.
+ ******************************************************************************/
+void traceBegin() {
+    if (trace.fd >= 0) {
+        trace.current = (TraceRecord){++trace.sequence};
+        trace.current.read = traceNow();
+    }
+}
+
+/*******************************************************************************
+ * traceField()
+ *
+ *  Description:
+ *      Appends "name":value to the record being formatted, or null for a
+ *      time that was never stamped.
+ ******************************************************************************/
+void traceField(char *record, size_t *length, const char *name, long value,
+                int isTime) {
+    formatString(record, length, TRACE_RECORD_MAX, ",\"");
+    formatString(record, length, TRACE_RECORD_MAX, name);
+    formatString(record, length, TRACE_RECORD_MAX, "\":");
+    if (isTime && value == 0) {
+        formatString(record, length, TRACE_RECORD_MAX, "null");
+    } else {
+        formatInt(record, length, TRACE_RECORD_MAX, value);
+    }
+}
+
+/*******************************************************************************
+ * traceWrite()
+ *
+ *  Description:
+ *      Buffers the JSON line of a finished command. The command line comes
+ *      last, so the fields before it can be picked out without a JSON
+ *      parser.
+ *
+ *  Inputs:
+ *      const TraceRecord *record
+ *      pid_t pid                  - last stage, or 0 for a builtin
+ *      int status                 - wait status
+ *      const ResourceUsage *usage - of every process, or NULL for a builtin
+ *      const char *commandLine
+ ******************************************************************************/
+void traceWrite(const TraceRecord *record, pid_t pid, int status,
+                const ResourceUsage *usage, const char *commandLine) {
+    static const char hexDigits[] = "0123456789abcdef";
+    if (trace.fd < 0) {
+        return;
+    }
+    if (TRACE_BUFFER_SIZE - trace.length < TRACE_RECORD_MAX) {
+        traceFlush();
+    }
+
+    char *line = trace.buffer + trace.length;
+    size_t length = 0;
+    formatString(line, &length, TRACE_RECORD_MAX, "{\"seq\":");
+    formatInt(line, &length, TRACE_RECORD_MAX, (long)record->sequence);
+    traceField(line, &length, "read", record->read, 1);
+    traceField(line, &length, "expand", record->expand, 1);
+    traceField(line, &length, "parse", record->parse, 1);
+    traceField(line, &length, "spawn", record->spawn, 1);
+    traceField(line, &length, "exec", record->exec, 1);
+    traceField(line, &length, "reap", record->reap, 1);
+    traceField(line, &length, "pid", pid, 0);
+    traceField(line, &length, "background", record->background, 0);
+    if (WIFSIGNALED(status)) {
+        traceField(line, &length, "signal", WTERMSIG(status), 0);
+    } else {
+        traceField(line, &length, "exit", WEXITSTATUS(status), 0);
+    }
+    ResourceUsage none = {{0}};
+    if (usage == NULL) {
+        usage = &none;
+    }
+    traceField(line, &length, "user_us",
+               usage->user.tv_sec * 1000000L + usage->user.tv_usec, 0);
+    traceField(line, &length, "system_us",
+               usage->system.tv_sec * 1000000L + usage->system.tv_usec, 0);
+    traceField(line, &length, "maxrss_kb", usage->maxRss, 0);
+
+    formatString(line, &length, TRACE_RECORD_MAX, ",\"command\":\"");
+    for (size_t i = 0; commandLine[i] != '\0' && i < TRACE_COMMAND_MAX; i++) {
+        unsigned char c = (unsigned char)commandLine[i];
+        if (c == '"' || c == '\\') {
+            line[length++] = '\\';
+            line[length++] = (char)c;
+        } else if (c < 0x20) {
+            formatString(line, &length, TRACE_RECORD_MAX, "\\u00");
+            line[length++] = hexDigits[c >> 4];
+            line[length++] = hexDigits[c & 15];
+        } else {
+            line[length++] = (char)c;
+        }
+    }
+    formatString(line, &length, TRACE_RECORD_MAX, "\"}\n");
+    trace.length += length;
+}
+
+/******************************************************************************
+ * Job table
+ *
+ * Background pipelines are kept in a slot array indexed by job id, with a
+ * free list so ids are reused, and an open addressing hash from pid to job.
+ * Insert, lookup and removal are all O(1). Every pid also gets a pidfd
+ * registered with the event loop, which reaps it as soon as it exits.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * pidSlotIndex()
+ *
+ *  Description:
+ *      Returns the home slot of pid in the pid hash.
+ ******************************************************************************/
+size_t pidSlotIndex(pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (jobTable.pidCapacity - 1);
+}
+
+/*******************************************************************************
+ * pidTableInsert()
+ *
+ *  Description:
+ *      Maps pid to the job in slot jobIndex, growing the hash so it stays at
+ *      most half full.
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if the hash could not be grown.
+ ******************************************************************************/
+int pidTableInsert(pid_t pid, int jobIndex) {
+    if ((jobTable.nPids + 1) * 2 > jobTable.pidCapacity) {
+        size_t oldCapacity = jobTable.pidCapacity;
+        PidSlot *oldSlots = jobTable.pidSlots;
+        size_t capacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+
+        PidSlot *slots = calloc(capacity, sizeof(PidSlot));
+        if (slots == NULL) {
+            return -1;
+        }
+        jobTable.pidSlots = slots;
+        jobTable.pidCapacity = capacity;
+        jobTable.nPids = 0;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (oldSlots[i].pid != 0) {
+                pidTableInsert(oldSlots[i].pid, oldSlots[i].jobIndex);
+            }
+        }
+        free(oldSlots);
+    }
+
+    size_t i = pidSlotIndex(pid);
+    while (jobTable.pidSlots[i].pid != 0) {
+        i = (i + 1) & (jobTable.pidCapacity - 1);
+    }
+    jobTable.pidSlots[i].pid = pid;
+    jobTable.pidSlots[i].jobIndex = jobIndex;
+    jobTable.nPids++;
+    return 0;
+}
+
+/*******************************************************************************
+ * pidTableFind()
+ *
+ *  Description:
+ *      Returns the slot index of the job pid belongs to, or -1 if pid is not
+ *      a running background process.
+ ******************************************************************************/
+int pidTableFind(pid_t pid) {
+    if (jobTable.pidCapacity == 0 || pid <= 0) {
+        return -1;
+    }
+    size_t i = pidSlotIndex(pid);
+    while (jobTable.pidSlots[i].pid != 0) {
+        if (jobTable.pidSlots[i].pid == pid) {
+            return jobTable.pidSlots[i].jobIndex;
+        }
+        i = (i + 1) & (jobTable.pidCapacity - 1);
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * pidTableRemove()
+ *
+ *  Description:
+ *      Removes pid from the hash, shifting later entries of its probe chain
+ *      back so no tombstones are needed.
+ ******************************************************************************/
+void pidTableRemove(pid_t pid) {
+    if (jobTable.pidCapacity == 0) {
+        return;
+    }
+    size_t mask = jobTable.pidCapacity - 1;
+    size_t i = pidSlotIndex(pid);
+    while (jobTable.pidSlots[i].pid != pid) {
+        if (jobTable.pidSlots[i].pid == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t hole = i;
+    for (size_t j = (hole + 1) & mask; jobTable.pidSlots[j].pid != 0;
+         j = (j + 1) & mask) {
+        size_t home = pidSlotIndex(jobTable.pidSlots[j].pid);
+        // move the entry if the hole lies between its home slot and j
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            jobTable.pidSlots[hole] = jobTable.pidSlots[j];
+            hole = j;
+        }
+    }
+    jobTable.pidSlots[hole].pid = 0;
+    jobTable.nPids--;
+}
+
+/*******************************************************************************
+ * raiseFileLimit()
+ *
+ *  Description:
+ *      Raises the soft open file limit to the hard limit, once background
+ *      jobs each holding a pidfd come within FILE_LIMIT_SLACK of the soft
+ *      one.
+ *      Children launched from then on go through forkCommand(), which puts
+ *      the original limit back, since select() and programs closing every
+ *      fd up to the limit expect the usual one.
+ *
+ *  Outputs:
+ *      Returns 0 if the limit was raised, -1 if it already was as high as
+ *      it goes.
+ ******************************************************************************/
+#define FILE_LIMIT_SLACK 64 // fds kept free for other uses than pidfds
+int raiseFileLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 ||
+        limit.rlim_cur >= limit.rlim_max) {
+        return -1;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return -1;
+    }
+    eventLoop.fileLimitRaised = 1;
+    return 0;
+}
+
+/*******************************************************************************
+ * restoreFileLimit()
+ *
+ *  Description:
+ *      Puts back the open file limit the shell was started with, in a child
+ *      about to exec a command after raiseFileLimit().
+ ******************************************************************************/
+void restoreFileLimit() {
+    if (eventLoop.fileLimitRaised) {
+        setrlimit(RLIMIT_NOFILE, &eventLoop.fileLimit);
+    }
+}
+
+/*******************************************************************************
+ * watchChild()
+ *
+ *  Description:
+ *      Opens a pidfd for pid and adds it to the event loop so its exit is
+ *      reported as an EVENT_CHILD event.
+ *
+ *  Outputs:
+ *      Returns the pidfd, or -1 if none could be opened. Such children are
+ *      found by polling when SIGCHLD arrives instead.
+ ******************************************************************************/
+int watchChild(pid_t pid) {
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0 && errno == EMFILE && raiseFileLimit() == 0) {
+        pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    }
+    if (pidfd >= 0 && !eventLoop.fileLimitRaised &&
+        (rlim_t)pidfd + FILE_LIMIT_SLACK >= eventLoop.fileLimit.rlim_cur) {
+        // leave room for the redirections and pipes of the next commands
+        raiseFileLimit();
+    }
+    if (pidfd >= 0) {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t)EVENT_CHILD << 32) | (uint32_t)pid;
+        if (epoll_ctl(eventLoop.epollFd, EPOLL_CTL_ADD, pidfd, &event) == 0) {
+            return pidfd;
+        }
+        close(pidfd);
+    }
+
+    eventLoop.nUnwatched++;
+    return -1;
+}
+
+/*******************************************************************************
+ * unwatchChild()
+ *
+ *  Description:
+ *      Releases whatever watchChild() set up for stage i of a job.
+ ******************************************************************************/
+void unwatchChild(Job *job, size_t i) {
+    if (job->pidfds[i] >= 0) {
+        // a child still between vfork and exec may hold a copy of the
+        // pidfd, so closing it alone does not remove it from the epoll set
+        epoll_ctl(eventLoop.epollFd, EPOLL_CTL_DEL, job->pidfds[i], NULL);
+        close(job->pidfds[i]);
+        job->pidfds[i] = -1;
+    } else {
+        eventLoop.nUnwatched--;
+    }
+}
+
+/*******************************************************************************
+ * jobInsert()
+ *
+ *  Description:
+ *      Adds a background pipeline to the table and starts watching each of
+ *      its processes. Stages that failed to launch are passed as -1 and
+ *      skipped.
+ *
+ *  Inputs:
+ *      pid_t *pids
+ *      size_t nPids
+ *      const char *commandLine
+ *
+ *  Outputs:
+ *      Returns the job id, or -1 if the job could not be recorded.
+ ******************************************************************************/
+int jobInsert(const pid_t *pids, size_t nPids, const char *commandLine) {
+    if (jobTable.freeList < 0 && jobTable.nJobs == jobTable.capacity) {
+        size_t capacity = jobTable.capacity == 0 ? 16 : jobTable.capacity * 2;
+        Job *jobs = realloc(jobTable.jobs, capacity * sizeof(Job));
+        if (jobs == NULL) {
+            return -1;
+        }
+        memset(jobs + jobTable.capacity, 0,
+               (capacity - jobTable.capacity) * sizeof(Job));
+        jobTable.jobs = jobs;
+        jobTable.capacity = capacity;
+    }
+
+    size_t lineLength = strlen(commandLine);
+    pid_t *block =
+        malloc(nPids * (sizeof(pid_t) + sizeof(int)) + lineLength + 1);
+    if (block == NULL) {
+        return -1;
+    }
+
+    int index;
+    if (jobTable.freeList >= 0) {
+        index = jobTable.freeList;
+        jobTable.freeList = jobTable.jobs[index].nextFree;
+    } else {
+        index = (int)jobTable.nJobs;
+    }
+    jobTable.nJobs++;
+
+    Job *job = &jobTable.jobs[index];
+    *job = (Job){0};
+    job->inUse = 1;
+    job->pids = block;
+    job->pidfds = (int *)(block + nPids);
+    job->commandLine = (char *)(job->pidfds + nPids);
+    memcpy(job->commandLine, commandLine, lineLength + 1);
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->startTime);
+    job->trace = trace.current;
+    job->trace.background = 1;
+
+    for (size_t i = 0; i < nPids; i++) {
+        if (pids[i] <= 0) {
+            continue;
+        }
+        if (pidTableInsert(pids[i], index) == 0) {
+            job->pids[job->nPids] = pids[i];
+            job->pidfds[job->nPids] = watchChild(pids[i]);
+            job->nPids++;
+            job->nRunning++;
+        }
+    }
+    if (job->nRunning == 0) {
+        job->state = JOB_DONE;
+        job->status = W_EXITCODE(1, 0);
+    }
+
+    return index + 1;
+}
+
+/*******************************************************************************
+ * jobRemove()
+ *
+ *  Description:
+ *      Frees a job slot for reuse.
+ ******************************************************************************/
+void jobRemove(int index) {
+    Job *job = &jobTable.jobs[index];
+    for (size_t i = 0; i < job->nPids; i++) {
+        if (pidTableFind(job->pids[i]) == index) {
+            pidTableRemove(job->pids[i]);
+            unwatchChild(job, i);
+        }
+    }
+    free(job->pids);
+    *job = (Job){0};
+    job->nextFree = jobTable.freeList;
+    jobTable.freeList = index;
+    jobTable.nJobs--;
+
+    // once the table is empty job ids start again from 1
+    if (jobTable.nJobs == 0) {
+        jobTable.freeList = -1;
+    }
+}
+
+/*******************************************************************************
+ * jobRetire()
+ *
+ *  Description:
+ *      Removes a finished job from the table once its completion has been
+ *      reported, keeping only its id, last pid and status for a later wait.
+ *      A script starting background jobs it never waits for thus keeps a
+ *      table the size of the jobs still running.
+ ******************************************************************************/
+void jobRetire(int index) {
+    Job *job = &jobTable.jobs[index];
+    DoneJob done = {index + 1, job->nPids > 0 ? job->pids[job->nPids - 1] : 0,
+                    job->status};
+
+    // an earlier job with the same id can no longer be named by it
+    size_t kept = 0;
+    for (size_t i = 0; i < jobTable.nDone; i++) {
+        if (jobTable.done[i].id != done.id) {
+            jobTable.done[kept++] = jobTable.done[i];
+        }
+    }
+    jobTable.nDone = kept;
+    if (jobTable.nDone == JOB_DONE_KEPT) {
+        memmove(jobTable.done, jobTable.done + 1,
+                (JOB_DONE_KEPT - 1) * sizeof(DoneJob));
+        jobTable.nDone--;
+    }
+    jobTable.done[jobTable.nDone++] = done;
+
+    jobRemove(index);
+}
+
+/*******************************************************************************
+ * jobRecordStatus()
+ *
+ *  Description:
+ *      Records the exit status and resource usage of a reaped pid. The pid
+ *      is retired from the job, and the status of the last stage becomes the
+ *      job's status.
+ *
+ *  Outputs:
+ *      Returns the slot index of the job, or -1 if pid is not in a job.
+ ******************************************************************************/
+int jobRecordStatus(pid_t pid, int status, const struct rusage *usage) {
+    int index = pidTableFind(pid);
+    if (index < 0) {
+        return -1;
+    }
+    Job *job = &jobTable.jobs[index];
+
+    pidTableRemove(pid);
+    for (size_t i = 0; i < job->nPids; i++) {
+        if (job->pids[i] == pid) {
+            unwatchChild(job, i);
+        }
+    }
+    job->nRunning--;
+    usageAdd(&job->usage, usage);
+    if (pid == job->pids[job->nPids - 1]) {
+        job->status = status;
+    }
+    if (job->nRunning == 0) {
+        job->state = JOB_DONE;
+        usageSetWall(&job->usage, &job->startTime);
+        traceStamp(&job->trace.reap);
+        traceWrite(&job->trace, job->pids[job->nPids - 1], job->status,
+                   &job->usage, job->commandLine);
+    }
+    return index;
+}
+
+/******************************************************************************
+ * Event handlers
+ *
+ * SIGINT, SIGTSTP, SIGQUIT, SIGCHLD and SIGUSR1 are blocked and read from a
+ * signalfd, and every background child has a pidfd. Both are watched by one
+ * epoll instance together with the input, and the handlers below are called
+ * synchronously from runEventLoop(), never in signal context.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * reportBackgroundStatus()
+ *
+ *  Description:
+ *      Queues a notice telling the user a background process is done. If the
+ *      queue is full it is flushed first.
+ ******************************************************************************/
+void reportBackgroundStatus(pid_t spawnpid, int status) {
+    char message[NOTICE_LENGTH];
+    size_t length = 0;
+
+    formatString(message, &length, NOTICE_LENGTH, "Background process (");
+    formatInt(message, &length, NOTICE_LENGTH, spawnpid);
+    formatString(message, &length, NOTICE_LENGTH, ") is done: ");
+    if (WIFSIGNALED(status)) {
+        formatString(message, &length, NOTICE_LENGTH, "terminated by signal ");
+        formatInt(message, &length, NOTICE_LENGTH, WTERMSIG(status));
+    } else {
+        formatString(message, &length, NOTICE_LENGTH, "exit value ");
+        formatInt(message, &length, NOTICE_LENGTH, WEXITSTATUS(status));
+    }
+    formatString(message, &length, NOTICE_LENGTH, "\n");
+
+    if (noticePush(message, length) != 0) {
+        noticeFlush();
+        noticePush(message, length);
+    }
+}
+
+/*******************************************************************************
+ * handle_childExit()
+ *
+ *  Description:
+ *      Reaps a background process whose pidfd became readable and records its
+ *      status and resource usage in the job table. Once the whole job is
+ *      done its usage is what status -v reports.
+ ******************************************************************************/
+void handle_childExit(pid_t spawnpid) {
+    int status;
+    struct rusage usage = {{0}};
+    pid_t pid = wait4(spawnpid, &status, WNOHANG, &usage);
+    if (pid == 0) {
+        return;
+    }
+    if (pid < 0) {
+        // somebody else reaped it, stop watching it anyway
+        status = W_EXITCODE(1, 0);
+    }
+
+    int index = jobRecordStatus(spawnpid, status, &usage);
+    if (index >= 0 && pid > 0) {
+        currentStatus = status;
+        if (jobTable.jobs[index].state == JOB_DONE) {
+            lastUsage = jobTable.jobs[index].usage;
+        }
+        reportBackgroundStatus(spawnpid, status);
+        // a job being waited for is removed by the builtin waiting for it
+        if (jobTable.jobs[index].state == JOB_DONE &&
+            index != jobTable.waited) {
+            jobRetire(index);
+        }
+    }
+}
+
+/*******************************************************************************
+ * handle_SIGCHLD()
+ *
+ *  Description:
+ *      Exits are reported through the pidfds, SIGCHLD is only used to track
+ *      jobs being stopped and continued, and to poll the few children we
+ *      could not open a pidfd for.
+ ******************************************************************************/
+void handle_SIGCHLD() {
+    siginfo_t info;
+    while (1) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WSTOPPED | WCONTINUED | WNOHANG) != 0 ||
+            info.si_pid == 0) {
+            break;
+        }
+        int index = pidTableFind(info.si_pid);
+        if (index >= 0) {
+            jobTable.jobs[index].state =
+                info.si_code == CLD_CONTINUED ? JOB_RUNNING : JOB_STOPPED;
+        }
+    }
+
+    for (size_t i = 0; eventLoop.nUnwatched > 0 && i < jobTable.capacity; i++) {
+        Job *job = &jobTable.jobs[i];
+        for (size_t j = 0; job->inUse && j < job->nPids; j++) {
+            if (job->pidfds[j] < 0 && pidTableFind(job->pids[j]) == (int)i) {
+                handle_childExit(job->pids[j]);
+            }
+        }
+    }
+}
+
+void handle_SIGTSTP() {
+    fgOnly = !fgOnly;
+
+    if (fgOnly) {
+        char *message = "\nNow entering foreground only mode\n";
+        write(STDOUT_FILENO, message, 36);
+    } else {
+        char *message = "\nNow leaving foreground only mode\n";
+        write(STDOUT_FILENO, message, 35);
+    }
+}
+
+void handle_SIGUSR1() {
+
+    char *message =
+        "\nSmallsh encountered an error\nAttemping to recover...\n: ";
+    write(STDOUT_FILENO, message, 56);
+    return;
+}
+
+void handle_SIGQUIT() { quit = 1; }
+
+void handle_SIGINT() { eventLoop.interrupted = 1; }
+
+/*******************************************************************************
+ * handle_pathChanged()
+ *
+ *  Description:
+ *      Drains the inotify events of the directories on $PATH and marks the
+ *      command index for rebuilding on the next completion.
+ ******************************************************************************/
+void handle_pathChanged() {
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(commandIndex.inotifyFd, buffer, sizeof(buffer)) > 0) {
+    }
+    commandIndex.stale = 1;
+}
+
+/*******************************************************************************
+ * setupEventLoop()
+ *
+ *  Description:
+ *      Blocks the signals the shell handles, creates the signalfd and the
+ *      epoll instance and starts watching inputFd. The open file limit is
+ *      remembered for raiseFileLimit() and restoreFileLimit().
+ *
+ *  Inputs:
+ *      int inputFd - fd command lines are read from, -1 if it never blocks
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 on failure.
+ ******************************************************************************/
+int setupEventLoop(int inputFd) {
+    sigset_t handledSignals;
+    sigemptyset(&handledSignals);
+    sigaddset(&handledSignals, SIGINT);
+    sigaddset(&handledSignals, SIGTSTP);
+    sigaddset(&handledSignals, SIGQUIT);
+    sigaddset(&handledSignals, SIGCHLD);
+    sigaddset(&handledSignals, SIGUSR1);
+
+    // a blocked signal still reaches the signalfd when it is ignored, so
+    // SIGINT and SIGTSTP are ignored for good and posix_spawn children
+    // inherit that; SIGCHLD must keep its default or children are reaped
+    struct sigaction default_action = {{0}};
+    sigemptyset(&default_action.sa_mask);
+    default_action.sa_handler = SIG_DFL;
+    struct sigaction ignore_action = default_action;
+    ignore_action.sa_handler = SIG_IGN;
+    sigemptyset(&eventLoop.ignoredSignals);
+    for (int signo = 1; signo < NSIG; signo++) {
+        if (sigismember(&handledSignals, signo) == 1) {
+            int ignore = signo == SIGINT || signo == SIGTSTP;
+            struct sigaction previous;
+            if (sigaction(signo, ignore ? &ignore_action : &default_action,
+                          &previous) == 0 &&
+                previous.sa_handler == SIG_IGN) {
+                sigaddset(&eventLoop.ignoredSignals, signo);
+            }
+        }
+    }
+    sigprocmask(SIG_BLOCK, &handledSignals, NULL);
+
+    if (getrlimit(RLIMIT_NOFILE, &eventLoop.fileLimit) != 0) {
+        eventLoop.fileLimit.rlim_cur = RLIM_INFINITY;
+    }
+
+    eventLoop.signalFd =
+        signalfd(-1, &handledSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+    eventLoop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (eventLoop.signalFd < 0 || eventLoop.epollFd < 0) {
+        return -1;
+    }
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    if (epoll_ctl(eventLoop.epollFd, EPOLL_CTL_ADD, eventLoop.signalFd,
+                  &event) != 0) {
+        return -1;
+    }
+
+    eventLoop.inputFd = -1;
+    if (inputFd >= 0) {
+        event.data.u64 = (uint64_t)EVENT_INPUT << 32;
+        // regular files can not be polled, they are always ready
+        if (epoll_ctl(eventLoop.epollFd, EPOLL_CTL_ADD, inputFd, &event) == 0) {
+            eventLoop.inputFd = inputFd;
+        }
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ * runEventLoop()
+ *
+ *  Description:
+ *      Waits up to timeout milliseconds (-1 forever, 0 to only poll) for
+ *      events and handles every one that is ready.
+ *
+ *  Outputs:
+ *      Returns the number of events handled, or -1 on error.
+ ******************************************************************************/
+int runEventLoop(int timeout) {
+    struct epoll_event events[64];
+    int nEvents = epoll_wait(eventLoop.epollFd, events, 64, timeout);
+    if (nEvents < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        int type = (int)(events[i].data.u64 >> 32);
+        uint32_t value = (uint32_t)events[i].data.u64;
+
+        if (type == EVENT_INPUT) {
+            eventLoop.inputReady = 1;
+        } else if (type == EVENT_CHILD) {
+            handle_childExit((pid_t)value);
+        } else if (type == EVENT_PATH) {
+            handle_pathChanged();
+        } else if (type == EVENT_SIGNAL) {
+            struct signalfd_siginfo info;
+            while (read(eventLoop.signalFd, &info, sizeof(info)) ==
+                   sizeof(info)) {
+                switch (info.ssi_signo) {
+                case SIGCHLD:
+                    handle_SIGCHLD();
+                    break;
+                case SIGTSTP:
+                    handle_SIGTSTP();
+                    break;
+                case SIGUSR1:
+                    handle_SIGUSR1();
+                    break;
+                case SIGTERM: // only taken through the signalfd by --server
+                case SIGQUIT:
+                    handle_SIGQUIT();
+                    break;
+                case SIGINT:
+                    handle_SIGINT();
+                    break;
+                }
+            }
+        }
+    }
+
+    return nEvents;
+}
+
+/*******************************************************************************
+ * Functions
+ *
+ ******************************************************************************/
+
+/*******************************************************************************
+ * openInputSource()
+ *
+ *  Description:
+ *      Sets up reading command lines from fd. A terminal is read with a
+ *      prompt. Anything else is a batch script: a regular file is mmap'd
+ *      whole. Terminals and pipes are read through a large read() buffer.
+ *
+ *  Inputs:
+ *      InputSource *input
+ *      int fd
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if the batch buffer could not be allocated.
+ ******************************************************************************/
+#define INPUT_BUFFER_SIZE (256 * 1024)
+int openInputSource(InputSource *input, int fd) {
+    *input = (InputSource){0};
+    input->fd = fd;
+    input->interactive = isatty(fd);
+
+    struct stat info;
+    if (!input->interactive && fstat(fd, &info) == 0 &&
+        S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE,
+                         fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+            input->map = map;
+            input->mapLength = (size_t)info.st_size;
+            return 0;
+        }
+    }
+
+    input->buffer = malloc(INPUT_BUFFER_SIZE);
+    if (input->buffer == NULL) {
+        return -1;
+    }
+    input->bufferCapacity = INPUT_BUFFER_SIZE;
+    return 0;
+}
+
+/*******************************************************************************
+ * openStringSource()
+ *
+ *  Description:
+ *      Sets up reading command lines from the string given to smallsh -c,
+ *      which is read in place like an mmap'd batch script.
+ *
+ *  Inputs:
+ *      InputSource *input
+ *      char *string
+ ******************************************************************************/
+void openStringSource(InputSource *input, char *string) {
+    *input = (InputSource){0};
+    input->fd = -1;
+    input->map = string;
+    input->mapLength = strlen(string);
+}
+
+/*******************************************************************************
+ * storeLine()
+ *
+ *  Description:
+ *      Copies `length` bytes into the reused line buffer and terminates them.
+ *
+ *  Outputs:
+ *      Returns the line buffer, or NULL if it could not be grown.
+ ******************************************************************************/
+char *storeLine(InputSource *input, const char *data, size_t length) {
+    if (length + 1 > input->lineCapacity) {
+        size_t capacity = input->lineCapacity * 2;
+        if (capacity < length + 1) {
+            capacity = length + 1;
+        }
+        char *line = realloc(input->line, capacity);
+        if (line == NULL) {
+            return NULL;
+        }
+        input->line = line;
+        input->lineCapacity = capacity;
+    }
+
+    memcpy(input->line, data, length);
+    input->line[length] = '\0';
+    return input->line;
+}
+
+/*******************************************************************************
+ * waitForInput()
+ *
+ *  Description:
+ *      Runs the event loop until the input fd is readable. A ctrl^c at the
+ *      prompt discards the line being typed and prompts again.
+ *
+ *  Outputs:
+ *      Returns 0 once input is ready, -1 if the shell is quitting.
+ ******************************************************************************/
+int waitForInput(InputSource *input) {
+    while (!eventLoop.inputReady && eventLoop.inputFd >= 0 && !quit) {
+        if (runEventLoop(-1) < 0) {
+            break;
+        }
+        if (eventLoop.interrupted) {
+            eventLoop.interrupted = 0;
+            if (input->interactive) {
+                fprintf(stdout, "\n: ");
+                fflush(stdout);
+            }
+        }
+    }
+    eventLoop.inputReady = 0;
+    return quit ? -1 : 0;
+}
+
+/*******************************************************************************
+ * readLine()
+ *
+ *  Description:
+ *      Returns the next input line without its \n, stored in the reused line
+ *      buffer. Lines are located with memchr either in the mmap'd script or
+ *      in the read() buffer, which is refilled once the event loop reports
+ *      the input readable and, for lines longer than the buffer, grown as
+ *      needed. Batch scripts handle pending events between lines.
+ *
+ *  Outputs:
+ *      Returns the line, or NULL at end of input, on ctrl^d at the prompt,
+ *      when the shell is quitting or on error.
+ ******************************************************************************/
+char *readLine(InputSource *input) {
+    if (!input->interactive) {
+        runEventLoop(0);
+    }
+    if (quit) {
+        return NULL;
+    }
+
+    if (input->map != NULL) {
+        if (input->mapOffset >= input->mapLength) {
+            input->atEof = 1;
+            return NULL;
+        }
+        const char *start = input->map + input->mapOffset;
+        size_t remaining = input->mapLength - input->mapOffset;
+        const char *newline = memchr(start, '\n', remaining);
+        size_t length = newline == NULL ? remaining : (size_t)(newline - start);
+        input->mapOffset += length + (newline != NULL);
+        return storeLine(input, start, length);
+    }
+
+    size_t scanned = input->bufferStart;
+    while (1) {
+        char *start = input->buffer + input->bufferStart;
+        char *newline = memchr(input->buffer + scanned, '\n',
+                               input->bufferEnd - scanned);
+        if (newline != NULL) {
+            input->bufferStart = (size_t)(newline - input->buffer) + 1;
+            return storeLine(input, start, (size_t)(newline - start));
+        }
+
+        if (input->atEof) {
+            if (input->bufferStart == input->bufferEnd) {
+                return NULL;
+            }
+            // last line without a trailing \n
+            size_t length = input->bufferEnd - input->bufferStart;
+            input->bufferStart = input->bufferEnd;
+            return storeLine(input, start, length);
+        }
+
+        // move the partial line to the front and make room for more
+        size_t pending = input->bufferEnd - input->bufferStart;
+        memmove(input->buffer, start, pending);
+        input->bufferStart = 0;
+        input->bufferEnd = pending;
+        scanned = pending;
+        if (pending == input->bufferCapacity) {
+            char *buffer = realloc(input->buffer, input->bufferCapacity * 2);
+            if (buffer == NULL) {
+                return NULL;
+            }
+            input->buffer = buffer;
+            input->bufferCapacity *= 2;
+        }
+
+        if (waitForInput(input) != 0) {
+            return NULL;
+        }
+        ssize_t nRead = read(input->fd, input->buffer + input->bufferEnd,
+                             input->bufferCapacity - input->bufferEnd);
+        if (nRead < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (nRead == 0 && input->interactive) {
+            // ctrl^d, just prompt again
+            fprintf(stdout, "\n");
+            return NULL;
+        }
+        if (nRead <= 0) {
+            input->atEof = 1;
+        } else {
+            input->bufferEnd += (size_t)nRead;
+        }
+    }
+}
+
+/*******************************************************************************
+ * historyOpen()
+ *
+ *  Description:
+ *      Opens the history file, $SMALLSH_HISTORY or ~/.smallsh_history, for
+ *      appending and maps its current contents. Nothing is read or indexed
+ *      yet: lines are only found, newest first, when the editor asks for
+ *      them, so startup costs the same however long the history is. Only
+ *      the last 4 GiB are mapped so offsets fit the uint32_t index. An empty
+ *      $SMALLSH_HISTORY turns the file off.
+ ******************************************************************************/
+void historyOpen() {
+    char path[4096];
+    const char *file = getenv("SMALLSH_HISTORY");
+    if (file == NULL) {
+        const char *home = getenv("HOME");
+        if (home == NULL ||
+            snprintf(path, sizeof(path), "%s/.smallsh_history", home) >=
+                (int)sizeof(path)) {
+            return;
+        }
+        file = path;
+    }
+    if (file[0] == '\0') {
+        return;
+    }
+
+    history.fd =
+        open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    struct stat info;
+    if (history.fd < 0 || fstat(history.fd, &info) != 0 || info.st_size == 0) {
+        return;
+    }
+
+    off_t start = 0;
+    if ((uint64_t)info.st_size > UINT32_MAX) {
+        long pageSize = sysconf(_SC_PAGESIZE);
+        start =
+            (info.st_size - UINT32_MAX + pageSize - 1) / pageSize * pageSize;
+    }
+    void *map = mmap(NULL, (size_t)(info.st_size - start), PROT_READ,
+                     MAP_PRIVATE, history.fd, start);
+    if (map != MAP_FAILED) {
+        history.map = map;
+        history.mapLength = (size_t)(info.st_size - start);
+        history.scanEnd = history.mapLength;
+    }
+}
+
+/*******************************************************************************
+ * historyIndexLine()
+ *
+ *  Description:
+ *      Indexes the next older non-empty line of the mapped file, scanning
+ *      backwards from scanEnd with memrchr.
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 once the whole file is indexed.
+ ******************************************************************************/
+int historyIndexLine() {
+    while (history.scanEnd > 0) {
+        size_t end = history.scanEnd;
+        if (history.map[end - 1] == '\n') {
+            end--;
+        }
+        const char *newline = memrchr(history.map, '\n', end);
+        size_t start =
+            newline == NULL ? 0 : (size_t)(newline - history.map) + 1;
+        history.scanEnd = start;
+        if (start == end) {
+            continue;
+        }
+
+        if (history.nOffsets == history.offsetsCapacity) {
+            size_t capacity = history.offsetsCapacity == 0
+                                  ? 1024
+                                  : history.offsetsCapacity * 2;
+            uint32_t *offsets =
+                realloc(history.offsets, capacity * sizeof(uint32_t));
+            if (offsets == NULL) {
+                return -1;
+            }
+            history.offsets = offsets;
+            history.offsetsCapacity = capacity;
+        }
+        history.offsets[history.nOffsets++] = (uint32_t)start;
+        return 0;
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * historyEntry()
+ *
+ *  Description:
+ *      Returns the index'th newest command, 0 being the last one entered,
+ *      and stores its length. The text is not terminated.
+ *
+ *  Outputs:
+ *      Returns NULL when the history has fewer entries.
+ ******************************************************************************/
+const char *historyEntry(size_t index, size_t *length) {
+    if (index < history.nSession) {
+        const char *entry =
+            history.session +
+            history.sessionOffsets[history.nSession - 1 - index];
+        *length = strlen(entry);
+        return entry;
+    }
+
+    index -= history.nSession;
+    while (index >= history.nOffsets) {
+        if (historyIndexLine() != 0) {
+            return NULL;
+        }
+    }
+    const char *entry = history.map + history.offsets[index];
+    const char *newline =
+        memchr(entry, '\n', history.mapLength - history.offsets[index]);
+    *length = newline == NULL
+                  ? (size_t)(history.map + history.mapLength - entry)
+                  : (size_t)(newline - entry);
+    return entry;
+}
+
+/*******************************************************************************
+ * historyAdd()
+ *
+ *  Description:
+ *      Appends a command to the history file with a single write and keeps
+ *      it for this session. A repeat of the previous command is skipped.
+ ******************************************************************************/
+void historyAdd(const char *line) {
+    size_t length = strlen(line);
+    size_t previousLength;
+    const char *previous = historyEntry(0, &previousLength);
+    if (length == 0 || (previous != NULL && previousLength == length &&
+                        memcmp(previous, line, length) == 0)) {
+        return;
+    }
+
+    if (history.sessionLength + length + 1 > history.sessionCapacity ||
+        history.nSession == history.sessionOffsetsCapacity) {
+        size_t capacity = history.sessionCapacity * 2;
+        if (capacity < history.sessionLength + length + 1) {
+            capacity = history.sessionLength + length + 1 + 4096;
+        }
+        char *session = realloc(history.session, capacity);
+        if (session == NULL) {
+            return;
+        }
+        history.session = session;
+        history.sessionCapacity = capacity;
+
+        size_t offsetsCapacity = history.sessionOffsetsCapacity == 0
+                                     ? 256
+                                     : history.sessionOffsetsCapacity * 2;
+        uint32_t *offsets = realloc(history.sessionOffsets,
+                                    offsetsCapacity * sizeof(uint32_t));
+        if (offsets == NULL) {
+            return;
+        }
+        history.sessionOffsets = offsets;
+        history.sessionOffsetsCapacity = offsetsCapacity;
+    }
+    history.sessionOffsets[history.nSession++] =
+        (uint32_t)history.sessionLength;
+    memcpy(history.session + history.sessionLength, line, length + 1);
+    history.sessionLength += length + 1;
+
+    if (history.fd >= 0) {
+        struct iovec iov[2] = {{(void *)line, length}, {"\n", 1}};
+        if (writev(history.fd, iov, 2) < 0) {
+            close(history.fd);
+            history.fd = -1;
+        }
+    }
+}
+
+/*******************************************************************************
+ * Line editor
+ *
+ * At a terminal, lines are read in raw mode with ICANON and ECHO off but ISIG
+ * kept, so ctrl^c, ctrl^z and ctrl^\ still reach the event loop as signals.
+ * The terminal is put back in its normal mode as soon as a line is entered,
+ * before any command runs. Keys:
+ *
+ *  ctrl^a / ctrl^e, home / end  - start / end of the line
+ *  ctrl^b / ctrl^f, arrows      - move the cursor
+ *  ctrl^p / ctrl^n, up / down   - previous / next command in the history
+ *  ctrl^r                       - incremental search backwards in the history
+ *  ctrl^h, backspace / delete   - delete before / under the cursor
+ *  ctrl^k / ctrl^u / ctrl^w     - delete to the end / start / previous word
+ *  ctrl^d                       - delete under the cursor, end input if empty
+ *  ctrl^l                       - clear the screen
+ *  tab                          - complete a command or path, list on a second
+ ******************************************************************************/
+#define KEY_EOF -1       // end of input, or the shell is quitting
+#define KEY_INTERRUPT -2 // ctrl^c
+#define KEY_REDRAW -3    // something else was printed meanwhile
+#define KEY_UP 1000
+#define KEY_DOWN 1001
+#define KEY_RIGHT 1002
+#define KEY_LEFT 1003
+#define KEY_HOME 1004
+#define KEY_END 1005
+#define KEY_DELETE 1006 // CTRL() comes from <sys/ttydefaults.h>
+
+/*******************************************************************************
+ * inputExhausted()
+ *
+ *  Description:
+ *      Tells whether a batch script or -c string read in place has nothing
+ *      left but blank lines and comments, making the line just read the
+ *      last command.
+ *
+ *  Outputs:
+ *      Returns 1 if so, 0 otherwise and for input read through a buffer.
+ ******************************************************************************/
+int inputExhausted(InputSource *input) {
+    if (input->map == NULL) {
+        return 0;
+    }
+    size_t offset = input->mapOffset;
+    while (offset < input->mapLength) {
+        const char *start = input->map + offset;
+        size_t remaining = input->mapLength - offset;
+        const char *newline = memchr(start, '\n', remaining);
+        size_t length = newline == NULL ? remaining : (size_t)(newline - start);
+        if (length > 0 && start[0] != '#') {
+            for (size_t i = 0; i < length; i++) {
+                if (start[i] != ' ' && start[i] != '\t') {
+                    return 0;
+                }
+            }
+        }
+        offset += length + (newline != NULL);
+    }
+    return 1;
+}
+
+/*******************************************************************************
+ * readByte()
+ *
+ *  Description:
+ *      Returns the next byte typed, taken from the input buffer, which is
+ *      refilled once the event loop reports the terminal readable.
+ *
+ *  Outputs:
+ *      Returns the byte, or one of KEY_EOF, KEY_INTERRUPT and KEY_REDRAW.
+ ******************************************************************************/
+int readByte(InputSource *input) {
+    while (input->bufferStart == input->bufferEnd) {
+        input->bufferStart = 0;
+        input->bufferEnd = 0;
+        int handledEvents = 0;
+        while (!eventLoop.inputReady && eventLoop.inputFd >= 0 && !quit &&
+               !eventLoop.interrupted) {
+            if (runEventLoop(-1) < 0) {
+                break;
+            }
+            handledEvents = 1;
+        }
+        if (quit) {
+            return KEY_EOF;
+        }
+        if (eventLoop.interrupted) {
+            eventLoop.interrupted = 0;
+            return KEY_INTERRUPT;
+        }
+        if (!eventLoop.inputReady && handledEvents) {
+            return KEY_REDRAW;
+        }
+        eventLoop.inputReady = 0;
+
+        ssize_t nRead = read(input->fd, input->buffer, input->bufferCapacity);
+        if (nRead < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (nRead <= 0) {
+            return KEY_EOF;
+        }
+        input->bufferEnd = (size_t)nRead;
+    }
+    return (unsigned char)input->buffer[input->bufferStart++];
+}
+
+/*******************************************************************************
+ * readKey()
+ *
+ *  Description:
+ *      Returns the next key, decoding the escape sequences terminals send
+ *      for the arrows, home, end and delete. A sequence always arrives in
+ *      one read, so an escape with nothing after it is a lone escape key.
+ ******************************************************************************/
+int readKey(InputSource *input) {
+    int key = readByte(input);
+    if (key != 27 || input->bufferStart == input->bufferEnd) {
+        return key;
+    }
+
+    int kind = readByte(input);
+    if (kind != '[' && kind != 'O') {
+        return kind < 0 ? kind : 27;
+    }
+    int code = input->bufferStart < input->bufferEnd ? readByte(input) : 0;
+    if (code >= '0' && code <= '9') {
+        // ESC [ n ~, skipping any modifiers after a ;
+        int last = code;
+        while (input->bufferStart < input->bufferEnd &&
+               (last = readByte(input)) != '~' && last >= 0) {
+        }
+        switch (code) {
+        case '1':
+        case '7':
+            return KEY_HOME;
+        case '4':
+        case '8':
+            return KEY_END;
+        case '3':
+            return KEY_DELETE;
+        }
+        return KEY_REDRAW;
+    }
+    switch (code) {
+    case 'A':
+        return KEY_UP;
+    case 'B':
+        return KEY_DOWN;
+    case 'C':
+        return KEY_RIGHT;
+    case 'D':
+        return KEY_LEFT;
+    case 'H':
+        return KEY_HOME;
+    case 'F':
+        return KEY_END;
+    }
+    return KEY_REDRAW;
+}
+
+/*******************************************************************************
+ * reserveLine()
+ *
+ *  Description:
+ *      Makes sure the line buffer of the input source, which the editor
+ *      edits in place, can hold `length` bytes and a terminator.
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if it could not be grown.
+ ******************************************************************************/
+int reserveLine(InputSource *input, size_t length) {
+    if (length + 1 <= input->lineCapacity) {
+        return 0;
+    }
+    size_t capacity = input->lineCapacity == 0 ? 256 : input->lineCapacity * 2;
+    while (capacity < length + 1) {
+        capacity *= 2;
+    }
+    char *line = realloc(input->line, capacity);
+    if (line == NULL) {
+        return -1;
+    }
+    input->line = line;
+    input->lineCapacity = capacity;
+    return 0;
+}
+
+/*******************************************************************************
+ * refreshLine()
+ *
+ *  Description:
+ *      Redraws the prompt and text with the cursor at `cursor`, scrolling
+ *      the text sideways when it does not fit the terminal. The whole
+ *      update is one write().
+ ******************************************************************************/
+void refreshLine(int fd, const char *prompt, const char *text, size_t length,
+                 size_t cursor) {
+    struct winsize size;
+    size_t columns = 80;
+    if (ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) {
+        columns = size.ws_col;
+    }
+    size_t promptLength = strlen(prompt);
+    size_t width = columns > promptLength + 1 ? columns - promptLength - 1 : 1;
+    size_t first = cursor > width ? cursor - width : 0;
+    size_t visible = length - first < width ? length - first : width;
+
+    size_t needed = promptLength + visible + 32;
+    if (needed > lineEditor.screenCapacity) {
+        char *screen = realloc(lineEditor.screen, needed);
+        if (screen == NULL) {
+            return;
+        }
+        lineEditor.screen = screen;
+        lineEditor.screenCapacity = needed;
+    }
+
+    char *screen = lineEditor.screen;
+    size_t used = 0;
+    screen[used++] = '\r';
+    memcpy(screen + used, prompt, promptLength);
+    used += promptLength;
+    memcpy(screen + used, text + first, visible);
+    used += visible;
+    memcpy(screen + used, "\x1b[K\r", 4);
+    used += 4;
+    size_t column = promptLength + cursor - first;
+    if (column > 0) {
+        screen[used++] = '\x1b';
+        screen[used++] = '[';
+        formatInt(screen, &used, needed, (long)column);
+        screen[used++] = 'C';
+    }
+    write(STDOUT_FILENO, screen, used);
+}
+
+/*******************************************************************************
+ * searchHistory()
+ *
+ *  Description:
+ *      Finds the newest history entry at index `from` or older that contains
+ *      query.
+ *
+ *  Outputs:
+ *      Returns the index, or -1 if there is none. *position receives the
+ *      offset of the match in the entry.
+ ******************************************************************************/
+long searchHistory(const char *query, size_t queryLength, size_t from,
+                   size_t *position) {
+    size_t length;
+    const char *entry;
+    for (size_t i = from; (entry = historyEntry(i, &length)) != NULL; i++) {
+        const char *match = memmem(entry, length, query, queryLength);
+        if (match != NULL) {
+            *position = (size_t)(match - entry);
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * readDirectoryEntry()
+ *
+ *  Description:
+ *      Returns the next entry of the directory, refilling the reader's buffer
+ *      with one getdents64 call at a time so even directories with hundreds
+ *      of thousands of entries take few syscalls.
+ *
+ *  Outputs:
+ *      Returns NULL once every entry has been read or on error.
+ ******************************************************************************/
+struct linux_dirent64 *readDirectoryEntry(DirectoryReader *reader) {
+    if (reader->position >= reader->end) {
+        long nRead = syscall(SYS_getdents64, reader->fd, reader->buffer,
+                             sizeof(reader->buffer));
+        if (nRead <= 0) {
+            return NULL;
+        }
+        reader->position = 0;
+        reader->end = (size_t)nRead;
+    }
+
+    struct linux_dirent64 *entry =
+        (struct linux_dirent64 *)(reader->buffer + reader->position);
+    reader->position += entry->d_reclen;
+    return entry;
+}
+
+/*******************************************************************************
+ * isDirectoryEntry()
+ *
+ *  Description:
+ *      Whether the entry is a directory, or a link to one. stat is only
+ *      needed when the file system does not report the type.
+ ******************************************************************************/
+int isDirectoryEntry(int dirFd, const struct linux_dirent64 *entry) {
+    struct stat info;
+    if (entry->d_type == DT_DIR) {
+        return 1;
+    }
+    if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+        return 0;
+    }
+    return fstatat(dirFd, entry->d_name, &info, 0) == 0 &&
+           S_ISDIR(info.st_mode);
+}
+
+/*******************************************************************************
+ * compareIndexNames()
+ *
+ *  Description:
+ *      qsort_r comparator ordering name offsets by the names they point at.
+ ******************************************************************************/
+int compareIndexNames(const void *a, const void *b, void *text) {
+    return strcmp((char *)text + *(const uint32_t *)a,
+                  (char *)text + *(const uint32_t *)b);
+}
+
+/*******************************************************************************
+ * commandIndexAdd()
+ *
+ *  Description:
+ *      Appends a name to the command index, which is sorted once all names
+ *      are in.
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if the index could not be grown.
+ ******************************************************************************/
+int commandIndexAdd(const char *name) {
+    size_t length = strlen(name) + 1;
+    if (commandIndex.textLength + length > commandIndex.textCapacity) {
+        size_t capacity = commandIndex.textCapacity == 0
+                              ? 16384
+                              : commandIndex.textCapacity * 2;
+        while (capacity < commandIndex.textLength + length) {
+            capacity *= 2;
+        }
+        char *text = realloc(commandIndex.text, capacity);
+        if (text == NULL) {
+            return -1;
+        }
+        commandIndex.text = text;
+        commandIndex.textCapacity = capacity;
+    }
+    if (commandIndex.nNames == commandIndex.namesCapacity) {
+        size_t capacity = commandIndex.namesCapacity == 0
+                              ? 1024
+                              : commandIndex.namesCapacity * 2;
+        uint32_t *names =
+            realloc(commandIndex.names, capacity * sizeof(uint32_t));
+        if (names == NULL) {
+            return -1;
+        }
+        commandIndex.names = names;
+        commandIndex.namesCapacity = capacity;
+    }
+
+    commandIndex.names[commandIndex.nNames++] =
+        (uint32_t)commandIndex.textLength;
+    memcpy(commandIndex.text + commandIndex.textLength, name, length);
+    commandIndex.textLength += length;
+    return 0;
+}
+
+/*******************************************************************************
+ * commandIndexUpdate()
+ *
+ *  Description:
+ *      Builds the index of executables on $PATH if it was never built, if
+ *      $PATH changed or if inotify reported a change in one of its
+ *      directories since. Otherwise the index is used as it is, so a
+ *      completion never rescans $PATH needlessly. The builtins are indexed
+ *      too.
+ ******************************************************************************/
+void commandIndexUpdate() {
+    static const char *builtins[] = {"bg",     "cd",    "exit", "fg",
+                                     "hash",   "jobs",  "kill", "parallel",
+                                     "quit",   "stats", "status", "time",
+                                     "wait",   "bgpolicy", "on", "nice",
+                                     "ionice", "xargs"};
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+    if (commandIndex.pathSnapshot != NULL && !commandIndex.stale &&
+        strcmp(commandIndex.pathSnapshot, path) == 0) {
+        return;
+    }
+
+    // watch the directories afresh, they may not be the same ones
+    if (commandIndex.inotifyFd >= 0) {
+        epoll_ctl(eventLoop.epollFd, EPOLL_CTL_DEL, commandIndex.inotifyFd,
+                  NULL);
+        close(commandIndex.inotifyFd);
+    }
+    commandIndex.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (commandIndex.inotifyFd >= 0) {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.u64 = (uint64_t)EVENT_PATH << 32;
+        epoll_ctl(eventLoop.epollFd, EPOLL_CTL_ADD, commandIndex.inotifyFd,
+                  &event);
+    }
+    free(commandIndex.pathSnapshot);
+    commandIndex.pathSnapshot = strdup(path);
+    commandIndex.stale = 0;
+    commandIndex.nNames = 0;
+    commandIndex.textLength = 0;
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        commandIndexAdd(builtins[i]);
+    }
+
+    DirectoryReader *reader = malloc(sizeof(DirectoryReader));
+    if (reader == NULL) {
+        return;
+    }
+    char directory[4096];
+    for (const char *start = path; start != NULL;) {
+        const char *colon = strchr(start, ':');
+        size_t length = colon == NULL ? strlen(start) : (size_t)(colon - start);
+        if (length >= sizeof(directory)) {
+            start = colon == NULL ? NULL : colon + 1;
+            continue;
+        }
+        // an empty entry means the current directory
+        if (length == 0) {
+            strcpy(directory, ".");
+        } else {
+            memcpy(directory, start, length);
+            directory[length] = '\0';
+        }
+        start = colon == NULL ? NULL : colon + 1;
+
+        reader->fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (reader->fd < 0) {
+            continue;
+        }
+        if (commandIndex.inotifyFd >= 0) {
+            inotify_add_watch(commandIndex.inotifyFd, directory,
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                  IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+                                  IN_MOVE_SELF | IN_ONLYDIR);
+        }
+        reader->position = 0;
+        reader->end = 0;
+        struct linux_dirent64 *entry;
+        while ((entry = readDirectoryEntry(reader)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR ||
+                faccessat(reader->fd, entry->d_name, X_OK, 0) != 0 ||
+                isDirectoryEntry(reader->fd, entry)) {
+                continue;
+            }
+            commandIndexAdd(entry->d_name);
+        }
+        close(reader->fd);
+    }
+    free(reader);
+
+    // sort and drop the names found in more than one directory
+    qsort_r(commandIndex.names, commandIndex.nNames, sizeof(uint32_t),
+            compareIndexNames, commandIndex.text);
+    size_t nUnique = 0;
+    for (size_t i = 0; i < commandIndex.nNames; i++) {
+        if (nUnique == 0 ||
+            strcmp(commandIndex.text + commandIndex.names[nUnique - 1],
+                   commandIndex.text + commandIndex.names[i]) != 0) {
+            commandIndex.names[nUnique++] = commandIndex.names[i];
+        }
+    }
+    commandIndex.nNames = nUnique;
+}
+
+/*******************************************************************************
+ * Completion
+ *
+ * Tab completes the word before the cursor: a command name from the command
+ * index when it is the first word of a stage and has no /, otherwise a path.
+ * Only the longest common prefix of the candidates and up to
+ * COMPLETION_LIST_MAX names for listing are kept, so a directory of any size
+ * is completed in a single pass over its entries.
+ ******************************************************************************/
+#define COMPLETION_LIST_MAX 256
+struct Completion // candidates found for the word being completed
+{
+    char common[256]; // longest common prefix of every candidate
+    size_t commonLength;
+    size_t nMatches;
+    int isDirectory; // of the last candidate, used when there is only one
+    char *list;      // names shown on a second tab, \0 separated
+    size_t listLength;
+    size_t listCapacity;
+    size_t nListed;
+};
+typedef struct Completion Completion;
+
+/*******************************************************************************
+ * completionAdd()
+ *
+ *  Description:
+ *      Adds a candidate, narrowing the common prefix and keeping its name for
+ *      listing while there is room.
+ ******************************************************************************/
+void completionAdd(Completion *completion, const char *name, int isDirectory) {
+    size_t length = strlen(name);
+    if (completion->nMatches == 0) {
+        completion->commonLength = length < sizeof(completion->common)
+                                       ? length
+                                       : sizeof(completion->common) - 1;
+        memcpy(completion->common, name, completion->commonLength);
+    } else {
+        size_t i = 0;
+        while (i < completion->commonLength &&
+               completion->common[i] == name[i]) {
+            i++;
+        }
+        completion->commonLength = i;
+    }
+    completion->nMatches++;
+    completion->isDirectory = isDirectory;
+
+    if (completion->nListed < COMPLETION_LIST_MAX) {
+        if (completion->listLength + length + 2 > completion->listCapacity) {
+            size_t capacity = (completion->listCapacity + length + 2) * 2;
+            char *list = realloc(completion->list, capacity);
+            if (list == NULL) {
+                return;
+            }
+            completion->list = list;
+            completion->listCapacity = capacity;
+        }
+        memcpy(completion->list + completion->listLength, name, length);
+        completion->listLength += length;
+        if (isDirectory) {
+            completion->list[completion->listLength++] = '/';
+        }
+        completion->list[completion->listLength++] = '\0';
+        completion->nListed++;
+    }
+}
+
+/*******************************************************************************
+ * completeLine()
+ *
+ *  Description:
+ *      Completes the word before the cursor as far as every candidate
+ *      agrees. A unique candidate is finished with a space, or a / for a
+ *      directory. When the word can not be extended and listMatches is set,
+ *      the candidates are printed under the prompt.
+ *
+ *  Inputs:
+ *      InputSource *input - the line is edited in its line buffer
+ *      size_t *length
+ *      size_t *cursor
+ *      int listMatches    - set for a second tab in a row
+ ******************************************************************************/
+void completeLine(InputSource *input, size_t *length, size_t *cursor,
+                  int listMatches) {
+    char *line = input->line;
+    size_t start = *cursor;
+    while (start > 0 && line[start - 1] != ' ') {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && line[before - 1] == ' ') {
+        before--;
+    }
+
+    char word[4096];
+    size_t wordLength = *cursor - start;
+    if (wordLength >= sizeof(word)) {
+        return;
+    }
+    memcpy(word, line + start, wordLength);
+    word[wordLength] = '\0';
+    char *slash = strrchr(word, '/');
+    int isCommand = slash == NULL && (before == 0 || line[before - 1] == '|');
+
+    Completion completion = {{0}};
+    const char *prefix = word;
+    if (isCommand) {
+        commandIndexUpdate();
+        // binary search for the first name not sorting before the word
+        size_t low = 0;
+        size_t high = commandIndex.nNames;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (strcmp(commandIndex.text + commandIndex.names[middle], word) <
+                0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (size_t i = low; i < commandIndex.nNames; i++) {
+            const char *name = commandIndex.text + commandIndex.names[i];
+            if (strncmp(name, word, wordLength) != 0) {
+                break;
+            }
+            completionAdd(&completion, name, 0);
+        }
+    } else {
+        DirectoryReader *reader = malloc(sizeof(DirectoryReader));
+        if (reader == NULL) {
+            return;
+        }
+        const char *directory = ".";
+        if (slash != NULL) {
+            prefix = slash + 1;
+            *slash = '\0';
+            directory = slash == word ? "/" : word;
+        }
+        size_t prefixLength = strlen(prefix);
+
+        reader->fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        reader->position = 0;
+        reader->end = 0;
+        struct linux_dirent64 *entry;
+        while (reader->fd >= 0 &&
+               (entry = readDirectoryEntry(reader)) != NULL) {
+            const char *name = entry->d_name;
+            // hidden files only when asked for
+            if ((name[0] == '.' && prefix[0] != '.') ||
+                strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+                strncmp(name, prefix, prefixLength) != 0) {
+                continue;
+            }
+            completionAdd(&completion, name,
+                          isDirectoryEntry(reader->fd, entry));
+        }
+        if (reader->fd >= 0) {
+            close(reader->fd);
+        }
+        free(reader);
+    }
+
+    size_t prefixLength = strlen(prefix);
+    if (completion.nMatches > 0 && completion.commonLength >= prefixLength) {
+        // insert what every candidate has after the prefix
+        size_t extra = completion.commonLength - prefixLength;
+        int finish = completion.nMatches == 1;
+        size_t inserted = extra + (finish ? 1 : 0);
+        if (inserted > 0 && reserveLine(input, *length + inserted) == 0) {
+            line = input->line;
+            memmove(line + *cursor + inserted, line + *cursor,
+                    *length - *cursor);
+            memcpy(line + *cursor, completion.common + prefixLength, extra);
+            if (finish) {
+                line[*cursor + extra] = completion.isDirectory ? '/' : ' ';
+            }
+            *cursor += inserted;
+            *length += inserted;
+        }
+
+        if (inserted == 0 && listMatches && completion.nMatches > 1) {
+            write(STDOUT_FILENO, "\r\n", 2);
+            const char *name = completion.list;
+            for (size_t i = 0; i < completion.nListed; i++) {
+                size_t nameLength = strlen(name);
+                write(STDOUT_FILENO, name, nameLength);
+                write(STDOUT_FILENO, "  ", 2);
+                name += nameLength + 1;
+            }
+            if (completion.nMatches > completion.nListed) {
+                char more[64];
+                size_t moreLength = 0;
+                formatString(more, &moreLength, sizeof(more), "... ");
+                formatInt(more, &moreLength, sizeof(more),
+                          (long)(completion.nMatches - completion.nListed));
+                formatString(more, &moreLength, sizeof(more), " more");
+                write(STDOUT_FILENO, more, moreLength);
+            }
+            write(STDOUT_FILENO, "\r\n", 2);
+        }
+    }
+    free(completion.list);
+}
+
+/*******************************************************************************
+ * editLine()
+ *
+ *  Description:
+ *      Reads a line from the terminal with the line editor, or prints the
+ *      prompt and reads it with readLine() if the terminal can not be put in
+ *      raw mode.
+ *
+ *  Inputs:
+ *      InputSource *input
+ *      const char *prompt
+ *
+ *  Outputs:
+ *      Returns the line in the line buffer of the input source, or NULL on
+ *      ctrl^d on an empty line, when the shell is quitting or on error.
+ ******************************************************************************/
+char *editLine(InputSource *input, const char *prompt) {
+    struct termios rawMode;
+    if (tcgetattr(input->fd, &lineEditor.savedMode) != 0) {
+        fprintf(stdout, "%s", prompt);
+        fflush(stdout);
+        return readLine(input);
+    }
+    rawMode = lineEditor.savedMode;
+    rawMode.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    rawMode.c_lflag &= ~(ECHO | ICANON | IEXTEN);
+    rawMode.c_cc[VMIN] = 1;
+    rawMode.c_cc[VTIME] = 0;
+    if (tcsetattr(input->fd, TCSADRAIN, &rawMode) != 0 ||
+        reserveLine(input, 0) != 0) {
+        fprintf(stdout, "%s", prompt);
+        fflush(stdout);
+        return readLine(input);
+    }
+
+    size_t length = 0;
+    size_t cursor = 0;
+    long historyIndex = -1; // -1 while editing the draft
+
+    int searching = 0;
+    char query[256];
+    size_t queryLength = 0;
+    long match = -1;
+    size_t matchPosition = 0;
+    int searchFailed = 0;
+    char searchPrompt[sizeof(query) + 32];
+
+    char *result = NULL;
+    int done = 0;
+    int previousKey = 0;
+    refreshLine(input->fd, prompt, input->line, length, cursor);
+    while (!done) {
+        int key = readKey(input);
+
+        if (searching) {
+            size_t matchLength = 0;
+            const char *matchText =
+                match >= 0 ? historyEntry((size_t)match, &matchLength) : NULL;
+
+            if (key == CTRL('r') || (key >= 32 && key < 127) || key == 127 ||
+                key == CTRL('h')) {
+                size_t from = 0;
+                if (key == CTRL('r')) {
+                    from = match >= 0 ? (size_t)match + 1 : 0;
+                } else if (key == 127 || key == CTRL('h')) {
+                    if (queryLength > 0) {
+                        queryLength--;
+                    }
+                } else if (queryLength < sizeof(query)) {
+                    query[queryLength++] = (char)key;
+                    from = match >= 0 ? (size_t)match : 0;
+                }
+                size_t position = 0;
+                long found = queryLength == 0
+                                 ? -1
+                                 : searchHistory(query, queryLength, from,
+                                                 &position);
+                searchFailed = queryLength > 0 && found < 0;
+                if (found >= 0) {
+                    match = found;
+                    matchPosition = position;
+                } else if (queryLength == 0) {
+                    match = -1;
+                }
+            } else if (key == CTRL('g') || key == 27) {
+                searching = 0;
+            } else if (key == KEY_INTERRUPT || key == KEY_EOF) {
+                searching = 0;
+            } else if (key != KEY_REDRAW) {
+                // any other key takes the match and is handled as usual
+                searching = 0;
+                if (matchText != NULL && reserveLine(input, matchLength) == 0) {
+                    memcpy(input->line, matchText, matchLength);
+                    length = matchLength;
+                    cursor = matchPosition;
+                    historyIndex = -1;
+                }
+            }
+
+            if (searching) {
+                snprintf(searchPrompt, sizeof(searchPrompt),
+                         "(%sreverse-i-search)`%.*s': ",
+                         searchFailed ? "failed " : "", (int)queryLength,
+                         query);
+                matchText = match >= 0
+                                ? historyEntry((size_t)match, &matchLength)
+                                : NULL;
+                if (matchText != NULL) {
+                    refreshLine(input->fd, searchPrompt, matchText,
+                                matchLength, matchPosition);
+                } else {
+                    refreshLine(input->fd, searchPrompt, input->line, length,
+                                cursor);
+                }
+                continue;
+            }
+            if (key == CTRL('g') || key == 27) {
+                refreshLine(input->fd, prompt, input->line, length, cursor);
+                continue;
+            }
+        }
+
+        switch (key) {
+        case '\r':
+        case '\n':
+            refreshLine(input->fd, prompt, input->line, length, length);
+            write(STDOUT_FILENO, "\r\n", 2);
+            input->line[length] = '\0';
+            result = input->line;
+            done = 1;
+            break;
+        case KEY_EOF:
+            write(STDOUT_FILENO, "\r\n", 2);
+            done = 1;
+            break;
+        case CTRL('d'):
+            if (length == 0) {
+                // ctrl^d on an empty line, just prompt again
+                write(STDOUT_FILENO, "\r\n", 2);
+                done = 1;
+                break;
+            }
+            // fall through
+        case KEY_DELETE:
+            if (cursor < length) {
+                memmove(input->line + cursor, input->line + cursor + 1,
+                        length - cursor - 1);
+                length--;
+            }
+            break;
+        case KEY_INTERRUPT:
+            // ctrl^c discards the line
+            write(STDOUT_FILENO, "^C\r\n", 4);
+            length = 0;
+            cursor = 0;
+            historyIndex = -1;
+            break;
+        case 127:
+        case CTRL('h'):
+            if (cursor > 0) {
+                memmove(input->line + cursor - 1, input->line + cursor,
+                        length - cursor);
+                cursor--;
+                length--;
+            }
+            break;
+        case CTRL('a'):
+        case KEY_HOME:
+            cursor = 0;
+            break;
+        case CTRL('e'):
+        case KEY_END:
+            cursor = length;
+            break;
+        case CTRL('b'):
+        case KEY_LEFT:
+            if (cursor > 0) {
+                cursor--;
+            }
+            break;
+        case CTRL('f'):
+        case KEY_RIGHT:
+            if (cursor < length) {
+                cursor++;
+            }
+            break;
+        case CTRL('k'):
+            length = cursor;
+            break;
+        case CTRL('u'):
+            memmove(input->line, input->line + cursor, length - cursor);
+            length -= cursor;
+            cursor = 0;
+            break;
+        case CTRL('w'): {
+            size_t start = cursor;
+            while (start > 0 && input->line[start - 1] == ' ') {
+                start--;
+            }
+            while (start > 0 && input->line[start - 1] != ' ') {
+                start--;
+            }
+            memmove(input->line + start, input->line + cursor,
+                    length - cursor);
+            length -= cursor - start;
+            cursor = start;
+            break;
+        }
+        case CTRL('l'):
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            break;
+        case '\t':
+            // a second tab in a row lists what the first could not decide
+            completeLine(input, &length, &cursor, previousKey == '\t');
+            break;
+        case CTRL('r'):
+            searching = 1;
+            queryLength = 0;
+            match = -1;
+            searchFailed = 0;
+            refreshLine(input->fd, "(reverse-i-search)`': ", input->line,
+                        length, cursor);
+            continue;
+        case CTRL('p'):
+        case KEY_UP:
+        case CTRL('n'):
+        case KEY_DOWN: {
+            long next = historyIndex +
+                        (key == CTRL('p') || key == KEY_UP ? 1 : -1);
+            size_t entryLength = 0;
+            const char *entry =
+                next >= 0 ? historyEntry((size_t)next, &entryLength) : NULL;
+            if (next >= 0 && entry == NULL) {
+                break;
+            }
+            if (historyIndex == -1 && next == 0) {
+                // keep what was typed so far to come back to it
+                if (length > lineEditor.draftCapacity) {
+                    char *draft = realloc(lineEditor.draft, length);
+                    if (draft == NULL) {
+                        break;
+                    }
+                    lineEditor.draft = draft;
+                    lineEditor.draftCapacity = length;
+                }
+                memcpy(lineEditor.draft, input->line, length);
+                lineEditor.draftLength = length;
+            }
+            if (next < 0) {
+                if (historyIndex < 0) {
+                    break;
+                }
+                entry = lineEditor.draft;
+                entryLength = lineEditor.draftLength;
+            }
+            if (reserveLine(input, entryLength) == 0) {
+                memcpy(input->line, entry, entryLength);
+                length = entryLength;
+                cursor = length;
+                historyIndex = next;
+            }
+            break;
+        }
+        default:
+            if (key >= 32 && key != 127 && key < 256 &&
+                reserveLine(input, length + 1) == 0) {
+                memmove(input->line + cursor + 1, input->line + cursor,
+                        length - cursor);
+                input->line[cursor++] = (char)key;
+                length++;
+            }
+            break;
+        }
+
+        if (!done) {
+            refreshLine(input->fd, prompt, input->line, length, cursor);
+        }
+        previousKey = key;
+    }
+
+    tcsetattr(input->fd, TCSADRAIN, &lineEditor.savedMode);
+    return result;
+}
+
+/*******************************************************************************
+ * cacheShellPid()
+ *
+ *  Description:
+ *      Formats the shell's pid once for $$.
+ ******************************************************************************/
+void cacheShellPid() {
+    shellPidLength = 0;
+    formatInt(shellPid, &shellPidLength, sizeof(shellPid), getpid());
+}
+
+/*******************************************************************************
+ * lookupVariable()
+ *
+ *  Description:
+ *      Finds the environment variable named by the `length` bytes at name,
+ *      which do not need to be terminated.
+ *
+ *  Outputs:
+ *      Returns its value, or NULL if it is not set.
+ ******************************************************************************/
+const char *lookupVariable(const char *name, size_t length) {
+    for (char **entry = environ; *entry != NULL; entry++) {
+        if (strncmp(*entry, name, length) == 0 && (*entry)[length] == '=') {
+            return *entry + length + 1;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * isNameChar()
+ *
+ *  Description:
+ *      Whether c may appear in a variable name, digits only after the first
+ *      character.
+ ******************************************************************************/
+int isNameChar(char c, int first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           (!first && c >= '0' && c <= '9');
+}
+
+/*******************************************************************************
+ * variableAt()
+ *
+ *  Description:
+ *      Resolves the reference starting at the $ in at:
+ *
+ *          $$          - pid of the shell
+ *          $?          - exit value of the last command, 128 + signal if it
+ *                        was killed by one
+ *          $!          - pid of the last background command
+ *          $NAME       - environment variable, empty when not set
+ *          ${NAME}     - same, for names followed by name characters
+ *
+ *  Inputs:
+ *      const char *at       - points at the $
+ *      size_t *consumed     - receives the length of the reference
+ *      size_t *valueLength  - receives the length of the value
+ *      char *scratch        - 24 bytes numbers are formatted into
+ *
+ *  Outputs:
+ *      Returns the value, or NULL if the $ does not start a reference and
+ *      is kept as it is, in which case *consumed is 1.
+ ******************************************************************************/
+const char *variableAt(const char *at, size_t *consumed, size_t *valueLength,
+                       char *scratch) {
+    const char *name = at + 1;
+    const char *value = NULL;
+    size_t nameLength = 0;
+
+    *consumed = 2;
+    *valueLength = 0;
+    switch (*name) {
+    case '$':
+        *valueLength = shellPidLength;
+        return shellPid;
+    case '?':
+        formatInt(scratch, valueLength, 24,
+                  WIFSIGNALED(currentStatus) ? 128 + WTERMSIG(currentStatus)
+                                             : WEXITSTATUS(currentStatus));
+        return scratch;
+    case '!':
+        if (lastBackgroundPid > 0) {
+            formatInt(scratch, valueLength, 24, lastBackgroundPid);
+        }
+        return scratch;
+    case '{':
+        while (isNameChar(name[1 + nameLength], nameLength == 0)) {
+            nameLength++;
+        }
+        if (nameLength == 0 || name[1 + nameLength] != '}') {
+            *consumed = 1;
+            return NULL;
+        }
+        *consumed = nameLength + 3;
+        value = lookupVariable(name + 1, nameLength);
+        break;
+    default:
+        while (isNameChar(name[nameLength], nameLength == 0)) {
+            nameLength++;
+        }
+        if (nameLength == 0) {
+            *consumed = 1;
+            return NULL;
+        }
+        *consumed = nameLength + 1;
+        value = lookupVariable(name, nameLength);
+        break;
+    }
+
+    if (value == NULL) {
+        return "";
+    }
+    *valueLength = strlen(value);
+    return value;
+}
+
+/*******************************************************************************
+ * expandCopy()
+ *
+ *  Description:
+ *      Appends n bytes of text to the expansion at out[*length], or only
+ *      counts them when out is NULL. With `escape` set, the quotes,
+ *      backslashes and operators <, >, | and & of a variable's value are
+ *      escaped so the parser takes them literally as part of an argument.
+ *      Within "" only the bytes a backslash escapes there are, as nothing
+ *      else is special.
+ ******************************************************************************/
+void expandCopy(char *out, size_t *length, const char *text, size_t n,
+                int escape, int inDouble) {
+    if (!escape) {
+        if (out != NULL) {
+            memcpy(out + *length, text, n);
+        }
+        *length += n;
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        char c = text[i];
+        if (c == '"' || c == '\\' ||
+            (!inDouble && strchr("'<>|&", c) != NULL)) {
+            if (out != NULL) {
+                out[*length] = '\\';
+            }
+            (*length)++;
+        }
+        if (out != NULL) {
+            out[*length] = c;
+        }
+        (*length)++;
+    }
+}
+
+/*******************************************************************************
+ * expandLine()
+ *
+ *  Description:
+ *      Expands the variable references of line into out, or only measures
+ *      the expansion when out is NULL. strpbrk() jumps from one $ to the
+ *      next, or with `quoting` set from one $, quote or backslash to the
+ *      next. Then nothing is expanded within '' or after a backslash, and
+ *      quotes and backslashes are kept for the parser. Here-doc bodies are
+ *      expanded without quoting.
+ *
+ *  Outputs:
+ *      Returns the length of the expansion, without its terminator.
+ ******************************************************************************/
+size_t expandLine(const char *line, char *out, int quoting) {
+    char scratch[24];
+    size_t consumed;
+    size_t valueLength;
+    size_t length = 0;
+    int inDouble = 0;
+    const char *at = line;
+    const char *special;
+    while ((special = strpbrk(at, quoting ? "$'\"\\" : "$")) != NULL) {
+        expandCopy(out, &length, at, (size_t)(special - at), 0, 0);
+        at = special;
+        if (*at == '$') {
+            const char *value =
+                variableAt(at, &consumed, &valueLength, scratch);
+            if (value == NULL) {
+                expandCopy(out, &length, at, 1, 0, 0);
+            } else {
+                expandCopy(out, &length, value, valueLength, quoting,
+                           inDouble);
+            }
+            at += consumed;
+            continue;
+        }
+
+        consumed = 1;
+        if (*at == '\\' && at[1] != '\0') {
+            consumed = 2;
+        } else if (*at == '\'' && !inDouble) {
+            const char *close = strchr(at + 1, '\'');
+            consumed = close == NULL ? strlen(at) : (size_t)(close - at) + 1;
+        } else if (*at == '"') {
+            inDouble = !inDouble;
+        }
+        expandCopy(out, &length, at, consumed, 0, 0);
+        at += consumed;
+    }
+    size_t rest = strlen(at);
+    expandCopy(out, &length, at, rest + 1, 0, 0);
+    return length - 1;
+}
+
+/*******************************************************************************
+ * expandVariables()
+ *
+ *  Description:
+ *      Expands every variable reference in line with expandLine(). The
+ *      expanded length is measured first so the reused expansion buffer is
+ *      sized exactly once, and the values are then copied in. Both passes
+ *      are linear in the length of the line and its expansion.
+ *
+ *  Outputs:
+ *      Returns line itself when it has no $, otherwise the expansion buffer
+ *      of the input source. Returns NULL if the buffer could not be grown.
+ ******************************************************************************/
+char *expandVariables(InputSource *input, char *line, int quoting) {
+    if (strchr(line, '$') == NULL) {
+        return line;
+    }
+
+    size_t length = expandLine(line, NULL, quoting);
+    if (length + 1 > input->expansionCapacity) {
+        size_t capacity = input->expansionCapacity * 2;
+        if (capacity < length + 1) {
+            capacity = length + 1;
+        }
+        char *expansion = realloc(input->expansion, capacity);
+        if (expansion == NULL) {
+            raise(SIGUSR1);
+            return NULL;
+        }
+        input->expansion = expansion;
+        input->expansionCapacity = capacity;
+    }
+
+    expandLine(line, input->expansion, quoting);
+    return input->expansion;
+}
+
+/*******************************************************************************
+ * getInputString
+ *
+ *  Description
+ *      Prints queued job notices, then returns the next command line from
+ *      the input source with comments and blank lines skipped and variables
+ *      expanded. Lines typed at a terminal go through the line editor and
+ *      are added to the history.
+ *
+ *  Inputs:
+ *      InputSource *input
+ *
+ *  Outputs:
+ *      Returns a char* into a buffer owned by the input source, valid until
+ *      the next call. Returns null on failure or at the end of a batch
+ *      script, where input->atEof is set.
+ ******************************************************************************/
+char *getInputString(InputSource *input) {
+    while (1) {
+        noticeFlush();
+        if (input->interactive) {
+            traceFlush();
+        }
+        char *temp_str =
+            input->interactive ? editLine(input, ": ") : readLine(input);
+        if (temp_str == NULL) {
+            return NULL;
+        }
+        traceBegin();
+
+        if (temp_str[0] == '\0' || temp_str[0] == '#') {
+            // ignore comments and blank lines
+            continue;
+        }
+        if (input->interactive) {
+            historyAdd(temp_str);
+        }
+        char *expanded = expandVariables(input, temp_str, 1);
+        traceStamp(&trace.current.expand);
+        return expanded;
+    }
+}
+
+/*******************************************************************************
+ * appendDocument()
+ *
+ *  Description:
+ *      Appends `length` bytes to the reused documents buffer of the input
+ *      source, growing it as needed.
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if the buffer could not be grown.
+ ******************************************************************************/
+int appendDocument(InputSource *input, size_t *used, const char *data,
+                   size_t length) {
+    if (*used + length > input->documentsCapacity) {
+        size_t capacity =
+            input->documentsCapacity == 0 ? 256 : input->documentsCapacity * 2;
+        while (capacity < *used + length) {
+            capacity *= 2;
+        }
+        char *documents = realloc(input->documents, capacity);
+        if (documents == NULL) {
+            return -1;
+        }
+        input->documents = documents;
+        input->documentsCapacity = capacity;
+    }
+
+    memcpy(input->documents + *used, data, length);
+    *used += length;
+    return 0;
+}
+
+/*******************************************************************************
+ * readHereDocuments()
+ *
+ *  Description:
+ *      Reads the body of every <<word in the pipeline from the input, up to a
+ *      line holding only word or the end of the input, expands variables in
+ *      it and points the stage's inputDocument_ptr at it. The bodies are
+ *      kept in the documents buffer of the input source, which is reused for
+ *      every command. Reading more lines overwrites the buffer the command
+ *      line came from, so the line is copied there first and commandLine is
+ *      updated to the copy.
+ *
+ *  Inputs:
+ *      InputSource *input
+ *      UserInputStruct *userInput - first stage, the rest are linked by next
+ *      char **commandLine
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if the bodies could not be stored.
+ ******************************************************************************/
+int readHereDocuments(InputSource *input, UserInputStruct *userInput,
+                      char **commandLine) {
+    int haveHereDocs = 0;
+    for (UserInputStruct *stage = userInput; stage != NULL;
+         stage = stage->next) {
+        if (stage->hereDocDelimiter_ptr != NULL) {
+            haveHereDocs = 1;
+        }
+    }
+    if (!haveHereDocs) {
+        return 0;
+    }
+
+    size_t used = 0;
+    size_t lineLength = strlen(*commandLine);
+    if (appendDocument(input, &used, *commandLine, lineLength + 1) != 0) {
+        return -1;
+    }
+
+    for (UserInputStruct *stage = userInput; stage != NULL;
+         stage = stage->next) {
+        if (stage->hereDocDelimiter_ptr == NULL) {
+            continue;
+        }
+        size_t start = used;
+        while (1) {
+            char *line =
+                input->interactive ? editLine(input, "> ") : readLine(input);
+            if (line == NULL ||
+                strcmp(line, stage->hereDocDelimiter_ptr) == 0) {
+                break;
+            }
+            line = expandVariables(input, line, 0);
+            if (line == NULL) {
+                return -1;
+            }
+            if (appendDocument(input, &used, line, strlen(line)) != 0 ||
+                appendDocument(input, &used, "\n", 1) != 0) {
+                return -1;
+            }
+        }
+        stage->inputDocumentLength = used - start;
+    }
+
+    // the buffer may have moved while it grew, point into it only now
+    size_t offset = lineLength + 1;
+    for (UserInputStruct *stage = userInput; stage != NULL;
+         stage = stage->next) {
+        if (stage->hereDocDelimiter_ptr != NULL) {
+            stage->inputDocument_ptr = input->documents + offset;
+            stage->hereDocDelimiter_ptr = NULL;
+            offset += stage->inputDocumentLength;
+        }
+    }
+    *commandLine = input->documents;
+    return 0;
+}
+
+/*******************************************************************************
+ * arenaReserve()
+ *
+ *  Description:
+ *      Makes sure the arena can hold at least `bytes` bytes after a reset.
+ *      The block is only replaced when it is too small, so in steady state
+ *      parsing a command performs no allocations at all.
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 if the allocation failed.
+ ******************************************************************************/
+int arenaReserve(Arena *arena, size_t bytes) {
+    arena->used = 0;
+    if (arena->capacity >= bytes) {
+        return 0;
+    }
+
+    size_t capacity = arena->capacity * 2;
+    if (capacity < bytes) {
+        capacity = bytes;
+    }
+
+    free(arena->base);
+    arena->base = malloc(capacity);
+    if (arena->base == NULL) {
+        arena->capacity = 0;
+        return -1;
+    }
+    arena->capacity = capacity;
+    return 0;
+}
+
+/*******************************************************************************
+ * arenaAlloc()
+ *
+ *  Description:
+ *      Carves `bytes` bytes aligned for any pointer type out of the arena.
+ *      Callers reserve the space up front, so this only fails on a bug.
+ ******************************************************************************/
+void *arenaAlloc(Arena *arena, size_t bytes) {
+    size_t offset = (arena->used + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (offset + bytes > arena->capacity) {
+        return NULL;
+    }
+    arena->used = offset + bytes;
+    return arena->base + offset;
+}
+
+/*******************************************************************************
+ * arenaReset()
+ *
+ *  Description:
+ *      Releases everything allocated from the arena in one step. The memory
+ *      block itself is kept for the next command.
+ ******************************************************************************/
+void arenaReset(Arena *arena) { arena->used = 0; }
+
+/******************************************************************************
+ * Lexer
+ *
+ * Lines of several megabytes are mostly long runs of ordinary characters,
+ * so the parser asks lexScan() for the next byte that ends a run instead of
+ * looking at every byte itself. On x86-64 the run is searched 32 bytes at a
+ * time with AVX2 when the CPU has it, 16 at a time with SSE2 otherwise, and
+ * the ordinary characters in between are copied with memcpy. Short words
+ * are not worth the call and are still copied a byte at a time. Other
+ * architectures use the scalar loop, which is also what the SIMD versions
+ * fall back to for the last bytes of a line.
+ ******************************************************************************/
+// what ends a run of ordinary bytes, one bit per context
+#define LEX_WORD 1   // unquoted: blanks, quotes and backslash
+#define LEX_DOUBLE 2 // within "": closing quote and backslash
+#define LEX_SINGLE 4 // within '': closing quote
+#define LEX_SHORT 16 // bytes copied one at a time before calling lexScan()
+
+// the contexts each byte ends a run in, NUL ending the line in all of them
+const unsigned char lexClass[256] = {
+    ['\0'] = LEX_WORD | LEX_DOUBLE | LEX_SINGLE,
+    [' '] = LEX_WORD,
+    ['\t'] = LEX_WORD,
+    ['\''] = LEX_WORD | LEX_SINGLE,
+    ['"'] = LEX_WORD | LEX_DOUBLE,
+    ['\\'] = LEX_WORD | LEX_DOUBLE,
+};
+
+// the same bytes for the SIMD versions, always five, repeated if fewer
+const char lexBytes[LEX_SINGLE + 1][5] = {
+    [LEX_WORD] = {' ', '\t', '\'', '"', '\\'},
+    [LEX_DOUBLE] = {'"', '\\', '"', '\\', '"'},
+    [LEX_SINGLE] = {'\'', '\'', '\'', '\'', '\''},
+};
+
+/*******************************************************************************
+ * lexScanScalar()
+ *
+ *  Description:
+ *      Returns the first byte of [at, end) that ends a run in the context
+ *      `set`, one of the LEX_* bits, or end if there is none.
+ ******************************************************************************/
+const char *lexScanScalar(const char *at, const char *end, int set) {
+    while (at < end && !(lexClass[(unsigned char)*at] & set)) {
+        at++;
+    }
+    return at;
+}
+
+#if defined(__x86_64__)
+/*******************************************************************************
+ * lexScanSse2()
+ *
+ *  Description:
+ *      lexScanScalar() 16 bytes at a time. SSE2 is part of x86-64.
+ ******************************************************************************/
+const char *lexScanSse2(const char *at, const char *end, int set) {
+    const char *bytes = lexBytes[set];
+    __m128i byte0 = _mm_set1_epi8(bytes[0]);
+    __m128i byte1 = _mm_set1_epi8(bytes[1]);
+    __m128i byte2 = _mm_set1_epi8(bytes[2]);
+    __m128i byte3 = _mm_set1_epi8(bytes[3]);
+    __m128i byte4 = _mm_set1_epi8(bytes[4]);
+    while (end - at >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)at);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, byte0),
+                         _mm_cmpeq_epi8(block, byte1)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, byte2),
+                                      _mm_cmpeq_epi8(block, byte3)),
+                         _mm_cmpeq_epi8(block, byte4)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return at + __builtin_ctz((unsigned)mask);
+        }
+        at += 16;
+    }
+    return lexScanScalar(at, end, set);
+}
+
+/*******************************************************************************
+ * lexScanAvx2()
+ *
+ *  Description:
+ *      lexScanScalar() 32 bytes at a time, compiled for AVX2 on its own so
+ *      the rest of the shell still runs on any x86-64. The last bytes are
+ *      scanned here too rather than by the SSE2 version, as mixing the two
+ *      without a vzeroupper in between stalls some CPUs.
+ ******************************************************************************/
+__attribute__((target("avx2"))) const char *
+lexScanAvx2(const char *at, const char *end, int set) {
+    const char *bytes = lexBytes[set];
+    __m256i byte0 = _mm256_set1_epi8(bytes[0]);
+    __m256i byte1 = _mm256_set1_epi8(bytes[1]);
+    __m256i byte2 = _mm256_set1_epi8(bytes[2]);
+    __m256i byte3 = _mm256_set1_epi8(bytes[3]);
+    __m256i byte4 = _mm256_set1_epi8(bytes[4]);
+    while (end - at >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)at);
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, byte0),
+                            _mm256_cmpeq_epi8(block, byte1)),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, byte2),
+                                            _mm256_cmpeq_epi8(block, byte3)),
+                            _mm256_cmpeq_epi8(block, byte4)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return at + __builtin_ctz(mask);
+        }
+        at += 32;
+    }
+    while (at < end && !(lexClass[(unsigned char)*at] & set)) {
+        at++;
+    }
+    return at;
+}
+#endif
+
+const char *lexScanSelect(const char *at, const char *end, int set);
+
+// the best lexScan*() for this CPU, picked on the first call
+const char *(*lexScan)(const char *, const char *, int) = lexScanSelect;
+
+/*******************************************************************************
+ * lexScanSelect()
+ *
+ *  Description:
+ *      Points lexScan at the widest version the CPU supports, then scans.
+ ******************************************************************************/
+const char *lexScanSelect(const char *at, const char *end, int set) {
+    lexScan = lexScanScalar;
+#if defined(__x86_64__)
+    lexScan = lexScanSse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lexScan = lexScanAvx2;
+    }
+#endif
+    return lexScan(at, end, set);
+}
+
+/*******************************************************************************
+ * lexCopy()
+ *
+ *  Description:
+ *      Copies the run of ordinary bytes starting at `at` to `out` and returns
+ *      where it ends, with *outEnd set past the copy. Most words are short,
+ *      so the first LEX_SHORT bytes are copied here one at a time and only
+ *      longer runs are left to lexScan() and memcpy.
+ ******************************************************************************/
+const char *lexCopy(const char *at, const char *end, int set, char *out,
+                    char **outEnd) {
+    const char *limit = end - at > LEX_SHORT ? at + LEX_SHORT : end;
+    while (at < limit && !(lexClass[(unsigned char)*at] & set)) {
+        *out++ = *at++;
+    }
+    if (at == limit && at < end) {
+        const char *stop = lexScan(at, end, set);
+        memcpy(out, at, (size_t)(stop - at));
+        out += stop - at;
+        at = stop;
+    }
+    *outEnd = out;
+    return at;
+}
+
+/*******************************************************************************
+ * parseArenaBound()
+ *
+ *  Description:
+ *      Upper bound on the arena space getuserInputFromString() can use for a
+ *      line of `length` bytes. Every token is followed by a separator or the
+ *      end of the line, so the token text needs at most length + 1 bytes and
+ *      there are at most length / 2 + 1 tokens. Each | is a token that takes
+ *      the place of an argument, so arguments plus the NULL ending each
+ *      stage's argv fit in length / 2 + 2 slots, and there are at most
+ *      length / 2 + 1 extra stages.
+ ******************************************************************************/
+size_t parseArenaBound(size_t length) {
+    return (length / 2 + 2) * sizeof(char *) +
+           (length / 2 + 1) * sizeof(UserInputStruct) + length + 1 +
+           2 * sizeof(void *);
+}
+
+/*******************************************************************************
+ * getuserInputFromString()
+ *
+ *  Description:
+ *      Splits the input line on blanks in a single pass, with lexScan()
+ *      finding where each run of ordinary characters ends. Within '' every
+ *      byte is literal, within "" a backslash escapes ", \, $ and `, and
+ *      elsewhere it escapes any byte. Arguments are copied into the arena
+ *      without their quotes and collected in argv, while the operators,
+ *      unless quoted, fill in the rest of the struct:
+ *
+ *          < file  - redirect stdin of the stage, the last one wins
+ *          <<word  - here-doc, stdin is the following lines up to word. The
+ *                    parser only records word in hereDocDelimiter_ptr, the
+ *                    body is read by readHereDocuments()
+ *          <<<word - here-string, stdin is word and a newline
+ *          > file  - redirect stdout of the stage, the last one wins
+ *          |       - start a new stage, linked through next
+ *          &       - run in the background, only honoured as the last token
+ *
+ *      Everything lives in the arena, so the result is released with a
+ *      single arenaReset(). The parser holds no state outside its arguments.
+ *
+ * Inputs:
+ *  const char* userInputString
+ *  Arena* arena
+ *
+ * Outputs:
+ *  Returns a UserInputStruct containing the necessary info to execute a
+ *  command sent by the user. checkSum is 0 if the arena could not be
+ *  allocated (argv is NULL), a redirection is missing its file name, a
+ *  pipeline stage is empty or a quote is not closed.
+ *
+ ******************************************************************************/
+UserInputStruct getuserInputFromString(const char *userInputString,
+                                       Arena *arena) {
+    // initialize the struct
+    UserInputStruct userInput = {0};
+
+    size_t length = strlen(userInputString);
+    if (arenaReserve(arena, parseArenaBound(length)) != 0) {
+        raise(SIGUSR1);
+        return userInput;
+    }
+
+    char **argvSlots = arenaAlloc(arena, (length / 2 + 2) * sizeof(char *));
+    UserInputStruct *extraStages =
+        arenaAlloc(arena, (length / 2 + 1) * sizeof(UserInputStruct));
+    char *text = arenaAlloc(arena, length + 1);
+
+    UserInputStruct *stage = &userInput;
+    stage->argv = argvSlots;
+    userInput.checkSum = 1;
+
+    char **pendingDestination = NULL;
+    int pendingHereString = 0;
+    int sawAmpersand = 0;
+    const char *cursor = userInputString;
+    const char *end = userInputString + length;
+
+    while (1) {
+        while (*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+        if (*cursor == '\0') {
+            break;
+        }
+
+        // copy the token into the arena without its quotes and backslashes.
+        // Operators only count when they were not quoted, up to `plain`.
+        char *token = text;
+        int quoted = 0;
+        size_t plain = 0;
+        while (cursor < end) {
+            // most words are short enough to copy here, lexCopy() takes the
+            // rest. The NUL ending the line stops the loop like a blank.
+            size_t n = 0;
+            while (n < LEX_SHORT &&
+                   !(lexClass[(unsigned char)cursor[n]] & LEX_WORD)) {
+                text[n] = cursor[n];
+                n++;
+            }
+            cursor += n;
+            text += n;
+            if (n == LEX_SHORT) {
+                cursor = lexCopy(cursor, end, LEX_WORD, text, &text);
+            }
+            if (cursor == end || *cursor == ' ' || *cursor == '\t') {
+                break;
+            }
+            if (!quoted) {
+                plain = (size_t)(text - token);
+                quoted = 1;
+            }
+
+            if (*cursor == '\\') {
+                // the next byte as it is
+                cursor++;
+                if (cursor < end) {
+                    *text++ = *cursor++;
+                }
+            } else if (*cursor == '\'') {
+                cursor = lexCopy(cursor + 1, end, LEX_SINGLE, text, &text);
+                if (cursor == end) {
+                    userInput.checkSum = 0;
+                } else {
+                    cursor++;
+                }
+            } else {
+                // within "" a backslash only escapes ", \, $ and `
+                cursor++;
+                while (1) {
+                    cursor = lexCopy(cursor, end, LEX_DOUBLE, text, &text);
+                    if (cursor == end) {
+                        userInput.checkSum = 0;
+                        break;
+                    }
+                    if (*cursor == '"') {
+                        cursor++;
+                        break;
+                    }
+                    if (cursor + 1 < end && strchr("\"\\$`", cursor[1])) {
+                        cursor++;
+                    }
+                    *text++ = *cursor++;
+                }
+            }
+        }
+        *text++ = '\0';
+        if (!quoted) {
+            plain = (size_t)(text - token) - 1;
+        }
+
+        if (pendingHereString || (pendingDestination == NULL && plain >= 3 &&
+                                  strncmp(token, "<<<", 3) == 0)) {
+            // the text of a here-string is the word and a newline. The space
+            // for the newline comes from the <<< that is dropped.
+            size_t skip = pendingHereString ? 0 : 3;
+            size_t wordLength = (size_t)(text - token) - 1 - skip;
+            if (wordLength == 0 && !pendingHereString && !quoted) {
+                // <<< on its own, the word is the next token
+                text = token;
+                pendingHereString = 1;
+                continue;
+            }
+            memmove(token, token + skip, wordLength);
+            token[wordLength] = '\n';
+            token[wordLength + 1] = '\0';
+            text = token + wordLength + 2;
+            stage->inputDocument_ptr = token;
+            stage->inputDocumentLength = wordLength + 1;
+            stage->inputDestination_ptr = NULL;
+            stage->hereDocDelimiter_ptr = NULL;
+            pendingHereString = 0;
+        } else if (pendingDestination != NULL) {
+            *pendingDestination = token;
+            pendingDestination = NULL;
+        } else if (!quoted && strcmp(token, "<") == 0) {
+            pendingDestination = &stage->inputDestination_ptr;
+            stage->inputDocument_ptr = NULL;
+            stage->hereDocDelimiter_ptr = NULL;
+        } else if (plain >= 2 && strncmp(token, "<<", 2) == 0) {
+            stage->inputDestination_ptr = NULL;
+            stage->inputDocument_ptr = NULL;
+            if (token[2] == '\0') {
+                pendingDestination = &stage->hereDocDelimiter_ptr;
+            } else {
+                stage->hereDocDelimiter_ptr = token + 2;
+            }
+        } else if (!quoted && strcmp(token, ">") == 0) {
+            pendingDestination = &stage->outputDestination_ptr;
+        } else if (!quoted && strcmp(token, "|") == 0) {
+            if (stage->argc == 0) {
+                userInput.checkSum = 0;
+            }
+            // done with this stage, append null pointer and start the next
+            stage->argv[stage->argc] = NULL;
+            argvSlots += stage->argc + 1;
+
+            UserInputStruct *nextStage = extraStages++;
+            *nextStage = (UserInputStruct){0};
+            nextStage->argv = argvSlots;
+            stage->next = nextStage;
+            stage = nextStage;
+        } else if (!quoted && strcmp(token, "&") == 0) {
+            sawAmpersand = 1;
+            continue;
+        } else {
+            //  item is command or arg
+            stage->argv[stage->argc++] = token;
+        }
+
+        // an & followed by more text is ignored
+        sawAmpersand = 0;
+    }
+
+    // done processing args, append null pointer
+    stage->argv[stage->argc] = NULL;
+
+    if (sawAmpersand) {
+        // User would like to run in background, unless in foreground-only
+        // mode which the caller applies
+        userInput.runInBackground = 1;
+    }
+
+    // a trailing < or > without a file name or an empty stage after a | is
+    // a syntax error
+    if (pendingDestination != NULL || pendingHereString ||
+        (stage != &userInput && stage->argc == 0)) {
+        userInput.checkSum = 0;
+    }
+
+    return userInput;
+}
+
+/*******************************************************************************
+ * hashString()
+ *
+ *  Description:
+ *      FNV-1a hash of a NUL terminated string.
+ ******************************************************************************/
+size_t hashString(const char *str) {
+    size_t hash = (size_t)2166136261u;
+    while (*str != '\0') {
+        hash = (hash ^ (unsigned char)*str++) * (size_t)16777619u;
+    }
+    return hash;
+}
+
+/*******************************************************************************
+ * Parse cache
+ *
+ * Scripts run the same command lines over and over. The parse of each line
+ * up to PARSE_CACHE_LINE_MAX bytes is copied into a single block keyed by
+ * the hash of the expanded line, so a line seen before is found with one
+ * hash and one strcmp and not tokenized again. The blocks are kept in least
+ * recently used order and the oldest is dropped beyond PARSE_CACHE_ENTRIES.
+ * A cached command is shared by every run of the line, so it is never
+ * written to. Lines with here-docs are not cached, their stages are filled
+ * in after parsing.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * parseCacheString()
+ *
+ *  Description:
+ *      Copies `length` bytes and a NUL to *text and advances it.
+ ******************************************************************************/
+char *parseCacheString(char **text, const char *str, size_t length) {
+    char *copy = *text;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    *text += length + 1;
+    return copy;
+}
+
+/*******************************************************************************
+ * parseCacheUnlink()
+ *
+ *  Description:
+ *      Takes an entry out of the recency list.
+ ******************************************************************************/
+void parseCacheUnlink(ParseCacheEntry *entry) {
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        parseCache.newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        parseCache.oldest = entry->newer;
+    }
+}
+
+/*******************************************************************************
+ * parseCachePush()
+ *
+ *  Description:
+ *      Makes an entry the most recently used.
+ ******************************************************************************/
+void parseCachePush(ParseCacheEntry *entry) {
+    entry->newer = NULL;
+    entry->older = parseCache.newest;
+    if (parseCache.newest != NULL) {
+        parseCache.newest->newer = entry;
+    } else {
+        parseCache.oldest = entry;
+    }
+    parseCache.newest = entry;
+}
+
+/*******************************************************************************
+ * parseCacheEvict()
+ *
+ *  Description:
+ *      Drops the least recently used entry.
+ ******************************************************************************/
+void parseCacheEvict() {
+    ParseCacheEntry *entry = parseCache.oldest;
+    if (entry == NULL) {
+        return;
+    }
+    parseCacheUnlink(entry);
+    ParseCacheEntry **link = &parseCache.buckets[entry->hash %
+                                                 PARSE_CACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    parseCache.nEntries--;
+    parseCache.bytes -= entry->size;
+    free(entry);
+}
+
+/*******************************************************************************
+ * parseCacheStore()
+ *
+ *  Description:
+ *      Copies a parsed command and its line into one block sized to fit and
+ *      adds it to the cache, evicting the oldest entry if the cache is full.
+ *      Nothing is cached if the block can not be allocated.
+ ******************************************************************************/
+void parseCacheStore(const UserInputStruct *parsed, const char *line,
+                     size_t length, size_t hash) {
+    // measure everything the command points to
+    size_t nStages = 0;
+    size_t nSlots = 0;
+    size_t textLength = length + 1;
+    for (const UserInputStruct *stage = parsed; stage != NULL;
+         stage = stage->next) {
+        nStages++;
+        nSlots += stage->argc + 1;
+        for (size_t i = 0; i < stage->argc; i++) {
+            textLength += strlen(stage->argv[i]) + 1;
+        }
+        if (stage->inputDestination_ptr != NULL) {
+            textLength += strlen(stage->inputDestination_ptr) + 1;
+        }
+        if (stage->outputDestination_ptr != NULL) {
+            textLength += strlen(stage->outputDestination_ptr) + 1;
+        }
+        if (stage->inputDocument_ptr != NULL) {
+            textLength += stage->inputDocumentLength + 1;
+        }
+    }
+
+    size_t size = sizeof(ParseCacheEntry) +
+                  (nStages - 1) * sizeof(UserInputStruct) +
+                  nSlots * sizeof(char *) + textLength;
+    ParseCacheEntry *entry = malloc(size);
+    if (entry == NULL) {
+        return;
+    }
+    UserInputStruct *extraStages = (UserInputStruct *)(entry + 1);
+    char **slots = (char **)(extraStages + (nStages - 1));
+    char *text = (char *)(slots + nSlots);
+
+    entry->hash = hash;
+    entry->size = size;
+    entry->line = parseCacheString(&text, line, length);
+    UserInputStruct *copy = &entry->parsed;
+    for (const UserInputStruct *stage = parsed; stage != NULL;
+         stage = stage->next) {
+        *copy = *stage;
+        copy->argv = slots;
+        for (size_t i = 0; i < stage->argc; i++) {
+            copy->argv[i] = parseCacheString(&text, stage->argv[i],
+                                             strlen(stage->argv[i]));
+        }
+        copy->argv[stage->argc] = NULL;
+        slots += stage->argc + 1;
+        if (stage->inputDestination_ptr != NULL) {
+            copy->inputDestination_ptr =
+                parseCacheString(&text, stage->inputDestination_ptr,
+                                 strlen(stage->inputDestination_ptr));
+        }
+        if (stage->outputDestination_ptr != NULL) {
+            copy->outputDestination_ptr =
+                parseCacheString(&text, stage->outputDestination_ptr,
+                                 strlen(stage->outputDestination_ptr));
+        }
+        if (stage->inputDocument_ptr != NULL) {
+            copy->inputDocument_ptr =
+                parseCacheString(&text, stage->inputDocument_ptr,
+                                 stage->inputDocumentLength);
+        }
+        if (stage->next != NULL) {
+            copy->next = extraStages++;
+            copy = copy->next;
+        }
+    }
+
+    if (parseCache.nEntries == PARSE_CACHE_ENTRIES) {
+        parseCacheEvict();
+    }
+    ParseCacheEntry **bucket = &parseCache.buckets[hash % PARSE_CACHE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+    parseCachePush(entry);
+    parseCache.nEntries++;
+    parseCache.bytes += size;
+}
+
+/*******************************************************************************
+ * parseCommand()
+ *
+ *  Description:
+ *      Returns the parse of a command line, from the parse cache if the line
+ *      was seen recently, otherwise from getuserInputFromString() whose
+ *      result is then cached. A cached result must not be modified.
+ *
+ *  Inputs:
+ *      const char *line - after variable expansion
+ *      Arena *arena     - for getuserInputFromString() on a miss
+ ******************************************************************************/
+UserInputStruct parseCommand(const char *line, Arena *arena) {
+    size_t length = strlen(line);
+    if (length > PARSE_CACHE_LINE_MAX) {
+        return getuserInputFromString(line, arena);
+    }
+
+    size_t hash = hashString(line);
+    for (ParseCacheEntry *entry =
+             parseCache.buckets[hash % PARSE_CACHE_BUCKETS];
+         entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->line, line) == 0) {
+            parseCache.hits++;
+            if (entry != parseCache.newest) {
+                parseCacheUnlink(entry);
+                parseCachePush(entry);
+            }
+            return entry->parsed;
+        }
+    }
+    parseCache.misses++;
+
+    UserInputStruct parsed = getuserInputFromString(line, arena);
+    if (!parsed.checkSum || parsed.argc == 0) {
+        return parsed;
+    }
+    for (UserInputStruct *stage = &parsed; stage != NULL; stage = stage->next) {
+        if (stage->hereDocDelimiter_ptr != NULL) {
+            return parsed;
+        }
+    }
+    parseCacheStore(&parsed, line, length, hash);
+    return parsed;
+}
+
+/*******************************************************************************
+ * commandHashClear()
+ *
+ *  Description:
+ *      Drops every cached command location. The hit/miss counters are kept.
+ ******************************************************************************/
+void commandHashClear() {
+    for (size_t i = 0; i < COMMAND_HASH_BUCKETS; i++) {
+        CommandHashEntry *entry = commandHash.buckets[i];
+        while (entry != NULL) {
+            CommandHashEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        commandHash.buckets[i] = NULL;
+    }
+}
+
+/*******************************************************************************
+ * commandHashCheckPath()
+ *
+ *  Description:
+ *      Invalidates the table if $PATH no longer matches the value the cached
+ *      entries were resolved against.
+ ******************************************************************************/
+void commandHashCheckPath() {
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+
+    if (commandHash.pathSnapshot != NULL &&
+        strcmp(commandHash.pathSnapshot, path) == 0) {
+        return;
+    }
+
+    commandHashClear();
+    free(commandHash.pathSnapshot);
+    commandHash.pathSnapshot = strdup(path);
+}
+
+/*******************************************************************************
+ * commandHashForget()
+ *
+ *  Description:
+ *      Removes a single command from the table, used when its cached path
+ *      has disappeared.
+ ******************************************************************************/
+void commandHashForget(const char *name) {
+    CommandHashEntry **link =
+        &commandHash.buckets[hashString(name) % COMMAND_HASH_BUCKETS];
+    while (*link != NULL) {
+        if (strcmp((*link)->name, name) == 0) {
+            CommandHashEntry *entry = *link;
+            *link = entry->next;
+            free(entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/*******************************************************************************
+ * commandHashLookup()
+ *
+ *  Description:
+ *      Resolves a command name to the absolute path execve should run. The
+ *      first lookup walks $PATH the same way execvp would, later lookups are
+ *      answered from the table until $PATH changes.
+ *
+ *  Inputs:
+ *      const char *name - command name without a '/'
+ *
+ *  Outputs:
+ *      Returns the cached path, or NULL if no executable was found.
+ ******************************************************************************/
+const char *commandHashLookup(const char *name) {
+    commandHashCheckPath();
+
+    size_t bucket = hashString(name) % COMMAND_HASH_BUCKETS;
+    for (CommandHashEntry *entry = commandHash.buckets[bucket]; entry != NULL;
+         entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            commandHash.hits++;
+            return entry->path;
+        }
+    }
+
+    commandHash.misses++;
+
+    // walk $PATH, an empty element means the current directory
+    size_t nameLength = strlen(name);
+    const char *dir = commandHash.pathSnapshot;
+    while (dir != NULL) {
+        const char *end = strchr(dir, ':');
+        size_t dirLength = end == NULL ? strlen(dir) : (size_t)(end - dir);
+
+        char candidate[dirLength + nameLength + 3];
+        if (dirLength == 0) {
+            candidate[0] = '.';
+            dirLength = 1;
+        } else {
+            memcpy(candidate, dir, dirLength);
+        }
+        candidate[dirLength] = '/';
+        memcpy(candidate + dirLength + 1, name, nameLength + 1);
+
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) &&
+            access(candidate, X_OK) == 0) {
+            size_t candidateLength = strlen(candidate);
+            CommandHashEntry *entry =
+                malloc(sizeof(CommandHashEntry) + nameLength + candidateLength +
+                       2);
+            if (entry == NULL) {
+                raise(SIGUSR1);
+                return NULL;
+            }
+            entry->hits = 1;
+            entry->name = (char *)(entry + 1);
+            entry->path = entry->name + nameLength + 1;
+            memcpy(entry->name, name, nameLength + 1);
+            memcpy(entry->path, candidate, candidateLength + 1);
+            entry->next = commandHash.buckets[bucket];
+            commandHash.buckets[bucket] = entry;
+            return entry->path;
+        }
+
+        dir = end == NULL ? NULL : end + 1;
+    }
+
+    return NULL;
+}
+
+/*******************************************************************************
+ * hashBuiltin()
+ *
+ *  Description:
+ *      Implements the hash builtin:
+ *
+ *          hash            - list cached commands and the hit/miss counters
+ *          hash -r         - forget every cached command
+ *          hash name ...   - resolve and cache the given commands
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ ******************************************************************************/
+void hashBuiltin(UserInputStruct userInput) {
+    if (userInput.argv[1] == NULL) {
+        commandHashCheckPath();
+        fprintf(stdout, "hits\tcommand\n");
+        for (size_t i = 0; i < COMMAND_HASH_BUCKETS; i++) {
+            for (CommandHashEntry *entry = commandHash.buckets[i];
+                 entry != NULL; entry = entry->next) {
+                fprintf(stdout, "%4lu\t%s\n", entry->hits, entry->path);
+            }
+        }
+        fprintf(stdout, "%lu hits, %lu misses\n", commandHash.hits,
+                commandHash.misses);
+        fflush(stdout);
+        return;
+    }
+
+    if (strcmp(userInput.argv[1], "-r") == 0) {
+        commandHashClear();
+        commandHash.hits = 0;
+        commandHash.misses = 0;
+        return;
+    }
+
+    for (size_t i = 1; userInput.argv[i] != NULL; i++) {
+        if (strchr(userInput.argv[i], '/') != NULL) {
+            continue;
+        }
+        if (commandHashLookup(userInput.argv[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", userInput.argv[i]);
+            fflush(stderr);
+        }
+    }
+}
+
+/*******************************************************************************
+ * printStatus()
+ *
+ *  Description:
+ *      Prints a wait status the way the status builtin reports it.
+ ******************************************************************************/
+void printStatus(FILE *stream, int status) {
+    if (WIFEXITED(status)) {
+        fprintf(stream, "exit value %d", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stream, "terminated by signal %d", WTERMSIG(status));
+    }
+}
+
+/*******************************************************************************
+ * findJob()
+ *
+ *  Description:
+ *      Resolves a job spec: %n for job n, %% or %+ for the most recently
+ *      started job, or the pid of any process in a job.
+ *
+ *  Outputs:
+ *      Returns the slot index of the job, or -1 if there is no such job.
+ ******************************************************************************/
+int findJob(const char *spec) {
+    if (strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        int latest = -1;
+        for (size_t i = 0; i < jobTable.capacity; i++) {
+            Job *job = &jobTable.jobs[i];
+            if (job->inUse &&
+                (latest < 0 ||
+                 job->startTime.tv_sec >
+                     jobTable.jobs[latest].startTime.tv_sec ||
+                 (job->startTime.tv_sec ==
+                      jobTable.jobs[latest].startTime.tv_sec &&
+                  job->startTime.tv_nsec >
+                      jobTable.jobs[latest].startTime.tv_nsec))) {
+                latest = (int)i;
+            }
+        }
+        return latest;
+    }
+
+    char *end;
+    if (spec[0] == '%') {
+        long id = strtol(spec + 1, &end, 10);
+        if (*end != '\0' || id < 1 || (size_t)id > jobTable.capacity ||
+            !jobTable.jobs[id - 1].inUse) {
+            return -1;
+        }
+        return (int)id - 1;
+    }
+
+    long pid = strtol(spec, &end, 10);
+    if (*end != '\0' || pid <= 0) {
+        return -1;
+    }
+    int index = pidTableFind((pid_t)pid);
+    if (index >= 0) {
+        return index;
+    }
+    // the pid may belong to a job that already finished
+    for (size_t i = 0; i < jobTable.capacity; i++) {
+        Job *job = &jobTable.jobs[i];
+        for (size_t j = 0; job->inUse && j < job->nPids; j++) {
+            if (job->pids[j] == (pid_t)pid) {
+                return (int)i;
+            }
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * signalJob()
+ *
+ *  Description:
+ *      Sends signo to every process of the job that has not been reaped.
+ ******************************************************************************/
+void signalJob(int index, int signo) {
+    Job *job = &jobTable.jobs[index];
+    for (size_t i = 0; i < job->nPids; i++) {
+        if (pidTableFind(job->pids[i]) == index) {
+            kill(job->pids[i], signo);
+        }
+    }
+}
+
+/*******************************************************************************
+ * waitForJob()
+ *
+ *  Description:
+ *      Runs the event loop until every process of the job has exited, the
+ *      job stops, or ctrl^c interrupts the wait. The job stays in the table
+ *      when it is done, for the caller to remove.
+ *
+ *  Outputs:
+ *      Returns the state of the job, JOB_RUNNING if the wait was interrupted.
+ ******************************************************************************/
+enum JobState waitForJob(int index) {
+    Job *job = &jobTable.jobs[index];
+    eventLoop.interrupted = 0;
+    jobTable.waited = index;
+    while (job->state == JOB_RUNNING && !eventLoop.interrupted && !quit) {
+        if (runEventLoop(-1) < 0) {
+            break;
+        }
+    }
+    jobTable.waited = -1;
+    eventLoop.interrupted = 0;
+    return job->state;
+}
+
+/*******************************************************************************
+ * jobsBuiltin()
+ *
+ *  Description:
+ *      Lists every job with its state, run time and command line. Finished
+ *      jobs are removed once they have been listed.
+ ******************************************************************************/
+void jobsBuiltin(UserInputStruct userInput) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (size_t i = 0; i < jobTable.capacity; i++) {
+        Job *job = &jobTable.jobs[i];
+        if (!job->inUse) {
+            continue;
+        }
+
+        fprintf(stdout, "[%zu] %d ", i + 1, job->pids[job->nPids - 1]);
+        if (job->state == JOB_RUNNING) {
+            fprintf(stdout, "Running");
+        } else if (job->state == JOB_STOPPED) {
+            fprintf(stdout, "Stopped");
+        } else {
+            fprintf(stdout, "Done, ");
+            printStatus(stdout, job->status);
+        }
+        fprintf(stdout, " (%lds) %s\n",
+                (long)(now.tv_sec - job->startTime.tv_sec), job->commandLine);
+
+        if (job->state == JOB_DONE) {
+            jobRemove((int)i);
+        }
+    }
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * fgBuiltin()
+ *
+ *  Description:
+ *      Brings a job to the foreground: continues it if it is stopped and
+ *      waits for it like a foreground command. Defaults to the most recently
+ *      started job.
+ ******************************************************************************/
+void fgBuiltin(UserInputStruct userInput) {
+    const char *spec = userInput.argv[1] == NULL ? "%%" : userInput.argv[1];
+    int index = findJob(spec);
+    if (index < 0) {
+        fprintf(stderr, "fg: %s: no such job\n", spec);
+        fflush(stderr);
+        currentStatus = W_EXITCODE(1, 0);
+        return;
+    }
+    Job *job = &jobTable.jobs[index];
+
+    fprintf(stdout, "%s\n", job->commandLine);
+    fflush(stdout);
+
+    if (job->state == JOB_STOPPED) {
+        signalJob(index, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+
+    enum JobState state = waitForJob(index);
+    if (state == JOB_STOPPED) {
+        fprintf(stdout, "[%d] Stopped\n", index + 1);
+        fflush(stdout);
+        return;
+    }
+    if (state == JOB_RUNNING) {
+        fprintf(stdout, "\n[%d] Still running in the background\n", index + 1);
+        fflush(stdout);
+        return;
+    }
+
+    currentStatus = job->status;
+    if (WIFSIGNALED(currentStatus)) {
+        fprintf(stdout, "terminated by signal %d\n", WTERMSIG(currentStatus));
+        fflush(stdout);
+    }
+    jobRemove(index);
+}
+
+/*******************************************************************************
+ * bgBuiltin()
+ *
+ *  Description:
+ *      Resumes a stopped job in the background. Defaults to the most recently
+ *      started job.
+ ******************************************************************************/
+void bgBuiltin(UserInputStruct userInput) {
+    const char *spec = userInput.argv[1] == NULL ? "%%" : userInput.argv[1];
+    int index = findJob(spec);
+    if (index < 0) {
+        fprintf(stderr, "bg: %s: no such job\n", spec);
+        fflush(stderr);
+        currentStatus = W_EXITCODE(1, 0);
+        return;
+    }
+    Job *job = &jobTable.jobs[index];
+
+    if (job->state == JOB_STOPPED) {
+        signalJob(index, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    fprintf(stdout, "[%d] %s\n", index + 1, job->commandLine);
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * findDoneJob()
+ *
+ *  Description:
+ *      Resolves %n or the pid of its last stage to a job that was removed
+ *      from the table once done.
+ *
+ *  Outputs:
+ *      Returns the index of its kept status, or -1 if there is none.
+ ******************************************************************************/
+int findDoneJob(const char *spec) {
+    char *end;
+    long number = strtol(spec + (spec[0] == '%'), &end, 10);
+    if (*end != '\0' || end == spec + (spec[0] == '%') || number <= 0) {
+        return -1;
+    }
+    for (size_t i = jobTable.nDone; i-- > 0;) {
+        DoneJob *done = &jobTable.done[i];
+        if (spec[0] == '%' ? done->id == number : done->pid == number) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * waitBuiltin()
+ *
+ *  Description:
+ *      wait %n|pid ... waits for the given jobs and sets the status to the
+ *      last one, which for a job already done is the status it was reported
+ *      with. wait on its own waits for every job that is not stopped and
+ *      prints the status each one finished with, so none are lost, and
+ *      forgets those of the jobs already reported. ctrl^c stops waiting.
+ ******************************************************************************/
+void waitBuiltin(UserInputStruct userInput) {
+    if (userInput.argv[1] == NULL) {
+        for (size_t i = 0; i < jobTable.capacity && !quit; i++) {
+            Job *job = &jobTable.jobs[i];
+            if (!job->inUse || job->state == JOB_STOPPED) {
+                continue;
+            }
+            enum JobState state = waitForJob((int)i);
+            if (state == JOB_RUNNING) {
+                // interrupted
+                currentStatus = W_EXITCODE(128 + SIGINT, 0);
+                break;
+            }
+            if (state != JOB_DONE) {
+                continue;
+            }
+            fprintf(stdout, "[%zu] %d %s: ", i + 1, job->pids[job->nPids - 1],
+                    job->commandLine);
+            printStatus(stdout, job->status);
+            fprintf(stdout, "\n");
+            currentStatus = job->status;
+            jobRemove((int)i);
+        }
+        jobTable.nDone = 0;
+        fflush(stdout);
+        return;
+    }
+
+    for (size_t i = 1; userInput.argv[i] != NULL; i++) {
+        int index = findJob(userInput.argv[i]);
+        int doneIndex = index < 0 ? findDoneJob(userInput.argv[i]) : -1;
+        if (doneIndex >= 0) {
+            // a status is only collected once, as with waitpid()
+            currentStatus = jobTable.done[doneIndex].status;
+            jobTable.nDone--;
+            memmove(jobTable.done + doneIndex, jobTable.done + doneIndex + 1,
+                    (jobTable.nDone - (size_t)doneIndex) * sizeof(DoneJob));
+            continue;
+        }
+        if (index < 0) {
+            fprintf(stderr, "wait: %s: no such job\n", userInput.argv[i]);
+            fflush(stderr);
+            currentStatus = W_EXITCODE(127, 0);
+            continue;
+        }
+        enum JobState state = waitForJob(index);
+        if (state == JOB_DONE) {
+            currentStatus = jobTable.jobs[index].status;
+            jobRemove(index);
+        } else if (state == JOB_RUNNING) {
+            currentStatus = W_EXITCODE(128 + SIGINT, 0);
+            break;
+        }
+    }
+}
+
+/*******************************************************************************
+ * killBuiltin()
+ *
+ *  Description:
+ *      kill [-SIGNAL] %n|pid ... sends a signal, SIGTERM by default, to every
+ *      process of the given jobs or to the given pids. The signal may be a
+ *      number or a name with or without the SIG prefix.
+ ******************************************************************************/
+void killBuiltin(UserInputStruct userInput) {
+    static const struct {
+        const char *name;
+        int signo;
+    } signalNames[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+                       {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+                       {"TERM", SIGTERM}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+                       {"TSTP", SIGTSTP}};
+
+    int signo = SIGTERM;
+    size_t first = 1;
+    if (userInput.argv[1] != NULL && userInput.argv[1][0] == '-') {
+        const char *name = userInput.argv[1] + 1;
+        if (strcmp(name, "s") == 0 && userInput.argv[2] != NULL) {
+            name = userInput.argv[2];
+            first++;
+        }
+        first++;
+
+        char *end;
+        signo = (int)strtol(name, &end, 10);
+        if (*end != '\0' || end == name) {
+            if (strncmp(name, "SIG", 3) == 0) {
+                name += 3;
+            }
+            signo = -1;
+            for (size_t i = 0; i < sizeof(signalNames) / sizeof(signalNames[0]);
+                 i++) {
+                if (strcmp(name, signalNames[i].name) == 0) {
+                    signo = signalNames[i].signo;
+                }
+            }
+        }
+        if (signo < 0 || signo >= NSIG) {
+            fprintf(stderr, "kill: %s: invalid signal\n", userInput.argv[1]);
+            fflush(stderr);
+            currentStatus = W_EXITCODE(1, 0);
+            return;
+        }
+    }
+
+    currentStatus = W_EXITCODE(0, 0);
+    for (size_t i = first; userInput.argv[i] != NULL; i++) {
+        const char *target = userInput.argv[i];
+        if (target[0] == '%') {
+            int index = findJob(target);
+            if (index < 0) {
+                fprintf(stderr, "kill: %s: no such job\n", target);
+                fflush(stderr);
+                currentStatus = W_EXITCODE(1, 0);
+                continue;
+            }
+            signalJob(index, signo);
+            // a stopped job only sees the signal once it runs again
+            if (jobTable.jobs[index].state == JOB_STOPPED && signo != SIGSTOP &&
+                signo != SIGTSTP) {
+                signalJob(index, SIGCONT);
+            }
+        } else {
+            char *end;
+            long pid = strtol(target, &end, 10);
+            if (*end != '\0' || end == target || kill((pid_t)pid, signo) != 0) {
+                fprintf(stderr, "kill: %s: %s\n", target,
+                        *end != '\0' || end == target ? "invalid pid"
+                                                      : strerror(errno));
+                fflush(stderr);
+                currentStatus = W_EXITCODE(1, 0);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ * openDocument()
+ *
+ *  Description:
+ *      Copies a here-doc or here-string into a memfd, seals it against any
+ *      further change and rewinds it, ready to be a child's stdin. Nothing
+ *      touches the filesystem and no process is needed to feed a pipe.
+ *
+ *  Outputs:
+ *      Returns the fd, or -1 with errno set on failure.
+ ******************************************************************************/
+int openDocument(const char *document, size_t length) {
+    int fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < length) {
+        ssize_t result = write(fd, document + written, length - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        written += (size_t)result;
+    }
+
+    fcntl(fd, F_ADD_SEALS,
+          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/******************************************************************************
+ * Launch policies
+ *
+ * A command may be prefixed with on CPUS, nice N and ionice CLASS, in any
+ * order, to pin its processes to some CPUs, lower their priority or change
+ * their I/O scheduling class. & jobs start from the policy set with
+ * bgpolicy, which the prefixes override field by field. The policy is applied
+ * by the child itself between its fork and its exec, so a command with one is
+ * launched through a zygote or fork() rather than posix_spawn, which has no
+ * attribute for any of them.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * parseCpuList()
+ *
+ *  Description:
+ *      Parses a CPU list such as 0-3,8,10-11, as taskset -c takes it.
+ *
+ *  Inputs:
+ *      const char *text
+ *      cpu_set_t *cpus - receives the CPUs listed
+ *
+ *  Outputs:
+ *      Returns 0 on success, or -1 if the list is malformed or holds none of
+ *      the CPUs the shell itself may run on.
+ ******************************************************************************/
+int parseCpuList(const char *text, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *at = text;
+    while (1) {
+        char *end;
+        if (*at < '0' || *at > '9') {
+            return -1;
+        }
+        long first = strtol(at, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            at = end + 1;
+            if (*at < '0' || *at > '9') {
+                return -1;
+            }
+            last = strtol(at, &end, 10);
+        }
+        if (first > last || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((int)cpu, cpus);
+        }
+        if (*end == '\0') {
+            break;
+        }
+        if (*end != ',') {
+            return -1;
+        }
+        at = end + 1;
+    }
+
+    // sched_setaffinity() would fail in the child instead
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        CPU_AND(&allowed, &allowed, cpus);
+        if (CPU_COUNT(&allowed) == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * parseIoClass()
+ *
+ *  Description:
+ *      Parses an I/O scheduling class: idle, best-effort or realtime (be and
+ *      rt for short, or 3, 2 and 1 as ionice -c numbers them), optionally
+ *      followed by :level with a level from 0, the highest, to 7. The level
+ *      defaults to 4.
+ *
+ *  Inputs:
+ *      const char *text
+ *      int *ioprio - receives the value for ioprio_set()
+ *
+ *  Outputs:
+ *      Returns 0 on success, or -1 if text is not a class.
+ ******************************************************************************/
+int parseIoClass(const char *text, int *ioprio) {
+    static const struct {
+        const char *name;
+        int ioClass;
+    } classes[] = {{"idle", IOPRIO_CLASS_IDLE},   {"3", IOPRIO_CLASS_IDLE},
+                   {"best-effort", IOPRIO_CLASS_BE}, {"be", IOPRIO_CLASS_BE},
+                   {"2", IOPRIO_CLASS_BE},        {"realtime", IOPRIO_CLASS_RT},
+                   {"rt", IOPRIO_CLASS_RT},       {"1", IOPRIO_CLASS_RT}};
+
+    const char *colon = strchr(text, ':');
+    size_t nameLength = colon == NULL ? strlen(text) : (size_t)(colon - text);
+    int level = 4;
+    if (colon != NULL) {
+        if (colon[1] < '0' || colon[1] > '7' || colon[2] != '\0') {
+            return -1;
+        }
+        level = colon[1] - '0';
+    }
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if (strlen(classes[i].name) == nameLength &&
+            strncmp(text, classes[i].name, nameLength) == 0) {
+            *ioprio = (classes[i].ioClass << IOPRIO_CLASS_SHIFT) | level;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * parseLaunchPolicy()
+ *
+ *  Description:
+ *      Reads the on CPUS, nice N and ionice CLASS prefixes at the start of
+ *      argv into policy. Only on is reserved: nice or ionice followed by
+ *      anything but a number or a class ends the prefixes, so nice -n 5 and
+ *      ionice -c 3 still reach the utilities.
+ *
+ *  Inputs:
+ *      char **argv
+ *      LaunchPolicy *policy - updated with the prefixes found
+ *
+ *  Outputs:
+ *      Returns the number of words taken by the prefixes, or -1 after
+ *      reporting a malformed CPU list.
+ ******************************************************************************/
+int parseLaunchPolicy(char **argv, LaunchPolicy *policy) {
+    size_t i = 0;
+    while (argv[i] != NULL && argv[i + 1] != NULL) {
+        const char *value = argv[i + 1];
+        if (strcmp(argv[i], "on") == 0) {
+            if (parseCpuList(value, &policy->cpus) != 0) {
+                fprintf(stderr, "on: %s: not a list of usable CPUs\n", value);
+                fflush(stderr);
+                return -1;
+            }
+            policy->hasCpus = 1;
+        } else if (strcmp(argv[i], "nice") == 0) {
+            char *end;
+            long nice = strtol(value, &end, 10);
+            if (*end != '\0' || end == value || nice < -40 || nice > 40) {
+                break;
+            }
+            policy->hasNice = 1;
+            policy->nice = (int)nice;
+        } else if (strcmp(argv[i], "ionice") == 0) {
+            if (parseIoClass(value, &policy->ioprio) != 0) {
+                break;
+            }
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    return (int)i;
+}
+
+/*******************************************************************************
+ * launchPolicyActive()
+ *
+ *  Description:
+ *      Tells whether the policy changes anything for a child.
+ ******************************************************************************/
+int launchPolicyActive(const LaunchPolicy *policy) {
+    return policy->hasCpus || policy->hasNice || policy->ioprio >= 0;
+}
+
+/*******************************************************************************
+ * applyLaunchPolicy()
+ *
+ *  Description:
+ *      Applies the policy to the calling process, a child about to exec. A
+ *      part that fails is reported on stderr and the command runs anyway,
+ *      as it does under nice(1) when a negative increment is refused.
+ ******************************************************************************/
+void applyLaunchPolicy(const LaunchPolicy *policy) {
+    if (policy->hasCpus &&
+        sched_setaffinity(0, sizeof(policy->cpus), &policy->cpus) != 0) {
+        fprintf(stderr, "on: %s\n", strerror(errno));
+    }
+    if (policy->hasNice) {
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0 ||
+            setpriority(PRIO_PROCESS, 0, current + policy->nice) != 0) {
+            fprintf(stderr, "nice: %s\n", strerror(errno));
+        }
+    }
+    if (policy->ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                                       policy->ioprio) != 0) {
+        fprintf(stderr, "ionice: %s\n", strerror(errno));
+    }
+    fflush(stderr);
+}
+
+/*******************************************************************************
+ * printLaunchPolicy()
+ *
+ *  Description:
+ *      Prints the policy as the prefixes that would set it, or none.
+ ******************************************************************************/
+void printLaunchPolicy(FILE *stream, const LaunchPolicy *policy) {
+    static const char *ioClasses[] = {"none", "rt", "be", "idle"};
+    if (!launchPolicyActive(policy)) {
+        fprintf(stream, "none");
+    }
+    const char *separator = "";
+    if (policy->hasCpus) {
+        fprintf(stream, "on ");
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (!CPU_ISSET(cpu, &policy->cpus)) {
+                continue;
+            }
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE &&
+                   CPU_ISSET(last + 1, &policy->cpus)) {
+                last++;
+            }
+            fprintf(stream, last == cpu ? "%s%d" : "%s%d-%d", separator, cpu,
+                    last);
+            separator = ",";
+            cpu = last;
+        }
+        separator = " ";
+    }
+    if (policy->hasNice) {
+        fprintf(stream, "%snice %d", separator, policy->nice);
+        separator = " ";
+    }
+    if (policy->ioprio >= 0) {
+        int ioClass = (policy->ioprio >> IOPRIO_CLASS_SHIFT) & 3;
+        fprintf(stream, "%sionice %s", separator, ioClasses[ioClass]);
+        if (ioClass != IOPRIO_CLASS_IDLE) {
+            fprintf(stream, ":%d", policy->ioprio & 7);
+        }
+    }
+    fprintf(stream, "\n");
+}
+
+/*******************************************************************************
+ * bgpolicyBuiltin()
+ *
+ *  Description:
+ *      Implements the bgpolicy builtin, the default policy of & jobs:
+ *
+ *          bgpolicy                - show it
+ *          bgpolicy none           - clear it
+ *          bgpolicy [on CPUS] [nice N] [ionice CLASS]
+ *                                  - replace it
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ ******************************************************************************/
+void bgpolicyBuiltin(UserInputStruct userInput) {
+    currentStatus = W_EXITCODE(0, 0);
+    if (userInput.argv[1] == NULL) {
+        fprintf(stdout, "bgpolicy ");
+        printLaunchPolicy(stdout, &backgroundPolicy);
+        fflush(stdout);
+        return;
+    }
+    if (strcmp(userInput.argv[1], "none") == 0 && userInput.argv[2] == NULL) {
+        backgroundPolicy = noLaunchPolicy;
+        return;
+    }
+
+    LaunchPolicy policy = noLaunchPolicy;
+    int nWords = parseLaunchPolicy(userInput.argv + 1, &policy);
+    if (nWords < 0) {
+        currentStatus = W_EXITCODE(1, 0);
+        return;
+    }
+    if (userInput.argv[1 + nWords] != NULL) {
+        fprintf(stderr, "bgpolicy: %s: expected on CPUS, nice N or ionice "
+                        "CLASS\n",
+                userInput.argv[1 + nWords]);
+        fflush(stderr);
+        currentStatus = W_EXITCODE(1, 0);
+        return;
+    }
+    backgroundPolicy = policy;
+}
+
+/******************************************************************************
+ * Zygotes
+ *
+ * With SMALLSH_ZYGOTES=N the shell keeps up to N children forked ahead of
+ * time, each waiting on a socket to be told what to exec. Launching a
+ * command through one sends its path, argv, stdin, stdout, stderr and
+ * working directory in a single message, and the zygote only has to apply
+ * them and call execve. The fork is out of the critical path.
+ *
+ * The zygotes are forked by a factory, a small process forked once at
+ * startup, with clone(CLONE_PARENT) so they are children of the shell and
+ * are waited for like any other command. Every zygote used asks the
+ * factory for a new one, which it sends back with its pid while the shell
+ * goes on. When no zygote is ready, posix_spawn is used instead.
+ ******************************************************************************/
+#define ZYGOTE_POOL_MAX 64
+#define ZYGOTE_MESSAGE_MAX (64 * 1024)
+
+/*******************************************************************************
+ * zygoteMain()
+ *
+ *  Description:
+ *      Body of a zygote. Waits for one request and execs it. The signals the
+ *      shell blocks may have become pending meanwhile, a ctrl^c meant for
+ *      an earlier command for instance, so each one is ignored, which
+ *      discards it, before its default is restored. Never returns.
+ ******************************************************************************/
+void zygoteMain(int socket) {
+    static const int resetSignals[] = {SIGINT,  SIGTSTP, SIGQUIT,
+                                       SIGCHLD, SIGUSR1, SIGTERM};
+    char *message = malloc(ZYGOTE_MESSAGE_MAX + 1);
+    union {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {message, ZYGOTE_MESSAGE_MAX};
+    struct msghdr header = {0};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+
+    ssize_t length;
+    do {
+        length = message == NULL ? -1 : recvmsg(socket, &header, 0);
+    } while (length < 0 && errno == EINTR);
+    struct cmsghdr *fdHeader = CMSG_FIRSTHDR(&header);
+    if (length < (ssize_t)sizeof(ZygoteRequest) || fdHeader == NULL ||
+        fdHeader->cmsg_type != SCM_RIGHTS ||
+        fdHeader->cmsg_len != CMSG_LEN(4 * sizeof(int))) {
+        // the shell is gone, or asked for nothing
+        _exit(0);
+    }
+
+    ZygoteRequest request;
+    memcpy(&request, message, sizeof(request));
+    message[length] = '\0';
+    char **argv = malloc(((size_t)request.argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        _exit(127);
+    }
+    char *path = message + sizeof(request);
+    char *at = path + strlen(path) + 1;
+    for (int32_t i = 0; i < request.argc; i++) {
+        argv[i] = at;
+        at += strlen(at) + 1;
+    }
+    argv[request.argc] = NULL;
+
+    // working directory, stdin, stdout and stderr
+    int fds[4];
+    memcpy(fds, CMSG_DATA(fdHeader), sizeof(fds));
+    fchdir(fds[0]);
+    for (int i = 1; i < 4; i++) {
+        dup2(fds[i], i - 1);
+    }
+    for (int i = 0; i < 4; i++) {
+        if (fds[i] > 2) {
+            close(fds[i]);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(resetSignals) / sizeof(resetSignals[0]);
+         i++) {
+        signal(resetSignals[i], SIG_IGN);
+        signal(resetSignals[i], SIG_DFL);
+    }
+    // the same dispositions forkCommand() gives its child
+    signal(SIGTSTP, SIG_IGN);
+    if (request.background) {
+        signal(SIGINT, SIG_IGN);
+    }
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+    applyLaunchPolicy(&request.policy);
+
+    // the socket is close-on-exec, so the shell sees it close on success
+    execve(path, argv, environ);
+    int error = errno;
+    send(socket, &error, sizeof(error), MSG_NOSIGNAL);
+    _exit(127);
+}
+
+/*******************************************************************************
+ * zygoteFactory()
+ *
+ *  Description:
+ *      Body of the factory. Every message from the shell asks for one more
+ *      zygote, which is sent back as its pid with the shell's end of its
+ *      socket. Exits once the shell closes its end. Never returns.
+ ******************************************************************************/
+void zygoteFactory(int control) {
+    while (1) {
+        char request;
+        ssize_t length = read(control, &request, 1);
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            _exit(0);
+        }
+
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+            continue;
+        }
+        // a sibling of ours, so a child of the shell
+        pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL,
+                                   NULL, NULL, NULL);
+        if (pid == 0) {
+            close(control);
+            close(pair[0]);
+            zygoteMain(pair[1]);
+        }
+        close(pair[1]);
+        if (pid > 0) {
+            union {
+                char buffer[CMSG_SPACE(sizeof(int))];
+                struct cmsghdr align;
+            } fdControl;
+            struct iovec iov = {&pid, sizeof(pid)};
+            struct msghdr message = {0};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = fdControl.buffer;
+            message.msg_controllen = sizeof(fdControl.buffer);
+            struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(header), &pair[0], sizeof(int));
+            sendmsg(control, &message, MSG_NOSIGNAL);
+        }
+        close(pair[0]);
+    }
+}
+
+/*******************************************************************************
+ * zygotePoolStart()
+ *
+ *  Description:
+ *      Forks the factory and asks it for SMALLSH_ZYGOTES zygotes, when that
+ *      is set. Called early, while the shell is small and cheap to fork.
+ ******************************************************************************/
+void zygotePoolStart() {
+    const char *value = getenv("SMALLSH_ZYGOTES");
+    long size = value == NULL ? 0 : strtol(value, NULL, 10);
+    if (size <= 0) {
+        return;
+    }
+    if (size > ZYGOTE_POOL_MAX) {
+        size = ZYGOTE_POOL_MAX;
+    }
+
+    int pair[2];
+    zygotePool.pids = malloc((size_t)size * sizeof(pid_t));
+    zygotePool.sockets = malloc((size_t)size * sizeof(int));
+    if (zygotePool.pids == NULL || zygotePool.sockets == NULL ||
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) != 0) {
+        free(zygotePool.pids);
+        free(zygotePool.sockets);
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(pair[0]);
+        zygoteFactory(pair[1]);
+    }
+    close(pair[1]);
+    if (pid < 0) {
+        close(pair[0]);
+        return;
+    }
+    zygotePool.factoryFd = pair[0];
+    zygotePool.factoryPid = pid;
+    zygotePool.size = (size_t)size;
+    for (long i = 0; i < size; i++) {
+        send(zygotePool.factoryFd, "+", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+/*******************************************************************************
+ * zygotePoolStop()
+ *
+ *  Description:
+ *      Closes the connections to the factory and the zygotes, which exit on
+ *      their own as they see them close.
+ ******************************************************************************/
+void zygotePoolStop() {
+    if (zygotePool.factoryFd < 0) {
+        return;
+    }
+    close(zygotePool.factoryFd);
+    zygotePool.factoryFd = -1;
+    for (size_t i = 0; i < zygotePool.nReady; i++) {
+        close(zygotePool.sockets[i]);
+    }
+    zygotePool.nReady = 0;
+}
+
+/*******************************************************************************
+ * zygotePoolCollect()
+ *
+ *  Description:
+ *      Adds the zygotes the factory has sent since last time to the pool,
+ *      without waiting for any.
+ ******************************************************************************/
+void zygotePoolCollect() {
+    while (zygotePool.nReady < zygotePool.size) {
+        pid_t pid;
+        union {
+            char buffer[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = {&pid, sizeof(pid)};
+        struct msghdr message = {0};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        if (recvmsg(zygotePool.factoryFd, &message,
+                    MSG_DONTWAIT | MSG_CMSG_CLOEXEC) != sizeof(pid)) {
+            return;
+        }
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header == NULL || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        memcpy(&zygotePool.sockets[zygotePool.nReady], CMSG_DATA(header),
+               sizeof(int));
+        zygotePool.pids[zygotePool.nReady++] = pid;
+    }
+}
+
+/*******************************************************************************
+ * zygoteCommand()
+ *
+ *  Description:
+ *      Launches the command through a ready zygote, resolving bare command
+ *      names through the command hash like spawnCommand(), and asks the
+ *      factory for a replacement. Waits only until the exec has happened,
+ *      which the zygote's socket closing shows.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ *      int inputDestination  - fd to place on stdin, or -1 to inherit
+ *      int outputDestination - fd to place on stdout, or -1 to inherit
+ *      pid_t *spawnPid       - receives the pid of the child
+ *
+ *  Outputs:
+ *      Returns 0 on success, ENOSYS if no zygote could be used, otherwise the
+ *      errno of the failed exec.
+ ******************************************************************************/
+int zygoteCommand(UserInputStruct userInput, int inputDestination,
+                  int outputDestination, pid_t *spawnPid) {
+    static char message[ZYGOTE_MESSAGE_MAX];
+    if (zygotePool.factoryFd < 0) {
+        return ENOSYS;
+    }
+    zygotePoolCollect();
+    int bare = strchr(userInput.argv[0], '/') == NULL;
+    const char *path =
+        bare ? commandHashLookup(userInput.argv[0]) : userInput.argv[0];
+    if (zygotePool.nReady == 0 || path == NULL) {
+        zygotePool.fallbacks += zygotePool.nReady == 0;
+        return ENOSYS;
+    }
+
+    ZygoteRequest request = {userInput.runInBackground,
+                             (int32_t)userInput.argc, launchPolicy};
+    size_t length = sizeof(request);
+    memcpy(message, &request, sizeof(request));
+    for (size_t i = 0; i <= userInput.argc; i++) {
+        const char *text = i == 0 ? path : userInput.argv[i - 1];
+        size_t textLength = strlen(text) + 1;
+        if (length + textLength > sizeof(message)) {
+            return ENOSYS;
+        }
+        memcpy(message + length, text, textLength);
+        length += textLength;
+    }
+
+    int fds[4] = {open(".", O_PATH | O_DIRECTORY | O_CLOEXEC),
+                  inputDestination >= 0 ? inputDestination : STDIN_FILENO,
+                  outputDestination >= 0 ? outputDestination : STDOUT_FILENO,
+                  STDERR_FILENO};
+    if (fds[0] < 0) {
+        return ENOSYS;
+    }
+    union {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {message, length};
+    struct msghdr header = {0};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *fdHeader = CMSG_FIRSTHDR(&header);
+    fdHeader->cmsg_level = SOL_SOCKET;
+    fdHeader->cmsg_type = SCM_RIGHTS;
+    fdHeader->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(fdHeader), fds, sizeof(fds));
+
+    zygotePool.nReady--;
+    pid_t pid = zygotePool.pids[zygotePool.nReady];
+    int socket = zygotePool.sockets[zygotePool.nReady];
+    send(zygotePool.factoryFd, "+", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    ssize_t sent = sendmsg(socket, &header, MSG_NOSIGNAL);
+    close(fds[0]);
+    int error = 0;
+    ssize_t received = 0;
+    if (sent >= 0) {
+        do {
+            received = recv(socket, &error, sizeof(error), 0);
+        } while (received < 0 && errno == EINTR);
+    }
+    close(socket);
+
+    if (sent < 0 || received != 0) {
+        // the zygote is gone or could not exec, either way it exits now
+        waitpid(pid, NULL, 0);
+        if (sent < 0 || received != sizeof(error)) {
+            return ENOSYS;
+        }
+        if (error == ENOENT && bare) {
+            commandHashForget(userInput.argv[0]);
+        }
+        return error;
+    }
+
+    zygotePool.launches++;
+    *spawnPid = pid;
+    return 0;
+}
+
+/*******************************************************************************
+ * statsBuiltin()
+ *
+ *  Description:
+ *      Implements the stats builtin:
+ *
+ *          stats       - show the hit rate and memory use of the parse cache,
+ *                        and how often a zygote was ready for a launch
+ *          stats -r    - empty the parse cache and reset its counters
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ ******************************************************************************/
+void statsBuiltin(UserInputStruct userInput) {
+    if (userInput.argv[1] != NULL && strcmp(userInput.argv[1], "-r") == 0) {
+        while (parseCache.nEntries > 0) {
+            parseCacheEvict();
+        }
+        parseCache.hits = 0;
+        parseCache.misses = 0;
+        return;
+    }
+
+    unsigned long lookups = parseCache.hits + parseCache.misses;
+    fprintf(stdout, "parse cache: %lu hits, %lu misses, %lu%% hit rate\n",
+            parseCache.hits, parseCache.misses,
+            lookups == 0 ? 0 : parseCache.hits * 100 / lookups);
+    fprintf(stdout, "parse cache: %lu of %d entries, %lu bytes\n",
+            (unsigned long)parseCache.nEntries, PARSE_CACHE_ENTRIES,
+            (unsigned long)parseCache.bytes);
+    if (zygotePool.size > 0) {
+        zygotePoolCollect();
+        fprintf(stdout,
+                "zygotes: %lu of %lu ready, %lu launches, %lu without one\n",
+                (unsigned long)zygotePool.nReady,
+                (unsigned long)zygotePool.size, zygotePool.launches,
+                zygotePool.fallbacks);
+    }
+    fflush(stdout);
+}
+
+/*******************************************************************************
+ * forkCommand()
+ *
+ *  Description:
+ *      Fallback launcher used when posix_spawn can not create the child, and
+ *      for commands with a launch policy or after raiseFileLimit(), which it
+ *      undoes before the exec. Mirrors the signal setup and redirections
+ *      done by spawnCommand().
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ *      int inputDestination  - fd to place on stdin, or -1 to inherit
+ *      int outputDestination - fd to place on stdout, or -1 to inherit
+ *      pid_t *spawnPid       - receives the pid of the child
+ *
+ *  Outputs:
+ *      Returns 0 on success, otherwise the errno from fork().
+ ******************************************************************************/
+int forkCommand(UserInputStruct userInput, int inputDestination,
+                int outputDestination, pid_t *spawnPid) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        return errno;
+    } else if (pid == 0) {
+        /**********************************
+         * CHILD PROCESS
+         *********************************/
+        struct sigaction default_action = {{0}};
+        sigemptyset(&default_action.sa_mask);
+        default_action.sa_handler = SIG_DFL;
+
+        struct sigaction ignore_action = {{0}};
+        sigemptyset(&ignore_action.sa_mask);
+        ignore_action.sa_handler = SIG_IGN;
+
+        // fg child should respond to sigint, bg child should ignore it
+        if (userInput.runInBackground) {
+            sigaction(SIGINT, &ignore_action, NULL);
+        } else {
+            sigaction(SIGINT, &default_action, NULL);
+        }
+        sigaction(SIGTSTP, &ignore_action, NULL);
+        sigaction(SIGCHLD, &default_action, NULL);
+        sigaction(SIGUSR1, &default_action, NULL);
+        sigaction(SIGQUIT, &default_action, NULL);
+
+        sigset_t emptyMask;
+        sigemptyset(&emptyMask);
+        sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+        if (inputDestination >= 0) {
+            dup2(inputDestination, 0);
+        }
+        if (outputDestination >= 0) {
+            dup2(outputDestination, 1);
+        }
+        applyLaunchPolicy(&launchPolicy);
+        restoreFileLimit();
+
+        execvp(userInput.argv[0], userInput.argv);
+        // exec only returns here if there is an error
+        fprintf(stdout, "Command not found or failed to execute\n");
+        fflush(stdout);
+        _exit(1);
+    }
+
+    *spawnPid = pid;
+    return 0;
+}
+
+/*******************************************************************************
+ * spawnCommand()
+ *
+ *  Description:
+ *      Launches the command with posix_spawn, resolving bare command names
+ *      through the command hash so $PATH is only walked once. glibc
+ *      implements this with clone(CLONE_VM|CLONE_VFORK), so the shell's page
+ *      tables are never copied. Signal state and redirections are described
+ *      with spawn attributes and file actions instead of being set up in a
+ *      forked child, matching forkCommand():
+ *
+ *          SIGINT            - default for fg children, ignored for bg ones
+ *          SIGTSTP           - ignored, so the child never stops on ctrl^z
+ *          everything else   - reset to the default disposition and unblocked
+ *
+ *      The shell ignores SIGINT and SIGTSTP from setupEventLoop() on, so
+ *      the child inherits both ignored and only SIGINT of a fg child is
+ *      reset. The shell's own dispositions are never touched here.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ *      int inputDestination  - fd to place on stdin, or -1 to inherit
+ *      int outputDestination - fd to place on stdout, or -1 to inherit
+ *      pid_t *spawnPid       - receives the pid of the child
+ *
+ *  Outputs:
+ *      Returns 0 on success, otherwise an errno value. ENOSYS, ENOMEM and
+ *      EAGAIN mean the child was never created; anything else comes from
+ *      the exec itself.
+ ******************************************************************************/
+int spawnCommand(UserInputStruct userInput, int inputDestination,
+                 int outputDestination, pid_t *spawnPid) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t fileActions;
+    sigset_t defaultSignals;
+    sigset_t childMask;
+    int result;
+
+    if (posix_spawnattr_init(&attr) != 0) {
+        return ENOMEM;
+    }
+    if (posix_spawn_file_actions_init(&fileActions) != 0) {
+        posix_spawnattr_destroy(&attr);
+        return ENOMEM;
+    }
+
+    sigemptyset(&defaultSignals);
+    if (!userInput.runInBackground) {
+        sigaddset(&defaultSignals, SIGINT);
+    }
+    sigaddset(&defaultSignals, SIGCHLD);
+    sigaddset(&defaultSignals, SIGUSR1);
+    sigaddset(&defaultSignals, SIGQUIT);
+
+    sigemptyset(&childMask);
+
+    posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+    posix_spawnattr_setsigmask(&attr, &childMask);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    if (inputDestination >= 0) {
+        posix_spawn_file_actions_adddup2(&fileActions, inputDestination, 0);
+    }
+    if (outputDestination >= 0) {
+        posix_spawn_file_actions_adddup2(&fileActions, outputDestination, 1);
+    }
+
+    if (strchr(userInput.argv[0], '/') != NULL) {
+        result = posix_spawn(spawnPid, userInput.argv[0], &fileActions, &attr,
+                             userInput.argv, environ);
+    } else {
+        const char *path = commandHashLookup(userInput.argv[0]);
+        result = path == NULL ? ENOENT
+                              : posix_spawn(spawnPid, path, &fileActions,
+                                            &attr, userInput.argv, environ);
+        if (result == ENOENT && path != NULL) {
+            // the cached executable disappeared, look it up again
+            commandHashForget(userInput.argv[0]);
+            path = commandHashLookup(userInput.argv[0]);
+            if (path != NULL) {
+                result = posix_spawn(spawnPid, path, &fileActions, &attr,
+                                     userInput.argv, environ);
+            }
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&fileActions);
+    posix_spawnattr_destroy(&attr);
+
+    return result;
+}
+
+/*******************************************************************************
+ * launchStage()
+ *
+ *  Description:
+ *      Opens the redirection destinations of one pipeline stage and launches
+ *      it. A redirection to a file or a here-doc takes precedence over the
+ *      pipe connecting the stage to its neighbour, and a background stage
+ *      reads from and writes to /dev/null instead of the terminal.
+ *
+ *  Inputs:
+ *      UserInputStruct stage
+ *      int pipeInput  - read end of the pipe from the previous stage, or -1
+ *      int pipeOutput - write end of the pipe to the next stage, or -1
+ *
+ *  Outputs:
+ *      Returns the pid of the child, or -1 if none was created, in which case
+ *      currentStatus explains why.
+ ******************************************************************************/
+pid_t launchStage(UserInputStruct stage, int pipeInput, int pipeOutput) {
+    int inputDestination = pipeInput;
+    int outputDestination = pipeOutput;
+    pid_t spawnPid = -1;
+
+    // open redirection destinations
+    const char *inputPath = stage.inputDestination_ptr;
+    const char *outputPath = stage.outputDestination_ptr;
+    int inputDocument = -1;
+    if (stage.inputDocument_ptr != NULL) {
+        inputDocument = openDocument(stage.inputDocument_ptr,
+                                     stage.inputDocumentLength);
+        if (inputDocument < 0) {
+            fprintf(stderr, "Can not create here-document: %s\n",
+                    strerror(errno));
+            fflush(stderr);
+            currentStatus = W_EXITCODE(2, 0);
+            return -1;
+        }
+        inputDestination = inputDocument;
+    }
+    if (stage.runInBackground) {
+        // background children never read or write the terminal
+        if (inputPath == NULL && inputDocument < 0 && pipeInput < 0) {
+            inputPath = "/dev/null";
+        }
+        if (outputPath == NULL && pipeOutput < 0) {
+            outputPath = "/dev/null";
+        }
+    }
+
+    if (inputPath != NULL) {
+        inputDestination = open(inputPath, O_RDONLY | O_CLOEXEC, 0444);
+        if (inputDestination < 0) {
+            fprintf(stderr, "Can not open file for input redirection\n");
+            fflush(stderr);
+            if (inputDocument >= 0) {
+                close(inputDocument);
+            }
+            currentStatus = W_EXITCODE(2, 0);
+            return -1;
+        }
+    }
+    if (outputPath != NULL) {
+        outputDestination = open(outputPath,
+                                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                 0666);
+        if (outputDestination < 0) {
+            fprintf(stderr, "Can not open file for output redirection\n");
+            fflush(stderr);
+            if (inputPath != NULL || inputDocument >= 0) {
+                close(inputDestination);
+            }
+            currentStatus = W_EXITCODE(2, 0);
+            return -1;
+        }
+    }
+
+    int result = zygoteCommand(stage, inputDestination, outputDestination,
+                               &spawnPid);
+    if (launchPolicyActive(&launchPolicy) || eventLoop.fileLimitRaised) {
+        // posix_spawn can not set the policy or the file limit up, a forked
+        // child can
+        if (result == ENOENT) {
+            result = ENOSYS;
+        }
+    } else if (result == ENOSYS || result == ENOENT) {
+        // a bare name may have moved since the command hash resolved it,
+        // spawnCommand() looks it up again
+        result = spawnCommand(stage, inputDestination, outputDestination,
+                              &spawnPid);
+    }
+    if (result == ENOSYS || result == ENOMEM || result == EAGAIN) {
+        result = forkCommand(stage, inputDestination, outputDestination,
+                             &spawnPid);
+        if (result != 0) {
+            fprintf(stderr, "fork(): %s\n", strerror(result));
+            fflush(stderr);
+            exit(2);
+        }
+    }
+
+    // the pipe ends belong to the caller
+    if (inputPath != NULL || inputDocument >= 0) {
+        close(inputDestination);
+    }
+    if (outputPath != NULL) {
+        close(outputDestination);
+    }
+
+    if (result != 0) {
+        fprintf(stdout, "%s: Command not found or failed to execute\n",
+                stage.argv[0]);
+        fflush(stdout);
+        currentStatus = W_EXITCODE(1, 0);
+        return -1;
+    }
+
+    return spawnPid;
+}
+
+/*******************************************************************************
+ * launchPipeline()
+ *
+ *  Description:
+ *      Launches every stage of the pipeline a | b | c, connecting neighbours
+ *      with pipe2(O_CLOEXEC) pipes, without waiting for any of them. The
+ *      stages share the shell's process group, so ctrl^c reaches all of
+ *      them at once. The data flows through the kernel pipes directly from
+ *      one stage to the next and the shell never copies any of it.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput - first stage, the rest are linked by next
+ *      pid_t *pids               - room for the pid of every stage
+ *
+ *  Outputs:
+ *      Returns the number of stages launched, fewer than there are if a pipe
+ *      could not be created. A stage that could not be started is stored as
+ *      -1 and leaves the reason in currentStatus.
+ ******************************************************************************/
+size_t launchPipeline(UserInputStruct userInput, pid_t *pids) {
+    int previousRead = -1;
+    size_t nLaunched = 0;
+    for (UserInputStruct *stage = &userInput; stage != NULL;
+         stage = stage->next) {
+        int pipeFds[2] = {-1, -1};
+        if (stage->next != NULL && pipe2(pipeFds, O_CLOEXEC) != 0) {
+            fprintf(stderr, "pipe(): %s\n", strerror(errno));
+            fflush(stderr);
+            currentStatus = W_EXITCODE(1, 0);
+            break;
+        }
+
+        UserInputStruct stageInput = *stage;
+        stageInput.runInBackground = userInput.runInBackground;
+        pids[nLaunched++] = launchStage(stageInput, previousRead, pipeFds[1]);
+
+        if (previousRead >= 0) {
+            close(previousRead);
+        }
+        if (pipeFds[1] >= 0) {
+            close(pipeFds[1]);
+        }
+        previousRead = pipeFds[0];
+    }
+    if (previousRead >= 0) {
+        close(previousRead);
+    }
+    return nLaunched;
+}
+
+/*******************************************************************************
+ * launchCommand()
+ *
+ *  Description:
+ *      Launches the pipeline with launchPipeline() and waits for all of its
+ *      stages when it runs in the foreground.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput - first stage, the rest are linked by next
+ *      const char *commandLine   - text recorded for background jobs
+ *
+ *  Outputs:
+ *      Updates currentStatus with the status of the last stage, and lastUsage
+ *      with the usage of every stage, for foreground pipelines. currentStatus
+ *      is also set for stages that could not be started. Background
+ *      pipelines are added to the job table. Returns the pid of the last
+ *      stage, or -1 if it was not created.
+ ******************************************************************************/
+pid_t launchCommand(UserInputStruct userInput, const char *commandLine) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    traceStamp(&trace.current.spawn);
+
+    size_t nStages = 0;
+    for (UserInputStruct *stage = &userInput; stage != NULL;
+         stage = stage->next) {
+        nStages++;
+    }
+
+    pid_t localPids[16];
+    pid_t *pids = localPids;
+    if (nStages > sizeof(localPids) / sizeof(localPids[0])) {
+        pids = malloc(nStages * sizeof(pid_t));
+        if (pids == NULL) {
+            raise(SIGUSR1);
+            return -1;
+        }
+    }
+
+    size_t nLaunched = launchPipeline(userInput, pids);
+    pid_t lastPid = nLaunched == nStages ? pids[nLaunched - 1] : -1;
+    traceStamp(&trace.current.exec);
+
+    if (userInput.runInBackground) {
+        if (lastPid > 0) {
+            lastBackgroundPid = lastPid;
+        }
+        int jobId = jobInsert(pids, nLaunched, commandLine);
+        if (jobId < 0) {
+            fprintf(stderr, "Could not record background job\n");
+            fflush(stderr);
+        } else if (jobTable.jobs[jobId - 1].state == JOB_DONE) {
+            // none of its stages started
+            jobRetire(jobId - 1);
+        }
+        for (size_t i = 0; i < nLaunched; i++) {
+            if (pids[i] > 0) {
+                fprintf(stdout, "[%d] Background process PID:(%d)\n", jobId,
+                        pids[i]);
+            }
+        }
+        fflush(stdout);
+    } else {
+        // reap every stage, the pipeline reports the last one's status and
+        // the usage of all of them
+        ResourceUsage usage = {{0}};
+        for (size_t i = 0; i < nLaunched; i++) {
+            int childStatus;
+            struct rusage childUsage;
+            if (pids[i] <= 0 ||
+                wait4(pids[i], &childStatus, 0, &childUsage) <= 0) {
+                continue;
+            }
+            usageAdd(&usage, &childUsage);
+            if (pids[i] == lastPid) {
+                currentStatus = childStatus;
+                if (WIFSIGNALED(currentStatus)) {
+                    fprintf(stdout, "terminated by signal %d\n",
+                            WTERMSIG(currentStatus));
+                    fflush(stdout);
+                }
+            }
+        }
+        usageSetWall(&usage, &start);
+        lastUsage = usage;
+        usageMerge(&timedUsage, &usage);
+        traceStamp(&trace.current.reap);
+        traceWrite(&trace.current, lastPid > 0 ? lastPid : 0, currentStatus,
+                   &usage, commandLine);
+
+        // signals that arrived meanwhile are handled now, like the original
+        // handlers that were blocked during the wait. A ctrl^c was meant
+        // for the foreground command and is not replayed at the prompt.
+        runEventLoop(0);
+        eventLoop.interrupted = 0;
+    }
+
+    if (pids != localPids) {
+        free(pids);
+    }
+
+    return lastPid;
+}
+
+/*******************************************************************************
+ * execCommand()
+ *
+ *  Description:
+ *      Runs a single foreground command in place of the shell. smallsh -c
+ *      does this for its last command when nothing is left to do once it
+ *      exits, saving a fork and a wait and handing the caller the command's
+ *      own pid and exit status. Redirections, signal dispositions and the
+ *      launch policy are set up in the shell itself as forkCommand() does in
+ *      its child.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput - a single stage run in the foreground
+ *
+ *  Outputs:
+ *      Only returns if a redirection could not be opened or the exec failed,
+ *      with currentStatus set as launchStage() would. The shell's stdin,
+ *      stdout and signals may have changed by then, so it should exit.
+ ******************************************************************************/
+void execCommand(UserInputStruct userInput) {
+    int inputDestination = -1;
+    int outputDestination = -1;
+
+    if (userInput.inputDocument_ptr != NULL) {
+        inputDestination = openDocument(userInput.inputDocument_ptr,
+                                        userInput.inputDocumentLength);
+        if (inputDestination < 0) {
+            fprintf(stderr, "Can not create here-document: %s\n",
+                    strerror(errno));
+            fflush(stderr);
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+    } else if (userInput.inputDestination_ptr != NULL) {
+        inputDestination =
+            open(userInput.inputDestination_ptr, O_RDONLY | O_CLOEXEC, 0444);
+        if (inputDestination < 0) {
+            fprintf(stderr, "Can not open file for input redirection\n");
+            fflush(stderr);
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+    }
+    if (userInput.outputDestination_ptr != NULL) {
+        outputDestination = open(userInput.outputDestination_ptr,
+                                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                 0666);
+        if (outputDestination < 0) {
+            fprintf(stderr, "Can not open file for output redirection\n");
+            fflush(stderr);
+            if (inputDestination >= 0) {
+                close(inputDestination);
+            }
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+    }
+
+    // whatever the shell still has to say goes out before it is replaced
+    noticeFlush();
+    fflush(stdout);
+    fflush(stderr);
+    zygotePoolStop();
+
+    struct sigaction default_action = {{0}};
+    sigemptyset(&default_action.sa_mask);
+    default_action.sa_handler = SIG_DFL;
+
+    struct sigaction ignore_action = {{0}};
+    sigemptyset(&ignore_action.sa_mask);
+    ignore_action.sa_handler = SIG_IGN;
+
+    // a shell started with SIGINT or SIGQUIT ignored, as a background job
+    // of another shell, passes that on like sh
+    static const int keptSignals[] = {SIGINT, SIGQUIT};
+    for (size_t i = 0; i < sizeof(keptSignals) / sizeof(keptSignals[0]);
+         i++) {
+        int ignored = sigismember(&eventLoop.ignoredSignals, keptSignals[i]);
+        sigaction(keptSignals[i],
+                  ignored == 1 ? &ignore_action : &default_action, NULL);
+    }
+    sigaction(SIGTSTP, &ignore_action, NULL);
+    sigaction(SIGCHLD, &default_action, NULL);
+    sigaction(SIGUSR1, &default_action, NULL);
+
+    sigset_t emptyMask;
+    sigemptyset(&emptyMask);
+    sigprocmask(SIG_SETMASK, &emptyMask, NULL);
+
+    if (inputDestination >= 0) {
+        dup2(inputDestination, 0);
+        close(inputDestination);
+    }
+    if (outputDestination >= 0) {
+        dup2(outputDestination, 1);
+        close(outputDestination);
+    }
+    applyLaunchPolicy(&launchPolicy);
+    restoreFileLimit();
+
+    execvp(userInput.argv[0], userInput.argv);
+    fprintf(stdout, "%s: Command not found or failed to execute\n",
+            userInput.argv[0]);
+    fflush(stdout);
+    currentStatus = W_EXITCODE(1, 0);
+}
+
+/******************************************************************************
+ * Fast builtins
+ *
+ * echo, printf, test, [, true, false and pwd run inside the shell instead of
+ * in a child. Scripts call them constantly and a fork and exec cost far more
+ * than the work they do. They only run in-process as a single foreground
+ * command, a pipeline or a background command still executes the real
+ * utility. Redirections are applied by swapping the shell's own stdin and
+ * stdout for the time of the builtin.
+ ******************************************************************************/
+enum FastBuiltin {
+    FAST_NONE,
+    FAST_ECHO,
+    FAST_PRINTF,
+    FAST_TEST,
+    FAST_BRACKET,
+    FAST_TRUE,
+    FAST_FALSE,
+    FAST_PWD
+};
+
+/*******************************************************************************
+ * findFastBuiltin()
+ *
+ *  Description:
+ *      Switches on the first letter of the command name so that at most one
+ *      strcmp decides whether it is a fast builtin.
+ ******************************************************************************/
+enum FastBuiltin findFastBuiltin(const char *name) {
+    switch (name[0]) {
+    case '[':
+        return name[1] == '\0' ? FAST_BRACKET : FAST_NONE;
+    case 'e':
+        return strcmp(name, "echo") == 0 ? FAST_ECHO : FAST_NONE;
+    case 'f':
+        return strcmp(name, "false") == 0 ? FAST_FALSE : FAST_NONE;
+    case 'p':
+        if (name[1] == 'r') {
+            return strcmp(name, "printf") == 0 ? FAST_PRINTF : FAST_NONE;
+        }
+        return strcmp(name, "pwd") == 0 ? FAST_PWD : FAST_NONE;
+    case 't':
+        if (name[1] == 'e') {
+            return strcmp(name, "test") == 0 ? FAST_TEST : FAST_NONE;
+        }
+        return strcmp(name, "true") == 0 ? FAST_TRUE : FAST_NONE;
+    default:
+        return FAST_NONE;
+    }
+}
+
+/*******************************************************************************
+ * printEscape()
+ *
+ *  Description:
+ *      Prints the backslash escape starting at text, as printf interprets
+ *      them in its format and in %b arguments.
+ *
+ *  Outputs:
+ *      Returns the number of bytes of text consumed, and sets *stop for \c,
+ *      which ends all output.
+ ******************************************************************************/
+size_t printEscape(FILE *stream, const char *text, int *stop) {
+    static const char escapes[] = "\\\\a\ab\bf\fn\nr\rt\tv\v";
+    if (text[1] == 'c') {
+        *stop = 1;
+        return 2;
+    }
+    if (text[1] >= '0' && text[1] <= '7') {
+        // up to three octal digits, after an optional 0 as %b allows
+        size_t i = 1;
+        int value = 0;
+        if (text[1] == '0') {
+            i++;
+        }
+        for (size_t end = i + 3; i < end && text[i] >= '0' && text[i] <= '7';
+             i++) {
+            value = value * 8 + (text[i] - '0');
+        }
+        fputc(value, stream);
+        return i;
+    }
+    for (size_t i = 0; text[1] != '\0' && escapes[i] != '\0'; i += 2) {
+        if (escapes[i] == text[1]) {
+            fputc(escapes[i + 1], stream);
+            return 2;
+        }
+    }
+    fputc('\\', stream);
+    return 1;
+}
+
+/*******************************************************************************
+ * echoBuiltin()
+ *
+ *  Description:
+ *      echo [-neE] [word ...] prints the words separated by spaces, followed
+ *      by a newline unless -n is given. -e interprets the backslash escapes
+ *      of the words as printf does, up to a \c ending all output, and -E,
+ *      the default, turns that off again. As with /bin/echo, options may be
+ *      combined as in -ne, and any other word starting with - is printed.
+ ******************************************************************************/
+int echoBuiltin(UserInputStruct userInput) {
+    size_t first = 1;
+    int newline = 1;
+    int escapes = 0;
+    char *option;
+    while ((option = userInput.argv[first]) != NULL && option[0] == '-' &&
+           option[1] != '\0' &&
+           strspn(option + 1, "neE") == strlen(option + 1)) {
+        for (option++; *option != '\0'; option++) {
+            if (*option == 'n') {
+                newline = 0;
+            } else {
+                escapes = *option == 'e';
+            }
+        }
+        first++;
+    }
+
+    int stop = 0;
+    for (size_t i = first; userInput.argv[i] != NULL && !stop; i++) {
+        if (i > first) {
+            fputc(' ', stdout);
+        }
+        if (!escapes) {
+            fputs(userInput.argv[i], stdout);
+            continue;
+        }
+        const char *p = userInput.argv[i];
+        while (*p != '\0' && !stop) {
+            if (*p == '\\') {
+                p += printEscape(stdout, p, &stop);
+            } else {
+                fputc(*p++, stdout);
+            }
+        }
+    }
+    if (newline && !stop) {
+        fputc('\n', stdout);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * printfBuiltin()
+ *
+ *  Description:
+ *      printf format [argument ...] prints the arguments under the control of
+ *      the format, reusing the format until every argument is consumed.
+ *      Supports the flags, width and precision of C's printf with the
+ *      conversions d i o u x X e E f F g G c s b and %%, and the usual
+ *      backslash escapes.
+ *
+ *  Outputs:
+ *      Returns 1 if a numeric argument was not a number, 0 otherwise.
+ ******************************************************************************/
+int printfBuiltin(UserInputStruct userInput) {
+    if (userInput.argv[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [argument ...]\n");
+        fflush(stderr);
+        return 2;
+    }
+    const char *format = userInput.argv[1];
+    char **arguments = userInput.argv + 2;
+    int result = 0;
+    int stop = 0;
+
+    do {
+        char **start = arguments;
+        for (const char *p = format; *p != '\0' && !stop;) {
+            if (*p == '\\') {
+                p += printEscape(stdout, p, &stop);
+                continue;
+            }
+            if (*p != '%') {
+                fputc(*p++, stdout);
+                continue;
+            }
+            if (p[1] == '%') {
+                fputc('%', stdout);
+                p += 2;
+                continue;
+            }
+
+            // copy the specification, turning * into the next argument
+            char spec[64];
+            size_t specLength = 0;
+            spec[specLength++] = *p++;
+            while (*p != '\0' && strchr("-+ #0123456789.*", *p) != NULL &&
+                   specLength < sizeof(spec) - 24) {
+                if (*p == '*') {
+                    int width = *arguments != NULL ? atoi(*arguments++) : 0;
+                    formatInt(spec, &specLength, sizeof(spec) - 4, width);
+                    p++;
+                } else {
+                    spec[specLength++] = *p++;
+                }
+            }
+            char conversion = *p;
+            if (conversion == '\0') {
+                break;
+            }
+            p++;
+            const char *argument = *arguments != NULL ? *arguments++ : NULL;
+
+            if (strchr("diouxXc", conversion) != NULL) {
+                char *end = NULL;
+                long long value = 0;
+                if (argument != NULL && conversion == 'c') {
+                    value = (unsigned char)argument[0];
+                } else if (argument != NULL &&
+                           (argument[0] == '\'' || argument[0] == '"')) {
+                    // 'c is the code of the character c
+                    value = (unsigned char)argument[1];
+                } else if (argument != NULL) {
+                    errno = 0;
+                    value = strtoll(argument, &end, 0);
+                    if (*end != '\0' || end == argument || errno != 0) {
+                        fprintf(stderr, "printf: %s: invalid number\n",
+                                argument);
+                        fflush(stderr);
+                        result = 1;
+                    }
+                }
+                if (conversion == 'c' && value == 0) {
+                    // an empty argument prints nothing, not a NUL
+                } else if (conversion == 'c') {
+                    spec[specLength++] = 'c';
+                    spec[specLength] = '\0';
+                    fprintf(stdout, spec, (int)value);
+                } else {
+                    spec[specLength++] = 'l';
+                    spec[specLength++] = 'l';
+                    spec[specLength++] = conversion;
+                    spec[specLength] = '\0';
+                    fprintf(stdout, spec, value);
+                }
+            } else if (strchr("eEfFgG", conversion) != NULL) {
+                char *end = NULL;
+                double value = 0;
+                if (argument != NULL) {
+                    value = strtod(argument, &end);
+                    if (*end != '\0' || end == argument) {
+                        fprintf(stderr, "printf: %s: invalid number\n",
+                                argument);
+                        fflush(stderr);
+                        result = 1;
+                    }
+                }
+                spec[specLength++] = conversion;
+                spec[specLength] = '\0';
+                fprintf(stdout, spec, value);
+            } else if (conversion == 's') {
+                spec[specLength++] = 's';
+                spec[specLength] = '\0';
+                fprintf(stdout, spec, argument != NULL ? argument : "");
+            } else if (conversion == 'b') {
+                const char *q = argument != NULL ? argument : "";
+                while (*q != '\0' && !stop) {
+                    if (*q == '\\') {
+                        q += printEscape(stdout, q, &stop);
+                    } else {
+                        fputc(*q++, stdout);
+                    }
+                }
+            } else {
+                fprintf(stderr, "printf: %%%c: invalid conversion\n",
+                        conversion);
+                fflush(stderr);
+                return 1;
+            }
+        }
+        // a format without conversions would never consume the rest
+        if (arguments == start) {
+            break;
+        }
+    } while (*arguments != NULL && !stop);
+
+    return result;
+}
+
+/*******************************************************************************
+ * Test expressions
+ *
+ * test and [ evaluate their arguments with a recursive descent parser over
+ *
+ *  expression := and ( -o and )*
+ *  and        := not ( -a not )*
+ *  not        := ! not | primary
+ *  primary    := ( expression ) | unary word | word binary word | word
+ *
+ * A binary operator is preferred over a unary one where both could apply, so
+ * that test -n = -n compares strings like other shells do.
+ ******************************************************************************/
+struct TestParser {
+    char **argv;
+    size_t argc;
+    size_t position;
+    int error; // 1 on a syntax error, 2 if it was already reported
+};
+typedef struct TestParser TestParser;
+
+/*******************************************************************************
+ * testBinary()
+ *
+ *  Description:
+ *      Evaluates a binary test operator, or returns -1 if op is not one.
+ ******************************************************************************/
+int testBinary(TestParser *parser, const char *left, const char *op,
+               const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    }
+    if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    }
+    if (op[0] != '-' || strlen(op) != 3) {
+        return -1;
+    }
+
+    static const char *numeric[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (size_t i = 0; i < sizeof(numeric) / sizeof(numeric[0]); i++) {
+        if (strcmp(op, numeric[i]) != 0) {
+            continue;
+        }
+        char *leftEnd;
+        char *rightEnd;
+        long long a = strtoll(left, &leftEnd, 10);
+        long long b = strtoll(right, &rightEnd, 10);
+        if (*leftEnd != '\0' || leftEnd == left || *rightEnd != '\0' ||
+            rightEnd == right) {
+            fprintf(stderr, "test: %s: integer expected\n",
+                    *leftEnd != '\0' || leftEnd == left ? left : right);
+            fflush(stderr);
+            parser->error = 2;
+            return 0;
+        }
+        switch (i) {
+        case 0:
+            return a == b;
+        case 1:
+            return a != b;
+        case 2:
+            return a < b;
+        case 3:
+            return a <= b;
+        case 4:
+            return a > b;
+        default:
+            return a >= b;
+        }
+    }
+
+    struct stat leftInfo;
+    struct stat rightInfo;
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 ||
+        strcmp(op, "-ef") == 0) {
+        int haveLeft = stat(left, &leftInfo) == 0;
+        int haveRight = stat(right, &rightInfo) == 0;
+        if (op[1] == 'e') {
+            return haveLeft && haveRight &&
+                   leftInfo.st_dev == rightInfo.st_dev &&
+                   leftInfo.st_ino == rightInfo.st_ino;
+        }
+        if (!haveLeft || !haveRight) {
+            return op[1] == 'n' ? haveLeft : haveRight;
+        }
+        struct timespec a = op[1] == 'n' ? leftInfo.st_mtim : rightInfo.st_mtim;
+        struct timespec b = op[1] == 'n' ? rightInfo.st_mtim : leftInfo.st_mtim;
+        return a.tv_sec > b.tv_sec ||
+               (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+    }
+    return -1;
+}
+
+/*******************************************************************************
+ * testUnary()
+ *
+ *  Description:
+ *      Evaluates a unary test operator, or returns -1 if op is not one.
+ ******************************************************************************/
+int testUnary(const char *op, const char *operand) {
+    struct stat info;
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+        return -1;
+    }
+    switch (op[1]) {
+    case 'n':
+        return operand[0] != '\0';
+    case 'z':
+        return operand[0] == '\0';
+    case 'e':
+        return stat(operand, &info) == 0;
+    case 'f':
+        return stat(operand, &info) == 0 && S_ISREG(info.st_mode);
+    case 'd':
+        return stat(operand, &info) == 0 && S_ISDIR(info.st_mode);
+    case 'b':
+        return stat(operand, &info) == 0 && S_ISBLK(info.st_mode);
+    case 'c':
+        return stat(operand, &info) == 0 && S_ISCHR(info.st_mode);
+    case 'p':
+        return stat(operand, &info) == 0 && S_ISFIFO(info.st_mode);
+    case 'S':
+        return stat(operand, &info) == 0 && S_ISSOCK(info.st_mode);
+    case 'h':
+    case 'L':
+        return lstat(operand, &info) == 0 && S_ISLNK(info.st_mode);
+    case 's':
+        return stat(operand, &info) == 0 && info.st_size > 0;
+    case 'g':
+        return stat(operand, &info) == 0 && (info.st_mode & S_ISGID);
+    case 'u':
+        return stat(operand, &info) == 0 && (info.st_mode & S_ISUID);
+    case 'k':
+        return stat(operand, &info) == 0 && (info.st_mode & S_ISVTX);
+    case 'r':
+        return access(operand, R_OK) == 0;
+    case 'w':
+        return access(operand, W_OK) == 0;
+    case 'x':
+        return access(operand, X_OK) == 0;
+    case 't':
+        return isatty(atoi(operand));
+    default:
+        return -1;
+    }
+}
+
+int testExpression(TestParser *parser);
+
+/*******************************************************************************
+ * testPrimary()
+ ******************************************************************************/
+int testPrimary(TestParser *parser) {
+    char **argv = parser->argv;
+    size_t i = parser->position;
+    size_t remaining = parser->argc - i;
+
+    if (remaining == 0) {
+        parser->error = 1;
+        return 0;
+    }
+    if (remaining >= 3) {
+        int result = testBinary(parser, argv[i], argv[i + 1], argv[i + 2]);
+        if (result >= 0) {
+            parser->position += 3;
+            return result;
+        }
+    }
+    if (strcmp(argv[i], "(") == 0 && remaining >= 2) {
+        parser->position++;
+        int result = testExpression(parser);
+        if (parser->position >= parser->argc ||
+            strcmp(argv[parser->position], ")") != 0) {
+            parser->error = 1;
+            return 0;
+        }
+        parser->position++;
+        return result;
+    }
+    if (remaining >= 2) {
+        int result = testUnary(argv[i], argv[i + 1]);
+        if (result >= 0) {
+            parser->position += 2;
+            return result;
+        }
+    }
+    parser->position++;
+    return argv[i][0] != '\0';
+}
+
+/*******************************************************************************
+ * testNot()
+ ******************************************************************************/
+int testNot(TestParser *parser) {
+    // a lone ! is a non-empty string, not an operator
+    if (parser->position + 1 < parser->argc &&
+        strcmp(parser->argv[parser->position], "!") == 0) {
+        parser->position++;
+        return !testNot(parser);
+    }
+    return testPrimary(parser);
+}
+
+/*******************************************************************************
+ * testAnd()
+ ******************************************************************************/
+int testAnd(TestParser *parser) {
+    int result = testNot(parser);
+    while (parser->position + 1 < parser->argc &&
+           strcmp(parser->argv[parser->position], "-a") == 0) {
+        parser->position++;
+        result = testNot(parser) && result;
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * testExpression()
+ ******************************************************************************/
+int testExpression(TestParser *parser) {
+    int result = testAnd(parser);
+    while (parser->position + 1 < parser->argc &&
+           strcmp(parser->argv[parser->position], "-o") == 0) {
+        parser->position++;
+        result = testAnd(parser) || result;
+    }
+    return result;
+}
+
+/*******************************************************************************
+ * testBuiltin()
+ *
+ *  Description:
+ *      test expression, or [ expression ], exits 0 when the expression is
+ *      true, 1 when it is false or empty and 2 on a syntax error.
+ ******************************************************************************/
+int testBuiltin(UserInputStruct userInput, int bracket) {
+    TestParser parser = {userInput.argv + 1, userInput.argc - 1, 0, 0};
+    if (bracket) {
+        if (parser.argc == 0 ||
+            strcmp(parser.argv[parser.argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            fflush(stderr);
+            return 2;
+        }
+        parser.argc--;
+    }
+    if (parser.argc == 0) {
+        return 1;
+    }
+
+    int result = testExpression(&parser);
+    if (!parser.error && parser.position != parser.argc) {
+        fprintf(stderr, "%s: %s: unexpected operator\n", userInput.argv[0],
+                parser.argv[parser.position]);
+        fflush(stderr);
+        return 2;
+    }
+    if (parser.error == 1) {
+        fprintf(stderr, "%s: syntax error\n", userInput.argv[0]);
+        fflush(stderr);
+    }
+    if (parser.error) {
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+/*******************************************************************************
+ * pwdBuiltin()
+ *
+ *  Description:
+ *      pwd prints the working directory.
+ ******************************************************************************/
+int pwdBuiltin() {
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == NULL) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        fflush(stderr);
+        return 1;
+    }
+    fprintf(stdout, "%s\n", directory);
+    return 0;
+}
+
+/*******************************************************************************
+ * runFastBuiltin()
+ *
+ *  Description:
+ *      Runs a fast builtin in the shell with its redirections applied to the
+ *      shell's own stdin and stdout, which are put back afterwards, and sets
+ *      currentStatus from its result.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput - a single foreground command
+ *      enum FastBuiltin builtin  - from findFastBuiltin()
+ ******************************************************************************/
+void runFastBuiltin(UserInputStruct userInput, enum FastBuiltin builtin) {
+    int savedInput = -1;
+    int savedOutput = -1;
+    int redirection = -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (userInput.inputDocument_ptr != NULL ||
+        userInput.inputDestination_ptr != NULL) {
+        redirection =
+            userInput.inputDocument_ptr != NULL
+                ? openDocument(userInput.inputDocument_ptr,
+                               userInput.inputDocumentLength)
+                : open(userInput.inputDestination_ptr, O_RDONLY | O_CLOEXEC);
+        if (redirection < 0) {
+            fprintf(stderr, "Can not open file for input redirection\n");
+            fflush(stderr);
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+        savedInput = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(redirection, STDIN_FILENO);
+        close(redirection);
+    }
+    if (userInput.outputDestination_ptr != NULL) {
+        redirection = open(userInput.outputDestination_ptr,
+                           O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (redirection < 0) {
+            fprintf(stderr, "Can not open file for output redirection\n");
+            fflush(stderr);
+            currentStatus = W_EXITCODE(2, 0);
+        } else {
+            fflush(stdout);
+            savedOutput = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+            dup2(redirection, STDOUT_FILENO);
+            close(redirection);
+        }
+    }
+
+    if (userInput.outputDestination_ptr == NULL || savedOutput >= 0) {
+        int result = 0;
+        switch (builtin) {
+        case FAST_ECHO:
+            result = echoBuiltin(userInput);
+            break;
+        case FAST_PRINTF:
+            result = printfBuiltin(userInput);
+            break;
+        case FAST_TEST:
+        case FAST_BRACKET:
+            result = testBuiltin(userInput, builtin == FAST_BRACKET);
+            break;
+        case FAST_FALSE:
+            result = 1;
+            break;
+        case FAST_PWD:
+            result = pwdBuiltin();
+            break;
+        default:
+            break;
+        }
+        fflush(stdout);
+        currentStatus = W_EXITCODE(result, 0);
+    }
+
+    if (savedOutput >= 0) {
+        dup2(savedOutput, STDOUT_FILENO);
+        close(savedOutput);
+    }
+    if (savedInput >= 0) {
+        dup2(savedInput, STDIN_FILENO);
+        close(savedInput);
+    }
+
+    lastUsage = (ResourceUsage){{0}};
+    usageSetWall(&lastUsage, &start);
+}
+
+/******************************************************************************
+ * Scheduler
+ *
+ * Runs many foreground commands with a bound on how many are alive at once,
+ * starting the next one as soon as any of them exits. Every child is watched
+ * through a pidfd in an epoll instance of its own, which also watches the
+ * shell's signalfd so ctrl^c and the job table are still handled while it
+ * waits. The stdout of each child is captured in a memfd and copied out when
+ * it finishes, so outputs are never interleaved.
+ ******************************************************************************/
+
+/*******************************************************************************
+ * schedulerInit()
+ *
+ *  Inputs:
+ *      Scheduler *scheduler
+ *      size_t maxRunning - children allowed to run at once, at least 1
+ *      int keepOrder     - print outputs in the order tasks were started
+ *      int outputFd      - where outputs are written
+ *
+ *  Outputs:
+ *      Returns 0 on success, -1 on failure.
+ ******************************************************************************/
+int schedulerInit(Scheduler *scheduler, size_t maxRunning, int keepOrder,
+                  int outputFd) {
+    *scheduler = (Scheduler){0};
+    scheduler->maxRunning = maxRunning;
+    scheduler->keepOrder = keepOrder;
+    scheduler->outputFd = outputFd;
+    scheduler->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    scheduler->running = calloc(maxRunning, sizeof(ParallelTask));
+    scheduler->freeSlots = malloc(maxRunning * sizeof(size_t));
+    if (scheduler->epollFd < 0 || scheduler->running == NULL ||
+        scheduler->freeSlots == NULL) {
+        close(scheduler->epollFd);
+        free(scheduler->running);
+        free(scheduler->freeSlots);
+        return -1;
+    }
+    for (size_t i = 0; i < maxRunning; i++) {
+        scheduler->freeSlots[scheduler->nFree++] = maxRunning - 1 - i;
+    }
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)EVENT_SIGNAL << 32;
+    epoll_ctl(scheduler->epollFd, EPOLL_CTL_ADD, eventLoop.signalFd, &event);
+    return 0;
+}
+
+/*******************************************************************************
+ * schedulerCopyOutput()
+ *
+ *  Description:
+ *      Copies a captured output to the scheduler's output with sendfile(),
+ *      falling back to read() and write(), and closes it.
+ ******************************************************************************/
+void schedulerCopyOutput(Scheduler *scheduler, int output) {
+    if (output < 0) {
+        return;
+    }
+
+    struct stat info;
+    off_t offset = 0;
+    if (fstat(output, &info) == 0) {
+        while (offset < info.st_size) {
+            ssize_t sent = sendfile(scheduler->outputFd, output, &offset,
+                                    (size_t)(info.st_size - offset));
+            if (sent > 0) {
+                continue;
+            }
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                char buffer[16384];
+                ssize_t nRead;
+                while ((nRead = pread(output, buffer, sizeof(buffer),
+                                      offset)) > 0 &&
+                       write(scheduler->outputFd, buffer, (size_t)nRead) ==
+                           nRead) {
+                    offset += nRead;
+                }
+            }
+            break;
+        }
+    }
+    close(output);
+}
+
+/*******************************************************************************
+ * schedulerCollect()
+ *
+ *  Description:
+ *      Reaps the child in a running slot if it has exited, records its
+ *      status and prints every output that is now due.
+ *
+ *  Outputs:
+ *      Returns 1 if the child was reaped, 0 if it is still running.
+ ******************************************************************************/
+int schedulerCollect(Scheduler *scheduler, size_t slot) {
+    ParallelTask *task = &scheduler->running[slot];
+    if (task->pid <= 0) {
+        // stale event for a slot reaped earlier in the same batch
+        return 0;
+    }
+    int status;
+    struct rusage usage = {{0}};
+    pid_t pid = wait4(task->pid, &status, WNOHANG, &usage);
+    if (pid == 0) {
+        return 0;
+    }
+    if (pid < 0) {
+        status = W_EXITCODE(1, 0);
+    }
+    usageAdd(&scheduler->usage, &usage);
+
+    if (task->pidfd >= 0) {
+        epoll_ctl(scheduler->epollFd, EPOLL_CTL_DEL, task->pidfd, NULL);
+        close(task->pidfd);
+    }
+    scheduler->statuses[task->index] = status;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        scheduler->nFailed++;
+    }
+
+    fflush(stdout);
+    if (scheduler->keepOrder) {
+        scheduler->outputs[task->index] = task->output;
+        while (scheduler->nextOutput < scheduler->nTasks &&
+               scheduler->outputs[scheduler->nextOutput] != OUTPUT_PENDING) {
+            schedulerCopyOutput(scheduler,
+                                scheduler->outputs[scheduler->nextOutput]);
+            scheduler->nextOutput++;
+        }
+    } else {
+        schedulerCopyOutput(scheduler, task->output);
+    }
+
+    task->pid = 0;
+    scheduler->freeSlots[scheduler->nFree++] = slot;
+    scheduler->nRunning--;
+    return 1;
+}
+
+/*******************************************************************************
+ * schedulerReap()
+ *
+ *  Description:
+ *      Waits up to timeout milliseconds (-1 forever) and reaps every child
+ *      that exited. Signals are handed to the shell's event loop.
+ ******************************************************************************/
+void schedulerReap(Scheduler *scheduler, int timeout) {
+    struct epoll_event events[64];
+    int nEvents = epoll_wait(scheduler->epollFd, events, 64, timeout);
+
+    int sawSignal = 0;
+    for (int i = 0; i < nEvents; i++) {
+        if ((int)(events[i].data.u64 >> 32) == EVENT_SIGNAL) {
+            sawSignal = 1;
+        } else {
+            schedulerCollect(scheduler, (size_t)(uint32_t)events[i].data.u64);
+        }
+    }
+
+    if (sawSignal) {
+        runEventLoop(0);
+        // children without a pidfd are only noticed through SIGCHLD
+        for (size_t i = 0; i < scheduler->maxRunning; i++) {
+            if (scheduler->running[i].pid > 0 &&
+                scheduler->running[i].pidfd < 0) {
+                schedulerCollect(scheduler, i);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ * schedulerStart()
+ *
+ *  Description:
+ *      Waits for a free slot, then launches stage in the foreground with its
+ *      stdout captured. A stage that can not be launched counts as a failed
+ *      task with the status launchStage() left in currentStatus.
+ *
+ *  Outputs:
+ *      Returns 0 once the task is started, or -1 if ctrl^c interrupted the
+ *      wait or the task could not be recorded.
+ ******************************************************************************/
+int schedulerStart(Scheduler *scheduler, UserInputStruct stage) {
+    while (scheduler->nFree == 0 && !eventLoop.interrupted) {
+        schedulerReap(scheduler, -1);
+    }
+    if (eventLoop.interrupted) {
+        return -1;
+    }
+
+    if (scheduler->nTasks == scheduler->tasksCapacity) {
+        size_t capacity =
+            scheduler->tasksCapacity == 0 ? 64 : scheduler->tasksCapacity * 2;
+        int *outputs = realloc(scheduler->outputs, capacity * sizeof(int));
+        if (outputs != NULL) {
+            scheduler->outputs = outputs;
+        }
+        int *statuses = realloc(scheduler->statuses, capacity * sizeof(int));
+        if (statuses != NULL) {
+            scheduler->statuses = statuses;
+        }
+        if (outputs == NULL || statuses == NULL) {
+            raise(SIGUSR1);
+            return -1;
+        }
+        scheduler->tasksCapacity = capacity;
+    }
+
+    size_t index = scheduler->nTasks++;
+    scheduler->outputs[index] = OUTPUT_PENDING;
+    scheduler->statuses[index] = 0;
+
+    // without memfds the outputs go straight to their destination
+    int output = memfd_create("smallsh-parallel", MFD_CLOEXEC);
+    stage.runInBackground = 0;
+    pid_t pid = launchStage(stage, -1,
+                            output >= 0 ? output : scheduler->outputFd);
+
+    size_t slot = scheduler->freeSlots[--scheduler->nFree];
+    ParallelTask *task = &scheduler->running[slot];
+    task->pid = pid;
+    task->output = output;
+    task->index = index;
+    task->pidfd = -1;
+    scheduler->nRunning++;
+
+    if (pid < 0) {
+        // nothing to wait for, record the failure right away
+        task->pid = 0;
+        scheduler->freeSlots[scheduler->nFree++] = slot;
+        scheduler->nRunning--;
+        scheduler->statuses[index] = currentStatus;
+        scheduler->nFailed++;
+        if (output >= 0) {
+            close(output);
+        }
+        scheduler->outputs[index] = -1;
+        while (scheduler->keepOrder &&
+               scheduler->nextOutput < scheduler->nTasks &&
+               scheduler->outputs[scheduler->nextOutput] != OUTPUT_PENDING) {
+            schedulerCopyOutput(scheduler,
+                                scheduler->outputs[scheduler->nextOutput]);
+            scheduler->nextOutput++;
+        }
+        return 0;
+    }
+
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t)EVENT_CHILD << 32) | (uint32_t)slot;
+        if (epoll_ctl(scheduler->epollFd, EPOLL_CTL_ADD, pidfd, &event) == 0) {
+            task->pidfd = pidfd;
+        } else {
+            close(pidfd);
+        }
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * schedulerFinish()
+ *
+ *  Description:
+ *      Waits for every running task, even after ctrl^c since the children
+ *      received it too, prints the outputs still held back and releases the
+ *      scheduler. The statuses stay valid until the caller frees them.
+ ******************************************************************************/
+void schedulerFinish(Scheduler *scheduler) {
+    while (scheduler->nRunning > 0) {
+        schedulerReap(scheduler, -1);
+    }
+
+    close(scheduler->epollFd);
+    free(scheduler->running);
+    free(scheduler->freeSlots);
+    free(scheduler->outputs);
+    scheduler->running = NULL;
+    scheduler->freeSlots = NULL;
+    scheduler->outputs = NULL;
+}
+
+/*******************************************************************************
+ * readAllInput()
+ *
+ *  Description:
+ *      Reads the whole input of a builtin: the file or here-doc it redirects
+ *      its stdin from, or else the shell's own stdin up to its end. When the
+ *      script is read from stdin that would swallow the rest of it, so the
+ *      builtin fails instead.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ *      size_t *length - receives the number of bytes read
+ *
+ *  Outputs:
+ *      Returns the contents, NUL terminated, to be freed by the caller, or
+ *      NULL after reporting the failure in currentStatus.
+ ******************************************************************************/
+char *readAllInput(UserInputStruct userInput, size_t *length) {
+    int fd = STDIN_FILENO;
+    if (userInput.inputDocument_ptr != NULL) {
+        fd = openDocument(userInput.inputDocument_ptr,
+                          userInput.inputDocumentLength);
+    } else if (userInput.inputDestination_ptr != NULL) {
+        fd = open(userInput.inputDestination_ptr, O_RDONLY | O_CLOEXEC);
+    } else if (scriptOnStdin) {
+        fprintf(stderr, "%s: stdin is the script, give the input with <\n",
+                userInput.argv[0]);
+        fflush(stderr);
+        currentStatus = W_EXITCODE(2, 0);
+        return NULL;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Can not open file for input redirection\n");
+        fflush(stderr);
+        currentStatus = W_EXITCODE(2, 0);
+        return NULL;
+    }
+
+    // files are read in one go, pipes and terminals as far as they go
+    struct stat info;
+    size_t capacity = 64 * 1024;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+        (size_t)info.st_size >= capacity) {
+        capacity = (size_t)info.st_size + 1;
+    }
+    char *contents = malloc(capacity);
+    *length = 0;
+    while (contents != NULL) {
+        if (*length + 1 == capacity) {
+            char *grown = realloc(contents, capacity * 2);
+            if (grown == NULL) {
+                free(contents);
+                contents = NULL;
+                break;
+            }
+            contents = grown;
+            capacity *= 2;
+        }
+        ssize_t nRead = read(fd, contents + *length, capacity - 1 - *length);
+        if (nRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nRead <= 0) {
+            break;
+        }
+        *length += (size_t)nRead;
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    if (contents == NULL) {
+        raise(SIGUSR1);
+        return NULL;
+    }
+    contents[*length] = '\0';
+    return contents;
+}
+
+/*******************************************************************************
+ * parallelBuiltin()
+ *
+ *  Description:
+ *      parallel [-j N] [-k] command [arg ...] ::: value ...
+ *      parallel [-j N] [-k] command [arg ...] < file
+ *
+ *      Runs command once per value, or per line of file or of a here-doc,
+ *      with at most N (default: the number of online CPUs, 0 for no limit)
+ *      running at once. Every {} in the arguments is replaced by the value,
+ *      which is appended when there is no {}. Each command's stdout is
+ *      printed in one piece when it finishes, or in the order of the values
+ *      with -k, to stdout or to the file given with >. Failed commands are
+ *      listed on stderr and the status is the number of failures, at most
+ *      101.
+ ******************************************************************************/
+void parallelBuiltin(UserInputStruct userInput) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long maxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+    int keepOrder = 0;
+    int badOption = 0;
+    size_t i = 1;
+
+    for (; userInput.argv[i] != NULL && userInput.argv[i][0] == '-'; i++) {
+        if (strcmp(userInput.argv[i], "-k") == 0) {
+            keepOrder = 1;
+        } else if (strcmp(userInput.argv[i], "-j") == 0 &&
+                   userInput.argv[i + 1] != NULL) {
+            char *end = NULL;
+            maxRunning = strtol(userInput.argv[++i], &end, 10);
+            if (*end != '\0' || maxRunning < 0) {
+                badOption = 1;
+            }
+        } else {
+            break;
+        }
+    }
+
+    size_t templateStart = i;
+    while (userInput.argv[i] != NULL && strcmp(userInput.argv[i], ":::") != 0) {
+        i++;
+    }
+    size_t templateLength = i - templateStart;
+    int haveValues = userInput.argv[i] != NULL;
+    int haveInput = userInput.inputDestination_ptr != NULL ||
+                    userInput.inputDocument_ptr != NULL;
+    if (badOption || templateLength == 0 || haveValues == haveInput) {
+        fprintf(stderr, "usage: parallel [-j N] [-k] command [arg ...] "
+                        "::: value ... | < file\n");
+        fflush(stderr);
+        currentStatus = W_EXITCODE(2, 0);
+        return;
+    }
+
+    // the values are either the words after ::: or the lines of a file or
+    // here-doc
+    char **values = &userInput.argv[i + (haveValues ? 1 : 0)];
+    size_t nValues = userInput.argc - (size_t)(values - userInput.argv);
+    char *fileContents = NULL;
+    char **fileValues = NULL;
+    if (!haveValues) {
+        size_t length;
+        fileContents = readAllInput(userInput, &length);
+        fileValues = fileContents == NULL
+                         ? NULL
+                         : malloc((length / 2 + 1) * sizeof(char *));
+        if (fileValues == NULL) {
+            if (fileContents != NULL) {
+                raise(SIGUSR1);
+            }
+            free(fileContents);
+            return;
+        }
+
+        // one value per non-empty line
+        nValues = 0;
+        for (char *line = fileContents; line < fileContents + length;) {
+            char *newline = memchr(line, '\n', length - (line - fileContents));
+            if (newline == NULL) {
+                newline = fileContents + length;
+            }
+            *newline = '\0';
+            if (newline > line) {
+                fileValues[nValues++] = line;
+            }
+            line = newline + 1;
+        }
+        values = fileValues;
+    }
+
+    int outputFd = STDOUT_FILENO;
+    if (userInput.outputDestination_ptr != NULL) {
+        outputFd = open(userInput.outputDestination_ptr,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (outputFd < 0) {
+            fprintf(stderr, "Can not open file for output redirection\n");
+            fflush(stderr);
+            free(fileContents);
+            free(fileValues);
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+    }
+
+    if (maxRunning <= 0 || (size_t)maxRunning > nValues) {
+        maxRunning = nValues > 0 ? (long)nValues : 1;
+    }
+
+    int substitutes = 0;
+    for (size_t t = 0; t < templateLength; t++) {
+        if (strstr(userInput.argv[templateStart + t], "{}") != NULL) {
+            substitutes = 1;
+        }
+    }
+
+    Scheduler scheduler;
+    int ready = schedulerInit(&scheduler, (size_t)maxRunning, keepOrder,
+                              outputFd) == 0;
+    if (!ready) {
+        raise(SIGUSR1);
+        nValues = 0;
+    }
+
+    // each command line is built in an arena reused for every value
+    Arena commandArgs = {0};
+    size_t nStarted = 0;
+    for (; nStarted < nValues; nStarted++) {
+        const char *value = values[nStarted];
+        size_t valueLength = strlen(value);
+        size_t bytes = (templateLength + 2) * sizeof(char *) + valueLength + 1;
+        for (size_t t = 0; t < templateLength; t++) {
+            const char *word = userInput.argv[templateStart + t];
+            bytes += strlen(word) + 1 + sizeof(char *);
+            for (const char *at = strstr(word, "{}"); at != NULL;
+                 at = strstr(at + 2, "{}")) {
+                bytes += valueLength;
+            }
+        }
+        if (arenaReserve(&commandArgs, bytes) != 0) {
+            raise(SIGUSR1);
+            break;
+        }
+
+        // children must not read the script or the values from our stdin
+        UserInputStruct stage = {0};
+        stage.inputDestination_ptr = "/dev/null";
+        stage.argv =
+            arenaAlloc(&commandArgs, (templateLength + 2) * sizeof(char *));
+        stage.checkSum = 1;
+        for (size_t t = 0; t < templateLength; t++) {
+            const char *word = userInput.argv[templateStart + t];
+            char *arg = commandArgs.base + commandArgs.used;
+            size_t length = 0;
+            for (const char *at = word; *at != '\0';) {
+                if (at[0] == '{' && at[1] == '}') {
+                    memcpy(arg + length, value, valueLength);
+                    length += valueLength;
+                    at += 2;
+                } else {
+                    arg[length++] = *at++;
+                }
+            }
+            arg[length] = '\0';
+            commandArgs.used += length + 1;
+            stage.argv[stage.argc++] = arg;
+        }
+        if (!substitutes) {
+            stage.argv[stage.argc++] = (char *)value;
+        }
+        stage.argv[stage.argc] = NULL;
+
+        if (schedulerStart(&scheduler, stage) != 0) {
+            break;
+        }
+    }
+    if (ready) {
+        schedulerFinish(&scheduler);
+    }
+    usageSetWall(&scheduler.usage, &start);
+    lastUsage = scheduler.usage;
+    usageMerge(&timedUsage, &scheduler.usage);
+
+    // summary of the failures, in the order of the values
+    for (size_t t = 0; t < scheduler.nTasks; t++) {
+        int status = scheduler.statuses[t];
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "parallel: %s: ", values[t]);
+            printStatus(stderr, status);
+            fprintf(stderr, "\n");
+        }
+    }
+    if (scheduler.nFailed > 0) {
+        fprintf(stderr, "parallel: %zu of %zu jobs failed\n",
+                scheduler.nFailed, scheduler.nTasks);
+    }
+    if (nStarted < nValues) {
+        fprintf(stderr, "parallel: %zu jobs not started\n",
+                nValues - nStarted);
+    }
+    fflush(stderr);
+
+    if (eventLoop.interrupted) {
+        currentStatus = W_EXITCODE(128 + SIGINT, 0);
+        eventLoop.interrupted = 0;
+    } else {
+        currentStatus = W_EXITCODE(
+            scheduler.nFailed > 101 ? 101 : (int)scheduler.nFailed, 0);
+    }
+
+    free(scheduler.statuses);
+    free(commandArgs.base);
+    free(fileContents);
+    free(fileValues);
+    if (outputFd != STDOUT_FILENO) {
+        close(outputFd);
+    }
+}
+
+/*******************************************************************************
+ * xargsBuiltin()
+ *
+ *  Description:
+ *      xargs [-0] [-n N] [-P N] command [arg ...] [< file] [> file]
+ *
+ *      Runs command with the items read from file, a here-doc or stdin
+ *      appended, as many per command as fit in ARG_MAX once the environment
+ *      and 2048 bytes of headroom are taken off, or N with -n. Stdin is only
+ *      read when it is not the script; otherwise the status is 2. Items are
+ *      separated by blanks and newlines, or by NULs with -0. With -P, N
+ *      commands (0: one per online CPU) run at once through the scheduler,
+ *      their outputs printed whole in order. The status is 0 if every
+ *      command succeeded, 125 if one was killed by a signal and 123 if one
+ *      failed otherwise. Other options are left to the xargs on $PATH.
+ *
+ *  Inputs:
+ *      UserInputStruct userInput
+ *      const char *commandLine - run as it is when an option is unknown
+ ******************************************************************************/
+void xargsBuiltin(UserInputStruct userInput, const char *commandLine) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long maxRunning = 1;
+    long maxItems = 0;
+    int nulSeparated = 0;
+    size_t i = 1;
+
+    for (; userInput.argv[i] != NULL && userInput.argv[i][0] == '-'; i++) {
+        const char *option = userInput.argv[i];
+        if (strcmp(option, "-0") == 0) {
+            nulSeparated = 1;
+            continue;
+        }
+        if ((strcmp(option, "-n") != 0 && strcmp(option, "-P") != 0) ||
+            userInput.argv[i + 1] == NULL) {
+            launchCommand(userInput, commandLine);
+            return;
+        }
+        char *end = NULL;
+        long value = strtol(userInput.argv[++i], &end, 10);
+        if (*end != '\0' || end == userInput.argv[i] || value < 0 ||
+            (option[1] == 'n' && value == 0)) {
+            fprintf(stderr, "xargs: %s %s: invalid number\n", option,
+                    userInput.argv[i]);
+            fflush(stderr);
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+        if (option[1] == 'n') {
+            maxItems = value;
+        } else {
+            maxRunning = value == 0 ? sysconf(_SC_NPROCESSORS_ONLN) : value;
+        }
+    }
+    size_t templateStart = i;
+    size_t templateLength = userInput.argc - templateStart;
+    if (templateLength == 0) {
+        fprintf(stderr, "usage: xargs [-0] [-n N] [-P N] command [arg ...]\n");
+        fflush(stderr);
+        currentStatus = W_EXITCODE(2, 0);
+        return;
+    }
+
+    size_t length;
+    char *contents = readAllInput(userInput, &length);
+    if (contents == NULL) {
+        return;
+    }
+    char **items = malloc((length / 2 + 1) * sizeof(char *));
+    size_t *itemLengths = malloc((length / 2 + 1) * sizeof(size_t));
+    if (items == NULL || itemLengths == NULL) {
+        raise(SIGUSR1);
+        free(contents);
+        free(items);
+        free(itemLengths);
+        return;
+    }
+    size_t nItems = 0;
+    for (size_t at = 0; at < length;) {
+        size_t end = at;
+        if (nulSeparated) {
+            end += strlen(contents + at);
+        } else {
+            end += strcspn(contents + at, " \t\n");
+        }
+        if (end > at && contents[at] != '\0') {
+            contents[end] = '\0';
+            items[nItems] = contents + at;
+            itemLengths[nItems++] = end - at;
+        }
+        at = end + 1;
+    }
+
+    int outputFd = STDOUT_FILENO;
+    if (userInput.outputDestination_ptr != NULL) {
+        outputFd = open(userInput.outputDestination_ptr,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (outputFd < 0) {
+            fprintf(stderr, "Can not open file for output redirection\n");
+            fflush(stderr);
+            free(contents);
+            free(items);
+            free(itemLengths);
+            currentStatus = W_EXITCODE(2, 0);
+            return;
+        }
+    }
+
+    // execve() counts every string and its pointer against ARG_MAX,
+    // environment included
+    long argMax = sysconf(_SC_ARG_MAX);
+    size_t room = argMax > 0 ? (size_t)argMax : _POSIX_ARG_MAX;
+    size_t used = 2048 + sizeof(char *);
+    for (char **variable = environ; *variable != NULL; variable++) {
+        used += strlen(*variable) + 1 + sizeof(char *);
+    }
+    for (size_t t = 0; t < templateLength; t++) {
+        used += strlen(userInput.argv[templateStart + t]) + 1 + sizeof(char *);
+    }
+    room = room > used + _POSIX_ARG_MAX ? room - used : _POSIX_ARG_MAX;
 
-            if (expansion_str != NULL) {
-                // expansion perfomed
-                free(temp_str);
-                temp_str = expansion_str;
-            }
+    Scheduler scheduler;
+    if (maxRunning < 1) {
+        maxRunning = 1;
+    }
+    int ready = schedulerInit(&scheduler, (size_t)maxRunning, 1, outputFd) == 0;
+    if (!ready) {
+        raise(SIGUSR1);
+    }
 
-            // attempt to allocate space for input string
-            userInputString = calloc(strlen(temp_str) + 1, sizeof(char));
-            if (userInputString == NULL) {
-                free(userInputString);
-                raise(SIGUSR1);
-                return NULL;
+    // like other xargs, the command runs once even without any item
+    Arena batchArgs = {0};
+    size_t next = 0;
+    while (ready) {
+        size_t count = 0;
+        size_t bytes = 0;
+        while (next + count < nItems &&
+               (maxItems == 0 || count < (size_t)maxItems)) {
+            size_t cost = itemLengths[next + count] + 1 + sizeof(char *);
+            if (count > 0 && bytes + cost > room) {
+                break;
             }
+            bytes += cost;
+            count++;
+        }
+        if (arenaReserve(&batchArgs,
+                         (templateLength + count + 1) * sizeof(char *)) != 0) {
+            raise(SIGUSR1);
+            break;
+        }
 
-            strcpy(userInputString, temp_str);
-            free(temp_str);
+        // the commands must not read our stdin
+        UserInputStruct stage = {0};
+        stage.inputDestination_ptr = "/dev/null";
+        stage.argv = arenaAlloc(&batchArgs,
+                                (templateLength + count + 1) * sizeof(char *));
+        stage.checkSum = 1;
+        memcpy(stage.argv, userInput.argv + templateStart,
+               templateLength * sizeof(char *));
+        memcpy(stage.argv + templateLength, items + next,
+               count * sizeof(char *));
+        stage.argc = templateLength + count;
+        stage.argv[stage.argc] = NULL;
 
-            return userInputString;
-        } else if (nRead < 1) {
-            free(userInputString);
-            clearerr(stdin);
-            return NULL;
-        } else {
+        if (schedulerStart(&scheduler, stage) != 0) {
+            break;
+        }
+        next += count;
+        if (next == nItems) {
+            break;
+        }
+    }
+    if (ready) {
+        schedulerFinish(&scheduler);
+    }
+    usageSetWall(&scheduler.usage, &start);
+    lastUsage = scheduler.usage;
+    usageMerge(&timedUsage, &scheduler.usage);
 
-            free(temp_str);
-            // user entered nothing, reprompt
+    int failed = 0;
+    int killed = 0;
+    for (size_t t = 0; t < scheduler.nTasks; t++) {
+        int status = scheduler.statuses[t];
+        if (WIFSIGNALED(status)) {
+            killed = 1;
+        } else if (WEXITSTATUS(status) != 0) {
+            failed = 1;
         }
     }
+    if (eventLoop.interrupted) {
+        currentStatus = W_EXITCODE(128 + SIGINT, 0);
+        eventLoop.interrupted = 0;
+    } else {
+        currentStatus = W_EXITCODE(killed ? 125 : failed ? 123 : 0, 0);
+    }
+
+    free(scheduler.statuses);
+    free(batchArgs.base);
+    free(contents);
+    free(items);
+    free(itemLengths);
+    if (outputFd != STDOUT_FILENO) {
+        close(outputFd);
+    }
 }
 
-/*******************************************************************************
- * parseToken()
- *  Description:
- *      Recursively parses tokens out of the original input string and populates
- *      the non-argument attributes of the UserInputStruct.
+/******************************************************************************
+ * Server
  *
- *      Counts and sets argc so that the calling function can create argv[];
+ * smallsh --server path listens on a UNIX domain socket of type
+ * SOCK_SEQPACKET at path and runs the command lines it receives, so a job
+ * runner pays for one round trip per command instead of starting a shell.
+ * The protocol, one message each way per command:
  *
- *  Inputs:
- *      UserInputStruct userInput
- *      char* token
- *      size_t* argc
+ *  request - the command line, with an optional trailing newline, in one
+ *            message of at most SERVER_REQUEST_MAX bytes. Variables are
+ *            expanded and the line is parsed like a line of a script,
+ *            except that here-docs are not available. One fd may be passed
+ *            with SCM_RIGHTS to become the stdin of the first stage,
+ *            otherwise stdin is /dev/null.
+ *  reply   - a struct ServerReply in host byte order, sent once the whole
+ *            pipeline has exited, with two fds passed with SCM_RIGHTS: a
+ *            memfd holding the command's stdout and one holding its stderr,
+ *            both rewound. The fds are missing if the memfds could not be
+ *            created, in which case the output went to the server's own.
  *
- *  Outputs:
- *      Allocates a pointer for, and sets the value of argc
- *      parses < , > , & out of the token array and builds the userInput struct
+ * A client sends its next request after reading the reply, but any number
+ * of clients may be connected, and their commands run concurrently. The
+ * children are watched through pidfds in an epoll instance of the server's
+ * own which also holds the listening socket, every connection and the
+ * shell's signalfd. Only echo, printf, test, [, true, false and pwd run
+ * as builtins. ctrl^c, ctrl^\ or SIGTERM stop the server: it stops
+ * accepting, sends SIGTERM to the commands still running, replies for them
+ * and removes the socket.
+ ******************************************************************************/
+#define SERVER_REQUEST_MAX (64 * 1024)
+
+/*******************************************************************************
+ * serverWatch()
+ *
+ *  Description:
+ *      Adds fd to the server's epoll instance with the given tag.
+ ******************************************************************************/
+int serverWatch(Server *server, int fd, int type, uint32_t value) {
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)type << 32) | value;
+    return epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*******************************************************************************
+ * serverDisconnect()
  *
+ *  Description:
+ *      Closes a connection and frees its slot. A command still running for
+ *      it is left to finish, its reply is dropped.
  ******************************************************************************/
-void parseToken(UserInputStruct userInput, char *token, size_t *argc) {
-    // lets take a look at the token
-    if (token == NULL) {
+void serverDisconnect(Server *server, ServerClient *client) {
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->socket, NULL);
+    if (client->busy) {
+        client->hungUp = 1;
         return;
     }
+    close(client->socket);
+    client->socket = -1;
+}
 
-    if (strcmp(token, "<") == 0) {
-        // get next token and set input destination
-        token = strtok(NULL, " ");
-
-        strcpy(userInput.inputDestination_ptr, token);
+/*******************************************************************************
+ * serverReply()
+ *
+ *  Description:
+ *      Sends the status, usage and captured outputs of the finished command
+ *      to its client, and starts listening for the client's next request.
+ ******************************************************************************/
+void serverReply(Server *server, ServerClient *client, size_t slot) {
+    usageSetWall(&client->usage, &client->start);
+    ServerReply reply = {0};
+    reply.status = client->status;
+    reply.exitCode = WIFSIGNALED(client->status)
+                         ? 128 + WTERMSIG(client->status)
+                         : WEXITSTATUS(client->status);
+    reply.wallNs = (int64_t)client->usage.wall.tv_sec * 1000000000 +
+                   client->usage.wall.tv_nsec;
+    reply.userUs = (int64_t)client->usage.user.tv_sec * 1000000 +
+                   client->usage.user.tv_usec;
+    reply.systemUs = (int64_t)client->usage.system.tv_sec * 1000000 +
+                     client->usage.system.tv_usec;
+    reply.maxRssKb = client->usage.maxRss;
 
-        // get next token and recurse
-        token = strtok(NULL, " ");
-        parseToken(userInput, token, argc);
-    } else if (strcmp(token, ">") == 0) {
-        // get next token and set output destination
-        token = strtok(NULL, " ");
+    struct iovec iov = {&reply, sizeof(reply)};
+    union {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (client->output >= 0 && client->error >= 0) {
+        int fds[2] = {client->output, client->error};
+        lseek(fds[0], 0, SEEK_SET);
+        lseek(fds[1], 0, SEEK_SET);
+        message.msg_control = control.buffer;
+        message.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    }
 
-        strcpy(userInput.outputDestination_ptr, token);
+    int sent = !client->hungUp &&
+               sendmsg(client->socket, &message, MSG_NOSIGNAL) >= 0;
+    if (client->output >= 0) {
+        close(client->output);
+    }
+    if (client->error >= 0) {
+        close(client->error);
+    }
+    client->output = -1;
+    client->error = -1;
+    client->busy = 0;
+    server->nBusy--;
 
-        // get next token and recurse
-        token = strtok(NULL, " ");
-        parseToken(userInput, token, argc);
-    } else if (strcmp(token, "&") == 0) {
-        // get next token and see if it's NULL, otherwise ignore
-        token = strtok(NULL, " ");
-        if (token == NULL) {
-            // User would like to run in background
-            if (!fgOnly) {
-                *userInput.runInBackground = 1;
-            }
-        } else {
-            // if the next token still contains text, ignore it and
-            // continue parsing the line
+    if (!sent) {
+        if (!client->hungUp) {
+            epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->socket, NULL);
+        }
+        close(client->socket);
+        client->socket = -1;
+        return;
+    }
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u64 = ((uint64_t)EVENT_REQUEST << 32) | (uint32_t)slot;
+    epoll_ctl(server->epollFd, EPOLL_CTL_MOD, client->socket, &event);
+}
 
-            parseToken(userInput, token, argc);
+/*******************************************************************************
+ * serverCollect()
+ *
+ *  Description:
+ *      Reaps whichever stages of a client's command have exited, and replies
+ *      once none is left.
+ ******************************************************************************/
+void serverCollect(Server *server, size_t slot) {
+    ServerClient *client = &server->clients[slot];
+    for (size_t i = 0; client->busy && i < client->nPids; i++) {
+        int childStatus;
+        struct rusage childUsage;
+        if (client->pids[i] <= 0 ||
+            wait4(client->pids[i], &childStatus, WNOHANG, &childUsage) <= 0) {
+            continue;
         }
-    } else {
-        //  item is command or arg, count it
-        *argc = *argc + (size_t)1;
+        usageAdd(&client->usage, &childUsage);
+        if (client->pids[i] == client->lastPid) {
+            client->status = childStatus;
+        }
+        if (client->pidfds[i] >= 0) {
+            epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->pidfds[i], NULL);
+            close(client->pidfds[i]);
+        }
+        client->pids[i] = -1;
+        client->nRunning--;
+    }
+    if (client->busy && client->nRunning == 0) {
+        serverReply(server, client, slot);
+    }
+}
 
-        // get next token and recurse
-        token = strtok(NULL, " ");
-        parseToken(userInput, token, argc);
+/*******************************************************************************
+ * serverRedirect()
+ *
+ *  Description:
+ *      Points the shell's stdin, stdout and stderr at the given fds, keeping
+ *      copies of the originals in saved. Children launched meanwhile
+ *      inherit them, and so do the shell's own error messages about them.
+ ******************************************************************************/
+void serverRedirect(const int fds[3], int saved[3]) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[i], i);
     }
 }
 
 /*******************************************************************************
- * getuserInputFromString()
+ * serverRestore()
  *
- * Inputs:
- *  char* userInputString
+ *  Description:
+ *      Undoes serverRedirect().
+ ******************************************************************************/
+void serverRestore(int saved[3]) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+    }
+}
+
+/*******************************************************************************
+ * serverRun()
  *
- * Outputs:
- *  Returns a UserInputStruct containing the necessary info to execute a
- *  command sent by the user.
+ *  Description:
+ *      Expands, parses and launches one command line for a client. Fast
+ *      builtins are replied to at once, anything else once its pipeline has
+ *      been reaped.
  *
+ *  Inputs:
+ *      Server *server
+ *      size_t slot     - of the client
+ *      char *line      - NUL terminated request
+ *      int input       - fd the client passed for stdin, or -1
  ******************************************************************************/
-UserInputStruct getuserInputFromString(char *userInputString) {
-
-    char *defaultDestination = "/dev/null";
+void serverRun(Server *server, size_t slot, char *line, int input) {
+    static InputSource expansion; // only its expansion buffer is used
+    ServerClient *client = &server->clients[slot];
+    clock_gettime(CLOCK_MONOTONIC, &client->start);
+    client->usage = (ResourceUsage){{0}};
+    client->busy = 1;
+    client->nPids = 0;
+    client->nRunning = 0;
+    client->lastPid = -1;
+    server->nBusy++;
+    // no more requests from this client until it has its reply
+    struct epoll_event event = {0};
+    event.data.u64 = ((uint64_t)EVENT_REQUEST << 32) | (uint32_t)slot;
+    epoll_ctl(server->epollFd, EPOLL_CTL_MOD, client->socket, &event);
 
-    // initialize the struct
-    UserInputStruct userInput;
-    userInput.argv = NULL;
-    userInput.inputDestination_ptr = NULL;
-    userInput.outputDestination_ptr = NULL;
-    userInput.runInBackground = NULL;
-
-    userInput.checkSum = malloc(sizeof(int));
-    // check to see if checksum allocated
-    if (userInput.checkSum == NULL) {
-        raise(SIGUSR1);
-        return userInput;
-    } else {
-        *userInput.checkSum = 0;
+    client->output = memfd_create("smallsh-stdout", MFD_CLOEXEC);
+    client->error = memfd_create("smallsh-stderr", MFD_CLOEXEC);
+    if (input < 0) {
+        input = open("/dev/null", O_RDONLY | O_CLOEXEC);
     }
+    int fds[3] = {input,
+                  client->output >= 0 ? client->output : STDOUT_FILENO,
+                  client->error >= 0 ? client->error : STDERR_FILENO};
+    int saved[3];
+    serverRedirect(fds, saved);
 
-    // attempt our first allocations
-    userInput.inputDestination_ptr =
-        calloc(strlen(defaultDestination) + (size_t)1, (size_t)1);
-    if (userInput.inputDestination_ptr == NULL) {
-        raise(SIGUSR1);
-        return userInput;
+    char *expanded = expandVariables(&expansion, line, 1);
+    UserInputStruct userInput = {0};
+    if (expanded != NULL) {
+        userInput = parseCommand(expanded, &commandArena);
     }
-
-    userInput.outputDestination_ptr =
-        calloc(strlen(defaultDestination) + (size_t)1, (size_t)1);
-    if (userInput.outputDestination_ptr == NULL) {
-        raise(SIGUSR1);
-        return userInput;
+    const char *problem = NULL;
+    if (expanded == NULL) {
+        problem = "Out of memory";
+    } else if (!userInput.checkSum) {
+        problem = "Syntax error: missing file name or command";
     }
-
-    userInput.runInBackground = malloc(sizeof(int));
-    if (userInput.runInBackground == NULL) {
-        raise(SIGUSR1);
-        return userInput;
+    size_t nStages = 0;
+    for (UserInputStruct *stage = &userInput; problem == NULL && stage != NULL;
+         stage = stage->next) {
+        if (stage->hereDocDelimiter_ptr != NULL) {
+            // the body would need more lines than the request holds
+            problem = "Here-docs are not available in server mode";
+        }
+        nStages++;
     }
+    // the pidfds share the pids allocation
+    if (nStages > client->pidsCapacity) {
+        pid_t *pids = realloc(client->pids, nStages * (sizeof(pid_t) +
+                                                       sizeof(int)));
+        if (pids == NULL) {
+            problem = "Out of memory";
+        } else {
+            client->pids = pids;
+            client->pidfds = (int *)(pids + nStages);
+            client->pidsCapacity = nStages;
+        }
+    }
+    client->pidfds = (int *)(client->pids + client->pidsCapacity);
 
-    strcpy(userInput.inputDestination_ptr, defaultDestination);
-    strcpy(userInput.outputDestination_ptr, defaultDestination);
-
-    *userInput.runInBackground = 0;
-
-    // let's build the arg array
-    userInput.argv = NULL;
+    enum FastBuiltin fastBuiltin;
+    if (problem != NULL) {
+        fprintf(stderr, "%s\n", problem);
+        client->status = W_EXITCODE(2, 0);
+    } else if (userInput.argc == 0) {
+        client->status = W_EXITCODE(0, 0);
+    } else if (userInput.next == NULL &&
+               (fastBuiltin = findFastBuiltin(userInput.argv[0])) !=
+                   FAST_NONE) {
+        runFastBuiltin(userInput, fastBuiltin);
+        client->status = currentStatus;
+    } else {
+        userInput.runInBackground = 0;
+        client->nPids = launchPipeline(userInput, client->pids);
+        client->lastPid =
+            client->nPids == nStages ? client->pids[nStages - 1] : -1;
+        client->status = currentStatus;
+    }
+    serverRestore(saved);
+    if (input >= 0) {
+        close(input);
+    }
+    arenaReset(&commandArena);
 
-    // allocate a second string to hold a copy of the input... for reasons...
-    char *inputString = calloc(strlen(userInputString) + 1, sizeof(char));
-    if (inputString == NULL) {
-        raise(SIGUSR1);
-        return userInput;
+    for (size_t i = 0; i < client->nPids; i++) {
+        client->pidfds[i] = -1;
+        if (client->pids[i] <= 0) {
+            continue;
+        }
+        client->nRunning++;
+        int pidfd = (int)syscall(SYS_pidfd_open, client->pids[i], 0);
+        if (pidfd >= 0 &&
+            serverWatch(server, pidfd, EVENT_CHILD, (uint32_t)slot) != 0) {
+            close(pidfd);
+            pidfd = -1;
+        }
+        client->pidfds[i] = pidfd;
     }
+    // without pidfds, or if nothing was started, this replies right away
+    serverCollect(server, slot);
+}
 
-    strcpy(inputString, userInputString);
+/*******************************************************************************
+ * serverRead()
+ *
+ *  Description:
+ *      Receives a request from a client, or notices that it hung up.
+ ******************************************************************************/
+void serverRead(Server *server, size_t slot) {
+    static char request[SERVER_REQUEST_MAX + 1];
+    ServerClient *client = &server->clients[slot];
 
-    char *token;
-    size_t argc = 0;
-    token = strtok(inputString, " ");
+    struct iovec iov = {request, SERVER_REQUEST_MAX};
+    union {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
 
-    // check to see that we got a non-empty token
-    if (token != NULL) {
-        parseToken(userInput, token, &argc);
+    if (client->busy) {
+        // only a hang up is reported while a command runs
+        serverDisconnect(server, client);
+        return;
     }
-
-    free(inputString);
-
-    userInput.argv =
-        malloc((argc + (size_t)1) *
-               (size_t)sizeof(char *)); // extra item for NULL pointer so we
-                                        // know we've hit the end of the array
-    if (userInput.argv == NULL) {
-        raise(SIGUSR1);
-        return userInput;
+    ssize_t length = recvmsg(client->socket, &message, MSG_CMSG_CLOEXEC);
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (length <= 0) {
+        serverDisconnect(server, client);
+        return;
     }
 
-    // loop through the string again to get the args:
-    for (size_t i = 0; i < argc; i++) {
-        token = NULL;
-        if (i == 0) {
-            // first time through the loop
-            token = strtok(userInputString, " ");
-        } else {
-            token = strtok(NULL, " ");
+    // the first fd passed is stdin, any others are not wanted
+    int input = -1;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET ||
+            header->cmsg_type != SCM_RIGHTS) {
+            continue;
         }
-
-        userInput.argv[i] =
-            calloc(strlen(token) + 1,
-                   sizeof(char)); // extra space for null terminator, use calloc
-                                  // so that memory space is initialized to \0
-        if (userInput.argv[i] == NULL) {
-            raise(SIGUSR1);
-            return userInput;
+        size_t nFds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nFds; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (input < 0) {
+                input = fd;
+            } else {
+                close(fd);
+            }
         }
-
-        // add the token to the array
-        strcpy(userInput.argv[i], token);
     }
 
-    // done processing args, append null pointer
-    userInput.argv[argc] = (void *)NULL;
+    if (message.msg_flags & MSG_TRUNC) {
+        // too long, run nothing and report it as the command's error
+        strcpy(request, "false");
+        length = 5;
+    }
+    if (length > 0 && request[length - 1] == '\n') {
+        length--;
+    }
+    request[length] = '\0';
+    serverRun(server, slot, request, input);
+}
 
-    // we made it through without returning early.
-    *userInput.checkSum = 1;
+/*******************************************************************************
+ * serverAccept()
+ *
+ *  Description:
+ *      Accepts the connections waiting on the listening socket.
+ ******************************************************************************/
+void serverAccept(Server *server) {
+    int fd;
+    while ((fd = accept4(server->listenFd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        size_t slot = 0;
+        while (slot < server->capacity && server->clients[slot].socket >= 0) {
+            slot++;
+        }
+        if (slot == server->capacity) {
+            size_t capacity = server->capacity == 0 ? 16 : server->capacity * 2;
+            ServerClient *clients =
+                realloc(server->clients, capacity * sizeof(ServerClient));
+            if (clients == NULL) {
+                close(fd);
+                continue;
+            }
+            memset(clients + server->capacity, 0,
+                   (capacity - server->capacity) * sizeof(ServerClient));
+            for (size_t i = server->capacity; i < capacity; i++) {
+                clients[i].socket = -1;
+            }
+            server->clients = clients;
+            server->capacity = capacity;
+        }
 
-    return userInput;
+        ServerClient *client = &server->clients[slot];
+        client->socket = fd;
+        client->busy = 0;
+        client->hungUp = 0;
+        client->output = -1;
+        client->error = -1;
+        if (serverWatch(server, fd, EVENT_REQUEST, (uint32_t)slot) != 0) {
+            close(fd);
+            client->socket = -1;
+        }
+    }
 }
 
 /*******************************************************************************
- * freeUserInput()
+ * serverMain()
  *
- * Purpose: attempts to free up allocated memory within the UserInputStruct.
- *
- * Inputs:
- *  UserInputStruct userInput
+ *  Description:
+ *      Runs smallsh --server path until it is told to stop and every
+ *      command it started has been replied to.
  *
+ *  Outputs:
+ *      Returns the shell's exit status.
  ******************************************************************************/
-void freeUserInput(UserInputStruct userInput) {
-    size_t i = 0;
+int serverMain(const char *path) {
+    Server server = {-1, -1, NULL, 0, 0};
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        fflush(stderr);
+        return 2;
+    }
+    strcpy(address.sun_path, path);
 
-    // free the argv contents
-    while (1) {
-        if (userInput.argv[i] != NULL) {
-            free(userInput.argv[i]);
-            i++;
-        } else {
-            break;
-        }
+    // a socket left behind by an earlier server is replaced
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    server.listenFd =
+        socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listenFd < 0 ||
+        bind(server.listenFd, (struct sockaddr *)&address, sizeof(address)) !=
+            0 ||
+        listen(server.listenFd, SOMAXCONN) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        fflush(stderr);
+        return 1;
     }
 
-    // free argv itself
-    free(userInput.argv);
+    // SIGTERM is how a job runner stops us, take it through the signalfd
+    sigset_t signals;
+    sigprocmask(SIG_BLOCK, NULL, &signals);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    signalfd(eventLoop.signalFd, &signals, 0);
 
-    // free the others
-    free(userInput.inputDestination_ptr);
-    free(userInput.outputDestination_ptr);
-    free(userInput.runInBackground);
-    free(userInput.checkSum);
-    return;
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epollFd < 0 ||
+        serverWatch(&server, server.listenFd, EVENT_ACCEPT, 0) != 0 ||
+        serverWatch(&server, eventLoop.signalFd, EVENT_SIGNAL, 0) != 0) {
+        fprintf(stderr, "epoll: %s\n", strerror(errno));
+        fflush(stderr);
+        unlink(path);
+        return 1;
+    }
+
+    int stopping = 0;
+    while (!stopping || server.nBusy > 0) {
+        struct epoll_event events[64];
+        int nEvents = epoll_wait(server.epollFd, events, 64, -1);
+        int sawSignal = 0;
+        for (int i = 0; i < nEvents; i++) {
+            int type = (int)(events[i].data.u64 >> 32);
+            size_t slot = (uint32_t)events[i].data.u64;
+            if (type == EVENT_ACCEPT) {
+                serverAccept(&server);
+            } else if (type == EVENT_REQUEST) {
+                serverRead(&server, slot);
+            } else if (type == EVENT_CHILD) {
+                // tagged with the client's slot rather than the pid
+                serverCollect(&server, slot);
+            } else if (type == EVENT_SIGNAL) {
+                sawSignal = 1;
+            }
+        }
+        if (!sawSignal) {
+            continue;
+        }
+
+        runEventLoop(0);
+        // children without a pidfd are only noticed through SIGCHLD
+        for (size_t i = 0; i < server.capacity; i++) {
+            if (server.clients[i].busy) {
+                serverCollect(&server, i);
+            }
+        }
+        if (!stopping && (quit || eventLoop.interrupted)) {
+            stopping = 1;
+            epoll_ctl(server.epollFd, EPOLL_CTL_DEL, server.listenFd, NULL);
+            close(server.listenFd);
+            unlink(path);
+            for (size_t i = 0; i < server.capacity; i++) {
+                ServerClient *client = &server.clients[i];
+                for (size_t j = 0; client->busy && j < client->nPids; j++) {
+                    if (client->pids[j] > 0) {
+                        kill(client->pids[j], SIGTERM);
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < server.capacity; i++) {
+        if (server.clients[i].socket >= 0) {
+            close(server.clients[i].socket);
+        }
+        free(server.clients[i].pids);
+    }
+    free(server.clients);
+    close(server.epollFd);
+    return 0;
 }
 
 /*******************************************************************************
  * main()
  *
  ******************************************************************************/
-int main() {
-    if (control_var) {
+int main(int argc, char *argv[]) {
+    InputSource input;
+    int inputFd = STDIN_FILENO;
+
+    // smallsh --server path serves command lines on a socket
+    if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        if (argc != 3) {
+            errx(2, "usage: smallsh --server socket");
+        }
+        if (setupEventLoop(-1) != 0) {
+            err(1, "event loop");
+        }
+        cacheShellPid();
+        zygotePoolStart();
+        int status = serverMain(argv[2]);
+        zygotePoolStop();
+        return status;
+    }
+
+    // smallsh -c string runs the string and smallsh script.sh the script,
+    // both in batch mode
+    int commandString = argc > 1 && strcmp(argv[1], "-c") == 0;
+    if (commandString) {
+        if (argc != 3) {
+            errx(2, "usage: smallsh -c command");
+        }
+        openStringSource(&input, argv[2]);
+    } else {
+        if (argc > 1) {
+            inputFd = open(argv[1], O_RDONLY | O_CLOEXEC);
+            if (inputFd < 0) {
+                err(1, "%s", argv[1]);
+            }
+        }
+        if (openInputSource(&input, inputFd) != 0) {
+            err(1, "input");
+        }
+        scriptOnStdin = inputFd == STDIN_FILENO && !input.interactive;
+    }
+    if (setupEventLoop(input.map == NULL ? input.fd : -1) != 0) {
+        err(1, "event loop");
+    }
+    cacheShellPid();
+    zygotePoolStart();
+    traceOpen();
+    if (input.interactive) {
+        historyOpen();
+    }
+
+    if (input.interactive && control_var) {
         fprintf(stdout,
                 "\nWelcome to smallsh\nPress ctrl^c to interrupt a process, "
                 "ctrl^z to toggle foreground-only mode, or ctrl^\\ to "
@@ -560,100 +7965,76 @@ int main() {
 
     // main execution loop
     while (!quit) {
-        // register event handlers
-        struct sigaction SIGINT_action = {{0}};
-        sigemptyset(&SIGINT_action.sa_mask);
-        SIGINT_action.sa_handler = SIG_IGN;
-
-        struct sigaction SIGTSTP_action = {{0}};
-        sigemptyset(&SIGTSTP_action.sa_mask);
-        SIGTSTP_action.sa_sigaction = handle_SIGTSTP;
-        SIGTSTP_action.sa_flags = SA_SIGINFO;
-
-        struct sigaction SIGUSR1_action = {{0}};
-        sigemptyset(&SIGUSR1_action.sa_mask);
-        SIGUSR1_action.sa_sigaction = handle_SIGUSR1;
-        SIGUSR1_action.sa_flags = SA_SIGINFO;
-
-        struct sigaction SIGQUIT_action = {{0}};
-        sigemptyset(&SIGQUIT_action.sa_mask);
-        SIGQUIT_action.sa_sigaction = handle_SIGQUIT;
-        SIGQUIT_action.sa_flags = SA_SIGINFO;
-
-        sigaction(SIGINT, &SIGINT_action, NULL);
-        sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-        sigaction(SIGUSR1, &SIGUSR1_action, NULL);
-        sigaction(SIGQUIT, &SIGQUIT_action, NULL);
-
         // Get input from the user
-        char *inputString = NULL;
-
-        inputString = getInputString();
+        char *inputString = getInputString(&input);
 
         if (inputString == NULL) {
-            fprintf(stdin,"\n");
-            clearerr(stdin);
+            if (input.atEof) {
+                // end of the batch script
+                break;
+            }
             continue;
         }
         // parse the input
-        UserInputStruct userInput;
-        while (1) {
-            userInput = getuserInputFromString(inputString);
-
-            /*****************************************************************
-             * TODO
-             * This validation logic should be looked at again to make sure
-             * it's clearing everything properly (i dont think it is from a
-             * quick sleep deprived glance)
-             *
-             * **************************************************************/
-            // validate the input in the order it was created
-            if (userInput.checkSum == NULL) {
-                fprintf(stderr, "Checksum allocation failed\n");
+        UserInputStruct userInput = parseCommand(inputString, &commandArena);
+        traceStamp(&trace.current.parse);
+        if (fgOnly) {
+            userInput.runInBackground = 0;
+        }
+
+        if (!userInput.checkSum) {
+            if (userInput.argv != NULL) {
+                fprintf(stderr,
+                        "Syntax error: missing file name or command\n");
                 fflush(stderr);
-            } else if (userInput.checkSum == 0) {
-                fprintf(stderr, "Input allocation failed ");
-                if (userInput.inputDestination_ptr == NULL) {
-                    fprintf(stderr, "...during input destination "
-                                    "allocation\n");
-                    fflush(stderr);
-                } else if (userInput.outputDestination_ptr == NULL) {
-                    fprintf(stderr, "...during output destination "
-                                    "allocation\n");
-                    fflush(stderr);
-                } else if (userInput.runInBackground == NULL) {
-                    fprintf(stderr, "...background boolean allocation\n");
-                    fflush(stderr);
-                } else if (userInput.argv == NULL) {
-                    fprintf(stderr, "...during pointer array "
-                                    "allocation\n");
-                    fflush(stderr);
-                } else {
+            }
+            arenaReset(&commandArena);
+            continue;
+        }
+        if (userInput.argc == 0) {
+            // nothing but operators
+            arenaReset(&commandArena);
+            continue;
+        }
+        if (readHereDocuments(&input, &userInput, &inputString) != 0) {
+            raise(SIGUSR1);
+            arenaReset(&commandArena);
+            continue;
+        }
 
-                    // check arguements.
-                    size_t i = 0;
-                    while (1) {
-                        if (userInput.argv[i] != NULL) {
-                            free(userInput.argv[i]);
-                            i++;
-                        } else {
-                            break;
-                        }
-                    }
+        enum FastBuiltin fastBuiltin;
 
-                    fprintf(stderr,
-                            "...during an argument "
-                            "allocation\n Read %zu args "
-                            "successfully before error.\n",
-                            i);
-                    fflush(stderr);
-                }
-            } else {
-                break;
-            }
+        // time command ... reports the cost of the rest of the line
+        int timed = strcmp(userInput.argv[0], "time") == 0;
+        struct timespec timedStart;
+        if (timed) {
+            userInput.argv++;
+            userInput.argc--;
+            timedUsage = (ResourceUsage){{0}};
+            clock_gettime(CLOCK_MONOTONIC, &timedStart);
         }
 
-        free(inputString);
+        // on CPUS, nice N and ionice CLASS ... place and prioritise the
+        // children of the rest of the line
+        launchPolicy =
+            userInput.runInBackground ? backgroundPolicy : noLaunchPolicy;
+        int nPrefixWords = 0;
+        if (userInput.argc > 0) {
+            nPrefixWords = parseLaunchPolicy(userInput.argv, &launchPolicy);
+        }
+        if (nPrefixWords < 0 || (nPrefixWords > 0 &&
+                                 userInput.argv[nPrefixWords] == NULL)) {
+            if (nPrefixWords > 0) {
+                fprintf(stderr, "%s: missing command\n", userInput.argv[0]);
+                fflush(stderr);
+            }
+            currentStatus = W_EXITCODE(1, 0);
+            launchPolicy = noLaunchPolicy;
+            arenaReset(&commandArena);
+            continue;
+        }
+        userInput.argv += nPrefixWords;
+        userInput.argc -= (size_t)nPrefixWords;
 
         // execute the input
 
@@ -663,7 +8044,12 @@ int main() {
          * and not in main
          *
          * **************************************************************/
-        if (strcmp(userInput.argv[0], "cd") == 0) {
+        if (userInput.argc == 0) {
+            // time on its own
+        } else if (userInput.next != NULL) {
+            // builtins only run on their own, pipelines are always exec'd
+            launchCommand(userInput, inputString);
+        } else if (strcmp(userInput.argv[0], "cd") == 0) {
             if (userInput.argv[1] == NULL) {
                 if (chdir(getenv("HOME")) != 0) {
                     fprintf(stderr, "Encountered an error "
@@ -688,174 +8074,93 @@ int main() {
                         WTERMSIG(currentStatus));
                 fflush(stdout);
             }
+            if (userInput.argv[1] != NULL &&
+                strcmp(userInput.argv[1], "-v") == 0) {
+                printUsage(stdout, &lastUsage);
+            }
 
             fflush(stdout);
+        } else if (strcmp(userInput.argv[0], "hash") == 0) {
+            hashBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "stats") == 0) {
+            statsBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "bgpolicy") == 0) {
+            bgpolicyBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "jobs") == 0) {
+            jobsBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "fg") == 0) {
+            fgBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "bg") == 0) {
+            bgBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "wait") == 0) {
+            waitBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "kill") == 0) {
+            killBuiltin(userInput);
+        } else if (strcmp(userInput.argv[0], "parallel") == 0) {
+            parallelBuiltin(userInput);
+        } else if (!userInput.runInBackground &&
+                   strcmp(userInput.argv[0], "xargs") == 0) {
+            xargsBuiltin(userInput, inputString);
         } else if (strcmp(userInput.argv[0], "exit") == 0 ||
                    strcmp(userInput.argv[0], "quit") == 0) {
-            raise(SIGQUIT);
+            quit = 1;
+        } else if (!userInput.runInBackground &&
+                   (fastBuiltin = findFastBuiltin(userInput.argv[0])) !=
+                       FAST_NONE) {
+            runFastBuiltin(userInput, fastBuiltin);
+        } else if (commandString && !userInput.runInBackground && !timed &&
+                   trace.fd < 0 && jobTable.nJobs == 0 &&
+                   inputExhausted(&input)) {
+            // the last command of smallsh -c replaces the shell
+            execCommand(userInput);
         } else {
             // else process command for exec
-            int childStatus;
-            int inputDestination;
-            int outputDestination;
-
-            // open redirection destinations
-            inputDestination =
-                open(userInput.inputDestination_ptr, O_RDONLY, 0444);
-            outputDestination = open(userInput.outputDestination_ptr,
-                                     O_WRONLY | O_CREAT | O_TRUNC, 0666);
-            // fork a new process
-            pid_t spawnPid = fork();
-
-            if (spawnPid < 0) {
-                fprintf(stderr, "fork(): ");
-                fflush(stderr);
-                freeUserInput(userInput);
-                close(inputDestination);
-                close(outputDestination);
-                exit(2);
-            } else if (spawnPid == 0) {
-                /**********************************
-                 * CHILD PROCESS
-                 *********************************/
-
-                // reregister signal handling
-                // fg child should respond to sigint
-                struct sigaction SIGINT_action_child_fg = {{0}};
-                sigemptyset(&SIGINT_action_child_fg.sa_mask);
-                SIGINT_action_child_fg.sa_handler = SIG_DFL;
-
-                // bg child should ignore
-                struct sigaction SIGINT_action_child_bg = {{0}};
-                sigemptyset(&SIGINT_action_child_bg.sa_mask);
-                SIGINT_action_child_bg.sa_handler = SIG_IGN;
-
-                // ignore everything else too
-                struct sigaction SIGCHLD_action_child = {{0}};
-                sigemptyset(&SIGCHLD_action_child.sa_mask);
-                SIGCHLD_action_child.sa_handler = SIG_IGN;
-
-                struct sigaction SIGTSTP_action_child = {{0}};
-                sigemptyset(&SIGTSTP_action_child.sa_mask);
-                SIGTSTP_action_child.sa_handler = SIG_IGN;
-
-                struct sigaction SIGUSR1_action_child = {{0}};
-                sigemptyset(&SIGUSR1_action_child.sa_mask);
-                SIGUSR1_action.sa_handler = SIG_IGN;
-
-                struct sigaction SIGQUIT_action_child = {{0}};
-                sigemptyset(&SIGQUIT_action_child.sa_mask);
-                SIGQUIT_action.sa_handler = SIG_IGN;
-
-                // check to see if files opened, kill the child if
-                // it failed
-                if (inputDestination < 0) {
-                    fprintf(stderr,
-                            "Can not open file for input redirection\n");
-                    fflush(stderr);
-                    freeUserInput(userInput);
-                    exit(2);
-                }
-                if (outputDestination < 0) {
-                    fprintf(stderr,
-                            "Can not open file for output redirection\n");
-                    fflush(stderr);
-                    close(inputDestination);
-                    freeUserInput(userInput);
-                    exit(2);
-                }
+            launchCommand(userInput, inputString);
+        }
 
-                if (*userInput.runInBackground) {
-                    /**********************************
-                     * BACKGROUND CHILD
-                     *********************************/
-                    // stdin/out should be redirected
-                    // regardless
-                    dup2(inputDestination, 0);
-                    dup2(outputDestination, 1);
-
-                    // set bg process to ignore SIGINT
-                    sigaction(SIGINT, &SIGINT_action_child_bg, NULL);
-                } else {
-                    /**********************************
-                     * FOREGROUND CHILD
-                     *********************************/
-                    // only redirect if the user chooses to
-                    if (strcmp(userInput.inputDestination_ptr, "/dev/null") !=
-                        0) {
-                        dup2(inputDestination, 0);
-                    }
-                    if (strcmp(userInput.outputDestination_ptr, "/dev/null") !=
-                        0) {
-                        dup2(outputDestination, 1);
-                    }
+        if (timed) {
+            usageSetWall(&timedUsage, &timedStart);
+            fflush(stdout);
+            printUsage(stderr, &timedUsage);
+            fflush(stderr);
+        }
 
-                    sigaction(SIGINT, &SIGINT_action_child_fg, NULL);
-                }
+        if (trace.fd >= 0 && trace.current.spawn == 0) {
+            // builtins are traced here, launched commands by launchCommand()
+            trace.current.reap = traceNow();
+            traceWrite(&trace.current, 0, currentStatus, NULL, inputString);
+        }
 
-                sigaction(SIGTSTP, &SIGTSTP_action_child, NULL);
-                sigaction(SIGCHLD, &SIGCHLD_action_child, NULL);
-                sigaction(SIGUSR1, &SIGUSR1_action_child, NULL);
-                sigaction(SIGQUIT, &SIGQUIT_action_child, NULL);
+        launchPolicy = noLaunchPolicy;
+        arenaReset(&commandArena);
+    }
 
-                execvp(userInput.argv[0], userInput.argv);
-                // exec only returns here if there is an error
-                fprintf(stdout, "Command not found or failed to execute\n");
-                fflush(stdout);
+    zygotePoolStop();
+    traceClose();
+    if (!input.interactive) {
+        // a script leaves its background jobs running, like sh. Signalling
+        // our process group here could reach whoever started the script.
+        fflush(stdout);
+        noticeFlush();
+        if (WIFSIGNALED(currentStatus)) {
+            return 128 + WTERMSIG(currentStatus);
+        }
+        return WEXITSTATUS(currentStatus);
+    }
 
-            } else {
-                /**********************************
-                 * PARENT PROCESS
-                 *********************************/
-                struct sigaction SIGCHLD_action = {{0}};
-                sigemptyset(&SIGCHLD_action.sa_mask);
-                SIGCHLD_action.sa_sigaction = handle_SIGCHLD;
-                SIGCHLD_action.sa_flags = SA_SIGINFO;
-                sigaction(SIGCHLD, &SIGCHLD_action, NULL);
-
-                if (*userInput.runInBackground) {
-
-                    fprintf(stdout, "Background process PID:(%d)\n", spawnPid);
-                    fflush(stdout);
-                } else {
-                    struct sigaction temp_act = {{0}};
-                    sigemptyset(&temp_act.sa_mask);
-
-                    // temporarily block sigtstp sigchld
-                    // sigusr1 sigquit
-                    sigaddset(&temp_act.sa_mask, SIGTSTP);
-                    sigaddset(&temp_act.sa_mask, SIGCHLD);
-                    sigaddset(&temp_act.sa_mask, SIGUSR1);
-                    sigaddset(&temp_act.sa_mask, SIGQUIT);
-
-                    sigprocmask(SIG_BLOCK, &temp_act.sa_mask, NULL);
-
-                    spawnPid = waitpid(spawnPid, &childStatus, 0);
-                    currentStatus = childStatus;
-                    if (WIFSIGNALED(currentStatus)) {
-                        fprintf(stdout, "terminated by signal %d\n",
-                                WTERMSIG(currentStatus));
-                    }
+    noticeFlush();
 
-                    sigprocmask(SIG_UNBLOCK, &temp_act.sa_mask, NULL);
-                }
+    // kill children
+    for (size_t i = 0; i < jobTable.capacity; i++) {
+        if (jobTable.jobs[i].inUse) {
+            signalJob((int)i, SIGTERM);
+            if (jobTable.jobs[i].state == JOB_STOPPED) {
+                signalJob((int)i, SIGCONT);
             }
-
-            close(inputDestination);
-            close(outputDestination);
         }
-
-        freeUserInput(userInput);
     }
 
-    struct sigaction temp_action = {{0}};
-    sigemptyset(&temp_action.sa_mask);
-    sigaddset(&temp_action.sa_mask, SIGTERM);
-    sigprocmask(SIG_BLOCK, &temp_action.sa_mask, NULL);
-    // kill children
-    kill(0, SIGTERM);
-
-    int childStatus = NULL;
+    int childStatus = 0;
     pid_t pid = wait(&childStatus);
     while (pid > 0) {
         // wait for child processes to finish
@@ -872,5 +8177,5 @@ int main() {
 
     fprintf(stdout, "\n\nThank you for using smallsh\n");
     fflush(stdout);
-    sigprocmask(SIG_UNBLOCK, &temp_action.sa_mask, NULL);
+    return 0;
 }
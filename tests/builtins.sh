@@ -0,0 +1,30 @@
+# builtins run inside the shell, anything else is looked up in PATH
+cd /
+pwd
+cd no/such/dir
+echo -n no newline
+echo
+echo -e "tab\there" -E
+echo -E "tab\there"
+echo -ne "a\nb\n"
+echo -x
+printf "%s=%d|%05.1f|%x|%c\n" n 42 3.14159 255 z
+printf "%b\n" "tab\tb"
+test 1 -lt 2
+status
+[ abc = abd ]
+status
+test 1 -eq x
+status
+[ 1 -eq 1
+status
+test -d /
+status
+true
+status
+false
+status
+bogus-command-xyz
+status
+exit
+echo not reached
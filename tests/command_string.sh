@@ -0,0 +1,18 @@
+# smallsh -c runs a string and exits with the status of its last command
+$SMALLSH -c "echo from -c"
+$SMALLSH -c "echo one | tr a-z A-Z"
+$SMALLSH -c "sh -c 'exit 7'"
+status
+$SMALLSH -c "cd /"
+$SMALLSH -c false
+status
+$SMALLSH -c 'echo $TESTOP'
+# the last command replaces the shell, so its pid is the shell's
+$SMALLSH -c 'sh -c "test $$ = \$\$ && echo exec in place"'
+$SMALLSH -c
+status
+# a SIGINT ignored by whoever started the shell stays ignored after the exec
+sh <<EOF
+trap '' INT
+exec "$SMALLSH" -c 'sh -c "kill -INT \$\$; echo SIGINT stayed ignored"'
+EOF
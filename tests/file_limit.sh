@@ -0,0 +1,10 @@
+# commands keep the shell's open file limit, even once many & jobs have made
+# the shell raise its own for their pidfds
+seq 100 | sed "s/.*/sleep 1 \&/" > start-jobs
+cat > check-limit <<EOF
+sh -c "ulimit -Sn" > limit
+wait
+EOF
+cat start-jobs check-limit > script
+sh -c 'ulimit -Sn 90 && exec "$SMALLSH" script' > /dev/null
+cat limit
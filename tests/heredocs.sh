@@ -0,0 +1,18 @@
+# here-docs end at their delimiter, here-strings are one line of stdin
+cat <<EOF
+home is $HOME
+  indented line
+EOF
+cat << END | tr a-z A-Z
+piped here-doc
+END
+cat <<EOF > saved
+kept in a file
+EOF
+cat saved
+cat <<<here-string
+tr a-z A-Z <<<shout
+wc -l <<<one
+cat <<
+cat <<EOF
+never closed
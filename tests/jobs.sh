@@ -0,0 +1,29 @@
+# background jobs report when they are done and wait collects their status
+false &
+wait %1
+status
+sleep 5 &
+jobs
+kill %1
+wait %1
+status
+sleep 0.5 &
+wait
+status
+jobs
+# a finished job leaves the table once it is reported, its status can still
+# be collected once and its id is reused
+sh -c "exit 3" &
+sleep 0.2
+jobs
+wait %1
+status
+wait %1
+status
+sleep 0.1 &
+wait %1
+kill %1
+fg %9
+bg %9
+status
+fg
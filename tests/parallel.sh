@@ -0,0 +1,15 @@
+# parallel runs a command per value and prints each output whole
+parallel -k echo item ::: a b c d
+parallel -k -j 2 echo {}-{} ::: x y
+parallel -j 1 sh -c ::: false true false
+status
+seq 3 > list
+parallel -k echo line < list
+parallel -k echo saved ::: 1 2 > out
+cat out
+parallel -j 0 sleep ::: 0.1 0.1 0.1
+status
+parallel -j x echo ::: a
+status
+parallel echo
+status
@@ -0,0 +1,13 @@
+# repeated lines are parsed once, and the cache is keyed on the expanded text
+stats -r
+echo one
+echo one
+echo one
+echo two
+stats
+false
+echo $?
+true
+echo $?
+stats -r
+stats
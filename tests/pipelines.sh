@@ -0,0 +1,12 @@
+# pipelines connect the stages directly and report the last stage's status
+seq 3 | sort -r | head -n 2
+echo one two three | wc -w
+false | true
+status
+true | false
+status
+seq 5 | tr 1-5 a-e | tail -n 1 > piped
+cat piped
+# an empty stage is a syntax error
+echo a | | cat
+echo a |
@@ -0,0 +1,28 @@
+# on, nice and ionice set the CPUs, nice value and I/O class of a command
+on 0 grep Cpus_allowed_list: /proc/self/status
+on 0-0 nice 4 grep Cpus_allowed_list: /proc/self/status
+nice
+nice 5 nice
+ionice idle ionice
+ionice be:3 ionice
+nice 2 ionice idle ionice
+time nice 1 nice
+# & jobs start from the bgpolicy
+bgpolicy
+bgpolicy nice 3 ionice idle
+bgpolicy
+nice > bg-nice &
+wait %1
+cat bg-nice
+nice 1 ionice > bg-ionice &
+wait %1
+cat bg-ionice
+bgpolicy none
+bgpolicy
+on x true
+status
+on 99999 true
+status
+ionice idle
+bgpolicy bogus
+status
@@ -0,0 +1,16 @@
+# quotes and backslashes group words and make operators plain text
+printf "[%s]\n" 'a b' "c d" e\ f 'it'"'"'s' "x\"y" "a\\b" 'a\b'
+echo '$HOME' "$HOME" \$HOME $HOME
+printf "[%s]\n" '' "" x
+echo "<" '|' "&" '>' \# "#"
+printf "[%s]\n" $TESTVAR
+printf "[%s]\n" "$TESTVAR"
+# operators inside a variable stay arguments
+printf "[%s]\n" $TESTOP
+printf "[%s]\n" "$TESTOP"
+# and so do quotes, backslashes and here-doc markers
+printf "[%s]\n" $TESTQUOTE
+printf "[%s]\n" "$TESTQUOTE"
+printf "[%s]\n"	tab	separated
+echo "unterminated
+echo 'unterminated
@@ -0,0 +1,14 @@
+# < and > replace stdin and stdout, the last one of each wins
+echo first > out
+cat out
+echo second > ignored > out
+cat out
+cat < out
+wc -c < out > count
+cat count
+cat < missing
+status
+echo x > no/such/dir
+status
+echo x >
+status
@@ -0,0 +1,43 @@
+#!/bin/sh
+# run.sh - runs every tests/*.sh through smallsh in batch mode, in a fresh
+# directory each, and compares what it prints on stdout and stderr with the
+# matching tests/*.out. The pids in job notices and listings, and the
+# figures in time reports, are replaced by N.
+#
+# Usage: tests/run.sh [smallsh]      - exits 1 if any test failed
+
+cd "$(dirname "$0")" || exit 2
+tests=$(pwd)
+SMALLSH=$(cd .. && pwd)/smallsh
+[ -n "$1" ] && SMALLSH=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+TESTS=$tests
+export SMALLSH TESTS
+
+# a fixed environment for the variables the tests expand
+HOME=/home/smallsh-test
+TESTVAR='two words'
+TESTOP='a > b | c & < d'
+TESTQUOTE='say "hi" it'"'"'s a\b <<EOF'
+export HOME TESTVAR TESTOP TESTQUOTE
+unset SMALLSH_ZYGOTES SMALLSH_TRACE
+
+work=$(mktemp -d) || exit 2
+trap 'rm -rf "$work"' EXIT
+
+failed=0
+for script in "$tests"/*.sh; do
+    name=$(basename "$script" .sh)
+    [ "$name" = run ] && continue
+    mkdir "$work/$name"
+    (cd "$work/$name" && "$SMALLSH" "$script" 2>&1 </dev/null) |
+        sed -e '/Background process/s/([0-9][0-9]*)/(N)/' \
+            -e 's/^\(\[[0-9]*\]\) [0-9][0-9]* /\1 N /' \
+            -e '/^real [0-9]/s/[0-9][0-9.]*/N/g' >"$work/$name.actual"
+    if diff -u "$tests/$name.out" "$work/$name.actual"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        failed=1
+    fi
+done
+exit $failed
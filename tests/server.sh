@@ -0,0 +1,19 @@
+# --server runs the lines clients send and passes back their outputs
+$SMALLSH --server sock &
+echo some input > input
+$TESTS/server_client sock <<EOF
+echo hello
+ls no-such-file-here
+false
+echo one two | wc -w
+sleep 0.1 | true
+cat <<END
+EOF
+$TESTS/server_client sock input <<EOF
+cat
+wc -c
+EOF
+kill %1
+wait %1
+test -e sock
+status
@@ -0,0 +1,143 @@
+/*******************************************************************************
+ * server_client.c
+ *
+ *  Description:
+ *      A client for smallsh --server used by tests/server.sh. It sends each
+ *      line of its stdin to the server as one request and prints the
+ *      command's captured stdout and stderr, in that order, followed by its
+ *      exit code. The shell is compiled in for the ServerReply layout.
+ *
+ *  Usage:
+ *      tests/server_client socket [input] < requests
+ *                              - input, when given, is passed as the stdin
+ *                                of every command
+ ******************************************************************************/
+
+#define main smallsh_main
+#include "../smallsh.c"
+#undef main
+
+/*******************************************************************************
+ * connectServer()
+ *
+ *  Description:
+ *      Connects to the socket at path, retrying for up to two seconds while
+ *      the server is still starting.
+ ******************************************************************************/
+static int connectServer(const char *path) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errx(2, "%s: path too long", path);
+    }
+    strcpy(address.sun_path, path);
+
+    for (int attempt = 0; attempt < 200; attempt++) {
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            err(2, "socket");
+        }
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    err(2, "connect %s", path);
+}
+
+/*******************************************************************************
+ * copyOutput()
+ *
+ *  Description:
+ *      Copies a captured output passed back by the server to fd and closes
+ *      it.
+ ******************************************************************************/
+static void copyOutput(int from, int fd) {
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(from, buffer, sizeof(buffer))) > 0) {
+        if (write(fd, buffer, (size_t)length) != length) {
+            err(2, "write");
+        }
+    }
+    close(from);
+}
+
+/*******************************************************************************
+ * request()
+ *
+ *  Description:
+ *      Runs one command line on the server and prints what it replied.
+ ******************************************************************************/
+static void request(int server, const char *line, int input) {
+    struct iovec iov = {(void *)line, strlen(line)};
+    union {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (input >= 0) {
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(sizeof(int));
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &input, sizeof(int));
+    }
+    if (sendmsg(server, &message, MSG_NOSIGNAL) < 0) {
+        err(2, "sendmsg");
+    }
+
+    ServerReply reply;
+    iov.iov_base = &reply;
+    iov.iov_len = sizeof(reply);
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    ssize_t length = recvmsg(server, &message, MSG_CMSG_CLOEXEC);
+    if (length != (ssize_t)sizeof(reply)) {
+        errx(2, "%s: no reply", line);
+    }
+
+    int fds[2] = {-1, -1};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header != NULL && header->cmsg_type == SCM_RIGHTS &&
+        header->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(header), sizeof(fds));
+        copyOutput(fds[0], STDOUT_FILENO);
+        copyOutput(fds[1], STDOUT_FILENO);
+    }
+    printf("exit code %d\n", (int)reply.exitCode);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: server_client socket [input] < requests\n");
+        return 2;
+    }
+    int server = connectServer(argv[1]);
+    int input = -1;
+    if (argc == 3 && (input = open(argv[2], O_RDONLY | O_CLOEXEC)) < 0) {
+        err(2, "%s", argv[2]);
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, stdin)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+        if (input >= 0) {
+            lseek(input, 0, SEEK_SET);
+        }
+        request(server, line, input);
+    }
+    free(line);
+    close(server);
+    return 0;
+}
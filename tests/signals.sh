@@ -0,0 +1,22 @@
+# commands start with no signals blocked, whichever way they are launched
+grep SigBlk /proc/self/status
+grep SigBlk /proc/self/status > bg-mask &
+wait %1
+cat bg-mask
+nice 1 grep SigBlk /proc/self/status
+env SMALLSH_ZYGOTES=2 $SMALLSH <<EOF
+sleep 0.1
+grep SigBlk /proc/self/status
+EOF
+# the shell ignores SIGINT and SIGTSTP itself, but only bg children keep SIGINT
+# ignored: 524288 is SIGTSTP alone, 524290 adds SIGINT
+sh -c 'echo $((0x$(sed -n "s/SigIgn:.//p" /proc/$$/status) & 0x80002))'
+sh -c 'echo $((0x$(sed -n "s/SigIgn:.//p" /proc/$$/status) & 0x80002))' > ign &
+wait %1
+cat ign
+# and still sees a SIGINT sent to it
+sleep 5 &
+sh -c 'sleep 0.2; kill -INT $PPID' &
+wait %1
+echo $?
+kill %1
@@ -0,0 +1,11 @@
+# time reports wall, user and system time and peak memory on stderr
+time sleep 0.1
+time false
+status
+status -v
+time seq 3 | wc -l
+sleep 0.1 &
+wait
+status -v
+time
+time cd /
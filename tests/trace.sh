@@ -0,0 +1,15 @@
+# SMALLSH_TRACE appends a JSON line per command, with the times and pid of
+# each step
+env SMALLSH_TRACE=trace $SMALLSH <<EOF
+echo one
+false
+seq 2 | wc -l
+sleep 0.1 &
+wait
+EOF
+cut -d, -f1,9,10,14 trace
+# only commands that were launched have a spawn time
+grep -c spawn.:null trace
+env SMALLSH_TRACE=no/such/dir/trace $SMALLSH <<EOF
+echo still runs
+EOF
@@ -0,0 +1,14 @@
+# $$, $?, $!, $NAME and ${NAME} are expanded before the line is parsed
+echo $HOME ${HOME}/file $HOME.d
+echo [$TESTVAR]
+echo [$NO_SUCH_VARIABLE] [${NO_SUCH_VARIABLE}]
+false
+echo $?
+sleep 5 &
+kill $!
+wait
+echo $?
+echo $$ > pid
+test -s pid
+status
+echo cost: $ 5 $
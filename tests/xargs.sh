@@ -0,0 +1,31 @@
+# xargs appends the items of its input to the command, packing as many as fit
+seq 5 > items
+xargs echo < items
+xargs -n 2 echo got < items
+xargs -n 2 -P 3 echo batch < items | sort
+xargs echo <<EOF
+one two   three
+  four
+EOF
+echo -n "a b:c d:" | tr : "\0" > nul-items
+xargs -0 -n 1 echo < nul-items
+seq 100000 > many
+xargs echo < many | wc -w
+xargs -n 1000 echo < many | wc -l
+xargs env false < items
+status
+xargs echo < missing
+status
+xargs -n x echo < items
+status
+# stdin is only read when the script does not come from it
+echo xargs echo got > items-script
+cat > stdin-script <<EOF
+xargs echo got
+status
+echo the rest of the script still runs
+EOF
+$SMALLSH < stdin-script
+cat stdin-script | $SMALLSH
+echo a b | $SMALLSH -c "xargs echo got"
+echo a b | $SMALLSH items-script
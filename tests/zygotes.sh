@@ -0,0 +1,19 @@
+# with SMALLSH_ZYGOTES set, commands are launched through pre-forked zygotes
+# and the pool is refilled after each launch
+env SMALLSH_ZYGOTES=4 $SMALLSH <<EOF | sed -e /^parse/d -e s/,.*launches.*//
+echo one | tr a-z A-Z
+cd /
+pwd
+env false
+status
+no-such-command-xyz
+status
+sleep 5 &
+kill %1
+wait %1
+echo two > out
+cat out
+echo three | tr a-z A-Z | tr T t
+sleep 0.3
+stats
+EOF